@@ -0,0 +1,106 @@
+#include "band_pool.h"
+
+#include <algorithm>
+#include <cassert>
+
+CBandPool::CWorker::CWorker(CBandPool* pool)
+    : m_pool(pool)
+    , m_wake(false, false)
+    , m_handle()
+    , m_started(false)
+{
+    assert(pool);
+}
+
+CBandPool::CWorker::~CWorker()
+{
+    if (m_started)
+    {
+        m_wake.Signal();
+        PlatformThread::Join(m_handle);
+    }
+}
+
+bool CBandPool::CWorker::Start()
+{
+    m_started = PlatformThread::Create(0, this, &m_handle);
+    return m_started;
+}
+
+void CBandPool::CWorker::ThreadMain()
+{
+    PlatformThread::SetName("Band worker");
+    while (true)
+    {
+        m_wake.Wait();
+        if (m_pool->m_stopping)
+            return;
+
+        m_pool->runBands();
+
+        // Run() waits for every worker it woke, so none can see the job of
+        // the next call.
+        if (!base::subtle::Barrier_AtomicIncrement(&m_pool->m_busyWorkers, -1))
+            m_pool->m_done.Signal();
+    }
+}
+
+//------------------------------------------------------------------------------
+CBandPool::CBandPool(int threadCount)
+    : m_workers()
+    , m_job(NULL)
+    , m_bandCount(0)
+    , m_nextBand(0)
+    , m_busyWorkers(0)
+    , m_done(false, false)
+    , m_stopping(false)
+{
+    for (int i = 0; i < threadCount; ++i)
+    {
+        boost::shared_ptr<CWorker> worker(new CWorker(this));
+        if (!worker->Start())
+            break;
+
+        m_workers.push_back(worker);
+    }
+}
+
+CBandPool::~CBandPool()
+{
+    m_stopping = true;
+    m_workers.clear();
+}
+
+void CBandPool::Run(CJob* job, int bandCount)
+{
+    assert(job);
+    m_job = job;
+    m_bandCount = bandCount;
+    base::subtle::NoBarrier_Store(&m_nextBand, 0);
+
+    // Not worth waking more workers than there are bands for.
+    const int wakeCount =
+        std::min(static_cast<int>(m_workers.size()), bandCount - 1);
+    base::subtle::Release_Store(&m_busyWorkers, wakeCount);
+    for (int i = 0; i < wakeCount; ++i)
+        m_workers[i]->Wake();
+
+    runBands();
+    if (wakeCount > 0)
+        m_done.Wait();
+
+    m_job = NULL;
+}
+
+void CBandPool::runBands()
+{
+    while (true)
+    {
+        const int band =
+            base::subtle::Barrier_AtomicIncrement(&m_nextBand, 1) - 1;
+        if (band >= m_bandCount)
+            return;
+
+        m_job->RunBand(band);
+    }
+}
\ No newline at end of file
@@ -0,0 +1,68 @@
+#ifndef _BAND_POOL_H_
+#define _BAND_POOL_H_
+
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+#include "chromium/base/atomicops.h"
+#include "chromium/base/basictypes.h"
+#include "chromium/base/platform_thread.h"
+#include "chromium/base/waitable_event.h"
+
+// Splits a job into bands run on a few worker threads and the calling thread.
+// Bands are taken in order by whichever thread is free, so a slow or
+// preempted worker doesn't hold the job up by more than the band it has.
+class CBandPool
+{
+public:
+    class CJob
+    {
+    public:
+        virtual ~CJob() {}
+
+        // Called on any thread of the pool, for each band once.
+        virtual void RunBand(int band) = 0;
+    };
+
+    // The pool runs up to |threadCount| + 1 bands at a time.
+    explicit CBandPool(int threadCount);
+    ~CBandPool();
+
+    int GetThreadCount() const { return static_cast<int>(m_workers.size()); }
+
+    // Returns once bands 0 to |bandCount| - 1 have run.
+    void Run(CJob* job, int bandCount);
+
+private:
+    class CWorker : public PlatformThread::Delegate
+    {
+    public:
+        explicit CWorker(CBandPool* pool);
+        virtual ~CWorker();
+
+        bool Start();
+        void Wake() { m_wake.Signal(); }
+
+        // PlatformThread::Delegate
+        virtual void ThreadMain();
+
+    private:
+        CBandPool* m_pool;
+        base::WaitableEvent m_wake;
+        PlatformThreadHandle m_handle;
+        bool m_started;
+    };
+
+    void runBands();
+
+    std::vector<boost::shared_ptr<CWorker> > m_workers;
+    CJob* m_job;
+    int m_bandCount;
+    volatile base::subtle::Atomic32 m_nextBand;
+    volatile base::subtle::Atomic32 m_busyWorkers;
+    base::WaitableEvent m_done;
+    volatile bool m_stopping;
+};
+
+#endif  // _BAND_POOL_H_
\ No newline at end of file
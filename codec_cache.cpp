@@ -0,0 +1,224 @@
+#include "codec_cache.h"
+
+#include <cassert>
+
+#include "ffmpeg.h"
+
+using std::list;
+using boost::shared_ptr;
+
+namespace
+{
+// Each one holds a DPB worth of pictures. One 4K stream fits in the memory
+// limit.
+const int maxIdleCodecs = 4;
+const int64 maxIdleSize = 256 * 1024 * 1024;
+const int maxIdleSeconds = 60;
+
+// The DPB and the picture being decoded, the whole DPB if the SPS isn't
+// known.
+int64 estimateSize(const CCodecContext& codec)
+{
+    int width;
+    int height;
+    codec.GetCodedSize(&width, &height);
+    const int frameCount = codec.GetDPBFrameCount();
+    const int bytesPerSample = (codec.GetBitDepth() > 8) ? 2 : 1;
+    return static_cast<int64>(width) * height * 3 / 2 * bytesPerSample *
+        (((frameCount < 0) ? 16 : frameCount) + 1);
+}
+
+// profile_idc of the first SPS in an avcC record or in parameter sets with
+// start codes, -1 if there is none.
+int getProfile(const void* extraData, int extraDataSize)
+{
+    const uint8* data = reinterpret_cast<const uint8*>(extraData);
+    if ((extraDataSize > 1) && (1 == data[0]))
+        return data[1];
+
+    for (int i = 0; i + 4 < extraDataSize; ++i)
+        if (!data[i] && !data[i + 1] && (1 == data[i + 2]) &&
+            (7 == (data[i + 3] & 0x1F)))
+            return data[i + 4];
+
+    return -1;
+}
+}
+
+CCodecCache::CCodecCache()
+    : m_access()
+    , m_idle()
+    , m_lent()
+    , m_wake(false, false)
+    , m_reaper()
+    , m_reaperStarted(false)
+    , m_stopping(false)
+{
+}
+
+CCodecCache::~CCodecCache()
+{
+    {
+        AutoLock lock(m_access);
+        m_stopping = true;
+    }
+
+    if (m_reaperStarted)
+    {
+        m_wake.Signal();
+        PlatformThread::Join(m_reaper);
+    }
+}
+
+shared_ptr<CCodecContext> CCodecCache::Acquire(int fourCC, int width,
+                                               int height, int nalLength,
+                                               const void* extraData,
+                                               int extraDataSize)
+{
+    TFormat format;
+    format.FourCC = fourCC;
+    format.Width = width;
+    format.Height = height;
+    format.Profile = getProfile(extraData, extraDataSize);
+    format.NALLength = nalLength;
+
+    shared_ptr<CCodecContext> codec;
+    list<shared_ptr<CCodecContext> > evicted;
+    {
+        AutoLock lock(m_access);
+        evict(&evicted);
+        for (list<TLentCodec>::iterator i = m_lent.begin();
+             i != m_lent.end();)
+        {
+            if (i->Codec.expired())
+                i = m_lent.erase(i);
+            else
+                ++i;
+        }
+
+        // Without parameter sets nothing says what the codec is set up for.
+        if (format.Profile >= 0)
+        {
+            for (list<TIdleCodec>::iterator i = m_idle.begin();
+                 i != m_idle.end(); ++i)
+            {
+                if (isSameFormat(i->Format, format))
+                {
+                    codec = i->Codec;
+                    m_idle.erase(i);
+                    break;
+                }
+            }
+        }
+    }
+
+    if (codec)
+        codec->Reuse(extraData, extraDataSize);
+    else
+        codec = CFFMPEG::get()->CreateCodec(fourCC, width, height, nalLength,
+                                            extraData, extraDataSize);
+
+    if (codec && (format.Profile >= 0))
+    {
+        TLentCodec lent;
+        lent.Format = format;
+        lent.Codec = codec;
+        AutoLock lock(m_access);
+        m_lent.push_back(lent);
+    }
+
+    return codec;
+}
+
+void CCodecCache::Release(const shared_ptr<CCodecContext>& codec)
+{
+    if (!codec || !codec.unique())
+        return;
+
+    // Closing a codec joins its threads, which happens outside the lock.
+    list<shared_ptr<CCodecContext> > evicted;
+    {
+        AutoLock lock(m_access);
+        for (list<TLentCodec>::iterator i = m_lent.begin();
+             i != m_lent.end(); ++i)
+        {
+            if (i->Codec.lock() != codec)
+                continue;
+
+            TIdleCodec idle;
+            idle.Format = i->Format;
+            idle.Codec = codec;
+            idle.Size = estimateSize(*codec);
+            idle.Released = base::TimeTicks::Now();
+            m_lent.erase(i);
+            m_idle.push_back(idle);
+            evict(&evicted);
+            if (!m_reaperStarted)
+                m_reaperStarted = PlatformThread::Create(0, this, &m_reaper);
+
+            break;
+        }
+    }
+
+    // The reaper may be waiting with nothing idle.
+    m_wake.Signal();
+}
+
+bool CCodecCache::isSameFormat(const TFormat& a, const TFormat& b)
+{
+    return (a.FourCC == b.FourCC) && (a.Width == b.Width) &&
+        (a.Height == b.Height) && (a.Profile == b.Profile) &&
+        (a.NALLength == b.NALLength);
+}
+
+void CCodecCache::ThreadMain()
+{
+    PlatformThread::SetName("Codec cache");
+    const base::TimeDelta maxIdleTime =
+        base::TimeDelta::FromSeconds(maxIdleSeconds);
+    for (;;)
+    {
+        list<shared_ptr<CCodecContext> > evicted;
+        bool idle;
+        base::TimeTicks expiry;
+        {
+            AutoLock lock(m_access);
+            if (m_stopping)
+                return;
+
+            evict(&evicted);
+            idle = !m_idle.empty();
+            if (idle)
+                expiry = m_idle.front().Released + maxIdleTime;
+        }
+
+        evicted.clear();
+        if (idle)
+            m_wake.TimedWait(expiry - base::TimeTicks::Now());
+        else
+            m_wake.Wait();
+    }
+}
+
+void CCodecCache::evict(list<shared_ptr<CCodecContext> >* evicted)
+{
+    assert(evicted);
+
+    int64 size = 0;
+    for (list<TIdleCodec>::const_iterator i = m_idle.begin();
+         i != m_idle.end(); ++i)
+        size += i->Size;
+
+    const base::TimeTicks now = base::TimeTicks::Now();
+    const base::TimeDelta maxIdleTime =
+        base::TimeDelta::FromSeconds(maxIdleSeconds);
+    while (!m_idle.empty() &&
+           ((static_cast<int>(m_idle.size()) > maxIdleCodecs) ||
+            (size > maxIdleSize) ||
+            (now - m_idle.front().Released > maxIdleTime)))
+    {
+        size -= m_idle.front().Size;
+        evicted->push_back(m_idle.front().Codec);
+        m_idle.pop_front();
+    }
+}
\ No newline at end of file
@@ -0,0 +1,87 @@
+#ifndef _CODEC_CACHE_H_
+#define _CODEC_CACHE_H_
+
+#include <list>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+
+#include "chromium/base/basictypes.h"
+#include "chromium/base/lock.h"
+#include "chromium/base/platform_thread.h"
+#include "chromium/base/singleton.h"
+#include "chromium/base/time.h"
+#include "chromium/base/waitable_event.h"
+
+class CCodecContext;
+
+// Keeps the codecs of disconnected streams open, with their frame pools, so
+// the next stream of the same format, e.g. after a channel change, starts on
+// a warm one. The codec keeps its threads, which the software decoder keeps
+// if its budget gives the same count and DXVA drops. The format is the
+// FourCC, the size of the media type, the profile of the parameter sets and
+// the NAL length. Idle codecs are closed oldest first when there are too
+// many, when their pictures take too much memory, or when they have been idle
+// for too long. A thread of the cache closes them as they expire, so nothing
+// stays open long after the last stream has gone.
+class CCodecCache : public Singleton<CCodecCache>,
+                    public PlatformThread::Delegate
+{
+public:
+    CCodecCache();
+    ~CCodecCache();
+
+    // Takes the arguments of CFFMPEG::CreateCodec(), which is what a miss
+    // ends up in.
+    boost::shared_ptr<CCodecContext> Acquire(int fourCC, int width,
+                                             int height, int nalLength,
+                                             const void* extraData,
+                                             int extraDataSize);
+
+    // Keeps |codec| for later if it came from Acquire() and nothing else
+    // refers to it any more.
+    void Release(const boost::shared_ptr<CCodecContext>& codec);
+
+private:
+    struct TFormat
+    {
+        int FourCC;
+        int Width;
+        int Height;
+        int Profile;
+        int NALLength;
+    };
+
+    struct TIdleCodec
+    {
+        TFormat Format;
+        boost::shared_ptr<CCodecContext> Codec;
+        int64 Size;                 // Estimated, of its pictures
+        base::TimeTicks Released;
+    };
+
+    struct TLentCodec
+    {
+        TFormat Format;
+        boost::weak_ptr<CCodecContext> Codec;
+    };
+
+    static bool isSameFormat(const TFormat& a, const TFormat& b);
+
+    // PlatformThread::Delegate, waits for the oldest idle codec to expire.
+    virtual void ThreadMain();
+
+    // Moves the idle codecs over the limits to |evicted|, to be closed
+    // outside the lock. |m_access| is held.
+    void evict(std::list<boost::shared_ptr<CCodecContext> >* evicted);
+
+    Lock m_access;
+    std::list<TIdleCodec> m_idle;   // Oldest first
+    std::list<TLentCodec> m_lent;
+    base::WaitableEvent m_wake;
+    PlatformThreadHandle m_reaper;
+    bool m_reaperStarted;
+    bool m_stopping;
+};
+
+#endif  // _CODEC_CACHE_H_
\ No newline at end of file
@@ -0,0 +1,180 @@
+#include "decode_trace.h"
+
+#include <cassert>
+#include <cstdio>
+#include <algorithm>
+
+#include "chromium/base/platform_thread.h"
+#include "chromium/base/string_util.h"
+#include "decoder_stats.h"
+
+using std::vector;
+using std::string;
+
+namespace
+{
+// 32 bytes per event, 128 KB per thread.
+const int eventsPerThread = 4096;
+}
+
+CDecodeTrace::CThreadRing::CThreadRing()
+    : m_events(eventsPerThread)
+    , m_added(0)
+    , m_threadID(0)
+    , m_currentFrame(-1)
+    , m_inUse(false)
+{
+}
+
+CDecodeTrace::CThreadRing::~CThreadRing()
+{
+}
+
+void CDecodeTrace::CThreadRing::Reset(int threadID)
+{
+    base::subtle::Release_Store(&m_added, 0);
+    m_threadID = threadID;
+    m_currentFrame = -1;
+    m_inUse = true;
+}
+
+// Only the owning thread writes, so the slot needs no lock. Publishing the
+// count afterwards keeps readers off the slot being filled, but the oldest
+// event may be overwritten while a dump copies it.
+void CDecodeTrace::CThreadRing::Add(const TEvent& event)
+{
+    const base::subtle::Atomic32 added = m_added;
+    m_events[added % eventsPerThread] = event;
+    base::subtle::Release_Store(&m_added, added + 1);
+}
+
+void CDecodeTrace::CThreadRing::GetEvents(vector<TEvent>* events) const
+{
+    assert(events);
+    const int added = base::subtle::Acquire_Load(&m_added);
+    const int first = std::max(0, added - eventsPerThread);
+    for (int i = first; i < added; ++i)
+        events->push_back(m_events[i % eventsPerThread]);
+}
+
+//------------------------------------------------------------------------------
+CDecodeTrace::CDecodeTrace()
+    : m_ringsAccess()
+    , m_rings()
+    , m_threadRing()
+{
+}
+
+CDecodeTrace::~CDecodeTrace()
+{
+    for (int i = 0; i < static_cast<int>(m_rings.size()); ++i)
+        delete m_rings[i];
+}
+
+void CDecodeTrace::SetCurrentFrame(int frameID)
+{
+    getThreadRing()->SetCurrentFrame(frameID);
+}
+
+void CDecodeTrace::AddEvent(int stage, int64 begin, int64 end,
+                            int surfaceIndex, int poc)
+{
+    CThreadRing* ring = getThreadRing();
+
+    TEvent event;
+    event.Begin = begin;
+    event.End = end;
+    event.FrameID = ring->GetCurrentFrame();
+    event.Stage = static_cast<int16>(stage);
+    event.SurfaceIndex = static_cast<int16>(surfaceIndex);
+    event.POC = poc;
+    ring->Add(event);
+}
+
+void CDecodeTrace::ReleaseThread()
+{
+    CThreadRing* ring = m_threadRing.Get();
+    if (!ring)
+        return;
+
+    AutoLock lock(m_ringsAccess);
+    ring->SetInUse(false);
+    m_threadRing.Set(NULL);
+}
+
+void CDecodeTrace::ExportChromeTrace(string* json) const
+{
+    assert(json);
+
+    json->assign("{\"traceEvents\":[");
+    bool first = true;
+    AutoLock lock(m_ringsAccess);
+    for (int i = 0; i < static_cast<int>(m_rings.size()); ++i)
+    {
+        vector<TEvent> events;
+        m_rings[i]->GetEvents(&events);
+        for (int j = 0; j < static_cast<int>(events.size()); ++j)
+        {
+            const TEvent& e = events[j];
+            const char* name = CDecoderStats::GetStageName(
+                static_cast<CDecoderStats::KStage>(e.Stage));
+            StringAppendF(json,
+                          "%s{\"name\":\"%s\",\"cat\":\"h264\",\"ph\":\"X\","
+                          "\"ts\":%lld,\"dur\":%lld,\"pid\":1,\"tid\":%d,"
+                          "\"args\":{\"frame\":%d,\"surface\":%d,"
+                          "\"poc\":%d}}",
+                          first ? "" : ",", name,
+                          static_cast<long long>(e.Begin),
+                          static_cast<long long>(e.End - e.Begin),
+                          m_rings[i]->GetThreadID(), e.FrameID,
+                          e.SurfaceIndex, e.POC);
+            first = false;
+        }
+    }
+
+    json->append("]}");
+}
+
+bool CDecodeTrace::DumpChromeTrace(const char* fileName) const
+{
+    assert(fileName);
+
+    string json;
+    ExportChromeTrace(&json);
+
+    FILE* file = fopen(fileName, "wb");
+    if (!file)
+        return false;
+
+    const bool written =
+        (fwrite(json.data(), 1, json.size(), file) == json.size());
+    return (fclose(file) == 0) && written;
+}
+
+CDecodeTrace::CThreadRing* CDecodeTrace::getThreadRing()
+{
+    CThreadRing* ring = m_threadRing.Get();
+    if (ring)
+        return ring;
+
+    // First event of this thread, take over a released ring if there is one.
+    AutoLock lock(m_ringsAccess);
+    for (int i = 0; i < static_cast<int>(m_rings.size()); ++i)
+    {
+        if (!m_rings[i]->IsInUse())
+        {
+            ring = m_rings[i];
+            break;
+        }
+    }
+
+    if (!ring)
+    {
+        ring = new CThreadRing;
+        m_rings.push_back(ring);
+    }
+
+    ring->Reset(PlatformThread::CurrentId());
+    m_threadRing.Set(ring);
+    return ring;
+}
\ No newline at end of file
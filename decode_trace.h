@@ -0,0 +1,77 @@
+#ifndef _DECODE_TRACE_H_
+#define _DECODE_TRACE_H_
+
+#include <string>
+#include <vector>
+
+#include "chromium/base/atomicops.h"
+#include "chromium/base/basictypes.h"
+#include "chromium/base/lock.h"
+#include "chromium/base/singleton.h"
+#include "chromium/base/thread_local.h"
+
+// Always-on record of the decode pipeline. Every thread writes fixed-size
+// binary events into a ring of its own without taking a lock, the rings are
+// only formatted when a dump is asked for. The dump is Chrome trace-event
+// JSON, to be loaded in chrome://tracing.
+class CDecodeTrace : public Singleton<CDecodeTrace>
+{
+public:
+    struct TEvent
+    {
+        int64 Begin;            // In microseconds
+        int64 End;
+        int FrameID;            // Input sample the thread was working on
+        int16 Stage;            // CDecoderStats::KStage
+        int16 SurfaceIndex;     // -1 if not a DXVA1 picture
+        int POC;
+    };
+
+    CDecodeTrace();
+    ~CDecodeTrace();
+
+    // Tags the events the calling thread adds from now on.
+    void SetCurrentFrame(int frameID);
+    void AddEvent(int stage, int64 begin, int64 end, int surfaceIndex,
+                  int poc);
+
+    // Lets another thread take over the ring of the calling thread, which is
+    // about to exit. Its events stay in the dumps until then.
+    void ReleaseThread();
+
+    void ExportChromeTrace(std::string* json) const;
+    bool DumpChromeTrace(const char* fileName) const;
+
+private:
+    class CThreadRing
+    {
+    public:
+        CThreadRing();
+        ~CThreadRing();
+
+        void Reset(int threadID);
+        void Add(const TEvent& event);
+        void GetEvents(std::vector<TEvent>* events) const;
+
+        int GetThreadID() const { return m_threadID; }
+        int GetCurrentFrame() const { return m_currentFrame; }
+        void SetCurrentFrame(int frameID) { m_currentFrame = frameID; }
+        bool IsInUse() const { return m_inUse; }
+        void SetInUse(bool inUse) { m_inUse = inUse; }
+
+    private:
+        std::vector<TEvent> m_events;
+        volatile base::subtle::Atomic32 m_added;
+        int m_threadID;
+        int m_currentFrame;
+        bool m_inUse;
+    };
+
+    CThreadRing* getThreadRing();
+
+    mutable Lock m_ringsAccess; // Taken once per thread and by the dumps
+    std::vector<CThreadRing*> m_rings;
+    base::ThreadLocalPointer<CThreadRing> m_threadRing;
+};
+
+#endif  // _DECODE_TRACE_H_
\ No newline at end of file
@@ -0,0 +1,226 @@
+#include "decoder_stats.h"
+
+#include <algorithm>
+#include <cassert>
+
+#if defined(_WIN32)
+#include <intrin.h>
+#endif
+
+#include "decode_trace.h"
+
+namespace
+{
+// base::subtle has no 64-bit operations on 32-bit Windows, compare-exchange
+// (cmpxchg8b there) is enough to build the rest on.
+int64 compareExchange(volatile int64* value, int64 exchange, int64 comparand)
+{
+#if defined(_WIN32)
+    return _InterlockedCompareExchange64(
+        reinterpret_cast<volatile __int64*>(value), exchange, comparand);
+#else
+    return __sync_val_compare_and_swap(value, comparand, exchange);
+#endif
+}
+
+// A compare-exchange that never changes anything reads the value in one
+// piece on 32-bit targets.
+int64 atomicLoad(const volatile int64* value)
+{
+    return compareExchange(const_cast<volatile int64*>(value), 0, 0);
+}
+
+void atomicStore(volatile int64* value, int64 newValue)
+{
+    int64 current = *value;
+    for (;;)
+    {
+        const int64 previous = compareExchange(value, newValue, current);
+        if (previous == current)
+            return;
+
+        current = previous;
+    }
+}
+
+void atomicAdd(volatile int64* value, int64 delta)
+{
+    int64 current = *value;
+    for (;;)
+    {
+        const int64 previous =
+            compareExchange(value, current + delta, current);
+        if (previous == current)
+            return;
+
+        current = previous;
+    }
+}
+
+void atomicMax(volatile int64* value, int64 candidate)
+{
+    int64 current = *value;
+    while (candidate > current)
+    {
+        const int64 previous = compareExchange(value, candidate, current);
+        if (previous == current)
+            return;
+
+        current = previous;
+    }
+}
+}
+
+CDecoderStats::CStageTimer::CStageTimer(CDecoderStats* stats, KStage stage)
+    : m_stats(stats)
+    , m_stage(stage)
+    , m_start(base::TimeTicks::HighResNow())
+    , m_surfaceIndex(-1)
+    , m_poc(0)
+{
+    assert(stats);
+}
+
+CDecoderStats::CStageTimer::~CStageTimer()
+{
+    const base::TimeTicks end = base::TimeTicks::HighResNow();
+    m_stats->AddStageTime(m_stage, (end - m_start).InMicroseconds());
+    CDecodeTrace::get()->AddEvent(
+        m_stage, (m_start - base::TimeTicks()).InMicroseconds(),
+        (end - base::TimeTicks()).InMicroseconds(), m_surfaceIndex, m_poc);
+}
+
+void CDecoderStats::CStageTimer::SetPicture(int surfaceIndex, int poc)
+{
+    m_surfaceIndex = surfaceIndex;
+    m_poc = poc;
+}
+
+//------------------------------------------------------------------------------
+const char* CDecoderStats::GetStageName(KStage stage)
+{
+    static const char* names[STAGE_COUNT] =
+    {
+        "PreDecode",
+        "Decode",
+        "PicParams",
+        "AcceleratorWait",
+        "Execute",
+        "Conversion",
+        "AllocatorWait",
+        "Deliver"
+    };
+
+    if ((stage < 0) || (stage >= STAGE_COUNT))
+        return "Unknown";
+
+    return names[stage];
+}
+
+//------------------------------------------------------------------------------
+CDecoderStats::CDecoderStats()
+    : m_counters()
+    , m_stages()
+    , m_firstInputTime(0)
+    , m_firstOutputTime(0)
+    , m_surfacesInUse(0)
+    , m_surfaceCount(0)
+    , m_threadCount(0)
+    , m_outputBufferCount(0)
+{
+    Reset();
+}
+
+CDecoderStats::~CDecoderStats()
+{
+}
+
+void CDecoderStats::Count(KCounter counter)
+{
+    assert((counter >= 0) && (counter < COUNTER_COUNT));
+    atomicAdd(&m_counters[counter], 1);
+    if (COUNTER_FRAMES_IN == counter)
+        markFirst(&m_firstInputTime);
+    else if (COUNTER_FRAMES_OUTPUT == counter)
+        markFirst(&m_firstOutputTime);
+}
+
+void CDecoderStats::AddStageTime(KStage stage, int64 time)
+{
+    assert((stage >= 0) && (stage < STAGE_COUNT));
+    TStageAccumulator& s = m_stages[stage];
+    atomicAdd(&s.Count, 1);
+    atomicAdd(&s.TotalTime, time);
+    atomicMax(&s.MaxTime, time);
+}
+
+void CDecoderStats::SetSurfaceOccupancy(int inUse, int count)
+{
+    base::subtle::Release_Store(&m_surfacesInUse, inUse);
+    base::subtle::Release_Store(&m_surfaceCount, count);
+}
+
+void CDecoderStats::SetThreadCount(int count)
+{
+    base::subtle::Release_Store(&m_threadCount, count);
+}
+
+void CDecoderStats::SetOutputBufferCount(int count)
+{
+    base::subtle::Release_Store(&m_outputBufferCount, count);
+}
+
+// Each value is read atomically, but the snapshot as a whole may straddle an
+// update.
+void CDecoderStats::GetSnapshot(TSnapshot* snapshot) const
+{
+    assert(snapshot);
+
+    for (int i = 0; i < COUNTER_COUNT; ++i)
+        snapshot->Counters[i] = atomicLoad(&m_counters[i]);
+
+    for (int i = 0; i < STAGE_COUNT; ++i)
+    {
+        snapshot->Stages[i].Count = atomicLoad(&m_stages[i].Count);
+        snapshot->Stages[i].TotalTime = atomicLoad(&m_stages[i].TotalTime);
+        snapshot->Stages[i].MaxTime = atomicLoad(&m_stages[i].MaxTime);
+    }
+
+    snapshot->SurfacesInUse = base::subtle::Acquire_Load(&m_surfacesInUse);
+    snapshot->SurfaceCount = base::subtle::Acquire_Load(&m_surfaceCount);
+    snapshot->ThreadCount = base::subtle::Acquire_Load(&m_threadCount);
+    snapshot->OutputBufferCount =
+        base::subtle::Acquire_Load(&m_outputBufferCount);
+
+    const int64 firstInput = atomicLoad(&m_firstInputTime);
+    const int64 firstOutput = atomicLoad(&m_firstOutputTime);
+    snapshot->FirstFrameTime =
+        (firstInput && firstOutput) ? firstOutput - firstInput : -1;
+}
+
+void CDecoderStats::Reset()
+{
+    for (int i = 0; i < COUNTER_COUNT; ++i)
+        atomicStore(&m_counters[i], 0);
+
+    for (int i = 0; i < STAGE_COUNT; ++i)
+    {
+        atomicStore(&m_stages[i].Count, 0);
+        atomicStore(&m_stages[i].TotalTime, 0);
+        atomicStore(&m_stages[i].MaxTime, 0);
+    }
+
+    atomicStore(&m_firstInputTime, 0);
+    atomicStore(&m_firstOutputTime, 0);
+}
+
+// Only the first call after Reset() stores its time.
+void CDecoderStats::markFirst(volatile int64* time)
+{
+    if (atomicLoad(time))
+        return;
+
+    const int64 now =
+        (base::TimeTicks::HighResNow() - base::TimeTicks()).InMicroseconds();
+    compareExchange(time, std::max<int64>(now, 1), 0);
+}
\ No newline at end of file
@@ -0,0 +1,114 @@
+#ifndef _DECODER_STATS_H_
+#define _DECODER_STATS_H_
+
+#include "chromium/base/atomicops.h"
+#include "chromium/base/basictypes.h"
+#include "chromium/base/time.h"
+
+// Counters and stage timings of one stream. Every update is a single atomic
+// operation, so the counters can stay on in release builds, and a snapshot
+// can be taken from any thread. Nothing in here depends on COM or DirectShow.
+class CDecoderStats
+{
+public:
+    enum KCounter
+    {
+        COUNTER_FRAMES_IN = 0,      // Input samples handed to the decoder
+        COUNTER_FRAMES_DECODED = 1,
+        COUNTER_FRAMES_OUTPUT = 2,
+        COUNTER_FRAMES_DROPPED = 3, // Decoded or skipped, but never shown
+        COUNTER_FRAMES_CONCEALED = 4,
+        COUNTER_SURFACE_EXHAUSTED = 5,  // No free DXVA1 picture slot
+        COUNTER_FRAMES_UNCLEAN = 6, // Output with references missing
+        COUNTER_COUNT
+    };
+
+    enum KStage
+    {
+        STAGE_PRE_DECODE = 0,       // Bitstream parsing ahead of DXVA
+        STAGE_DECODE = 1,           // libavcodec picture decoding
+        STAGE_PIC_PARAMS = 2,
+        STAGE_ACCELERATOR_WAIT = 3, // BeginFrame until a surface is free
+        STAGE_EXECUTE = 4,
+        STAGE_CONVERSION = 5,
+        STAGE_ALLOCATOR_WAIT = 6,
+        STAGE_DELIVER = 7,
+        STAGE_COUNT
+    };
+
+    struct TStageTime
+    {
+        int64 Count;
+        int64 TotalTime;            // In microseconds
+        int64 MaxTime;              // In microseconds
+    };
+
+    struct TSnapshot
+    {
+        int64 Counters[COUNTER_COUNT];
+        TStageTime Stages[STAGE_COUNT];
+        int SurfacesInUse;          // Occupied DXVA1 picture slots
+        int SurfaceCount;
+        int ThreadCount;            // Decoding threads of libavcodec
+        int OutputBufferCount;      // Buffers the output allocator holds
+        int64 FirstFrameTime;       // First input to first output sample, in
+                                    // microseconds, -1 until both happened
+    };
+
+    // Adds the time from construction to destruction to a stage, and the
+    // same span to the decode trace.
+    class CStageTimer
+    {
+    public:
+        CStageTimer(CDecoderStats* stats, KStage stage);
+        ~CStageTimer();
+
+        void SetPicture(int surfaceIndex, int poc);
+
+    private:
+        CDecoderStats* m_stats;
+        KStage m_stage;
+        base::TimeTicks m_start;
+        int m_surfaceIndex;
+        int m_poc;
+    };
+
+    static const char* GetStageName(KStage stage);
+
+    CDecoderStats();
+    ~CDecoderStats();
+
+    void Count(KCounter counter);
+    void AddStageTime(KStage stage, int64 time);
+    void SetSurfaceOccupancy(int inUse, int count);
+    void SetThreadCount(int count);
+    void SetOutputBufferCount(int count);
+
+    // Allocator calls per input sample are
+    // Stages[STAGE_ALLOCATOR_WAIT].Count / Counters[COUNTER_FRAMES_IN].
+    void GetSnapshot(TSnapshot* snapshot) const;
+
+    // Starts the counters and timings over, the gauges keep their values.
+    void Reset();
+
+private:
+    void markFirst(volatile int64* time);
+
+    struct TStageAccumulator
+    {
+        volatile int64 Count;
+        volatile int64 TotalTime;
+        volatile int64 MaxTime;
+    };
+
+    volatile int64 m_counters[COUNTER_COUNT];
+    TStageAccumulator m_stages[STAGE_COUNT];
+    volatile int64 m_firstInputTime;    // 0 until the first input sample
+    volatile int64 m_firstOutputTime;
+    volatile base::subtle::Atomic32 m_surfacesInUse;
+    volatile base::subtle::Atomic32 m_surfaceCount;
+    volatile base::subtle::Atomic32 m_threadCount;
+    volatile base::subtle::Atomic32 m_outputBufferCount;
+};
+
+#endif  // _DECODER_STATS_H_
\ No newline at end of file
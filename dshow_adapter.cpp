@@ -0,0 +1,184 @@
+#include "dshow_adapter.h"
+
+#include <cassert>
+#include <cstdlib>
+
+#include <streams.h>
+#include <dvdmedia.h>
+
+#include "codec_cache.h"
+#include "ffmpeg.h"
+#include "common/guid_def.h"
+#include "common/dshow_util.h"
+
+using boost::shared_ptr;
+
+namespace
+{
+struct SupportedType
+{
+    const GUID& SubType;
+    int FourCC;
+};
+
+const SupportedType supportedTypes[] = {
+    { MEDIASUBTYPE_H264, '462H' },
+    { MEDIASUBTYPE_h264, '462h' },
+    { MEDIASUBTYPE_X264, '462X' },
+    { MEDIASUBTYPE_x264, '462x' },
+    { MEDIASUBTYPE_VSSH, 'HSSV' },
+    { MEDIASUBTYPE_vssh, 'hssv' },
+    { MEDIASUBTYPE_DAVC, 'CVAD' },
+    { MEDIASUBTYPE_davc, 'cvad' },
+    { MEDIASUBTYPE_PAVC, 'CVAP' },
+    { MEDIASUBTYPE_pavc, 'cvap' },
+    { MEDIASUBTYPE_AVC1, '1CVA' },
+    { MEDIASUBTYPE_avc1, '1cva' },
+    { MEDIASUBTYPE_H264_bis, '1cva' }
+};
+
+int getFourCCFromSubType(const GUID& subType)
+{
+    for (int i = 0; i < arraysize(supportedTypes); ++i)
+        if (supportedTypes[i].SubType == subType)
+            return supportedTypes[i].FourCC;
+
+    return 0;
+}
+}
+}
+
+namespace dshow_adapter
+{
+bool IsSubTypeSupported(const CMediaType& mediaType)
+{
+    for (int i = 0; i < arraysize(supportedTypes); ++i)
+        if (supportedTypes[i].SubType == *mediaType.Subtype())
+            return true;
+
+    return false;
+}
+
+void GetExtraData(const CMediaType& mediaType, const void** data, int* size)
+{
+    assert(data);
+    assert(size);
+
+    *data = NULL;
+    *size = 0;
+    if (FORMAT_VideoInfo == *mediaType.FormatType())
+    {
+        *size = mediaType.FormatLength() - sizeof(VIDEOINFOHEADER);
+        *data = *size ? mediaType.Format() + sizeof(VIDEOINFOHEADER) : NULL;
+    }
+    else if (FORMAT_VideoInfo2 == *mediaType.FormatType())
+    {
+        *size = mediaType.FormatLength() - sizeof(VIDEOINFOHEADER2);
+        *data = *size ? mediaType.Format() + sizeof(VIDEOINFOHEADER2) : NULL;
+    }
+    else if (FORMAT_MPEGVideo == *mediaType.FormatType())
+    {
+        MPEG1VIDEOINFO* mpeg1info =
+            reinterpret_cast<MPEG1VIDEOINFO*>(mediaType.Format());
+        if (mpeg1info->cbSequenceHeader)
+        {
+            *size = mpeg1info->cbSequenceHeader;
+            *data = mpeg1info->bSequenceHeader;
+        }
+    }
+    else if (FORMAT_MPEG2Video == *mediaType.FormatType())
+    {
+        MPEG2VIDEOINFO* mpeg2info =
+            reinterpret_cast<MPEG2VIDEOINFO*>(mediaType.Format());
+        if (mpeg2info->cbSequenceHeader)
+        {
+            *size = mpeg2info->cbSequenceHeader;
+            *data = reinterpret_cast<const void*>(mpeg2info->dwSequenceHeader);
+        }
+    }
+
+shared_ptr<CCodecContext> CreateCodec(const CMediaType& mediaType)
+{
+    if (!IsSubTypeSupported(mediaType))
+        return shared_ptr<CCodecContext>();
+
+    BITMAPINFOHEADER header;
+    if (!ExtractBitmapInfoFromMediaType(mediaType, &header))
+        return shared_ptr<CCodecContext>();
+
+    int nalLength = 0;
+    if ((FORMAT_MPEG2Video == *mediaType.FormatType()) &&
+        (('1cva' == header.biCompression) || ('1CVA' == header.biCompression)))
+    {
+        MPEG2VIDEOINFO* m =
+            reinterpret_cast<MPEG2VIDEOINFO*>(mediaType.Format());
+        nalLength = m->dwFlags;
+    }
+
+    const void* extraData;
+    int extraDataSize;
+    GetExtraData(mediaType, &extraData, &extraDataSize);
+    // get() registers the codecs on first use.
+    CFFMPEG::get();
+    return CCodecCache::get()->Acquire(
+        getFourCCFromSubType(*mediaType.Subtype()), header.biWidth,
+        abs(header.biHeight), nalLength, extraData, extraDataSize);
+}
+
+bool InitScale(const CCodecContext& codec, IMediaSample* sample,
+               CSWScale* scale)
+{
+    assert(sample);
+    assert(scale);
+
+    int width = scale->GetWidth();
+    int height = scale->GetHeight();
+    int fourCC = scale->GetOutFourCC();
+
+    // A media type is attached to the sample only when the output format
+    // changes.
+    AM_MEDIA_TYPE* m = NULL;
+    if ((S_OK == sample->GetMediaType(&m)) && m)
+    {
+        BITMAPINFOHEADER header;
+        const bool extracted = ExtractBitmapInfoFromMediaType(*m, &header);
+        DeleteMediaType(m);
+        if (!extracted)
+            return false;
+
+        width = header.biWidth;
+        height = abs(header.biHeight);
+        fourCC = header.biCompression;
+    }
+
+    return scale->Init(codec, width, height, fourCC);
+}
+
+void ReviseTypeSpecFlags(int firstFieldType, int picType, DWORD* flags)
+{
+    assert(flags);
+
+    bool progressive;
+    bool topFieldFirst;
+    CCodecContext::KCodingType codingType;
+    CCodecContext::GetPictureFlags(firstFieldType, picType, &progressive,
+                                   &topFieldFirst, &codingType);
+    if (progressive)
+        *flags |= AM_VIDEO_FLAG_WEAVE;
+    else if (topFieldFirst)
+        *flags |= AM_VIDEO_FLAG_FIELD1FIRST;
+
+    switch (codingType)
+    {
+        case CCodecContext::CODING_TYPE_I:
+            *flags |= AM_VIDEO_FLAG_I_SAMPLE;
+            break;
+        case CCodecContext::CODING_TYPE_P:
+            *flags |= AM_VIDEO_FLAG_P_SAMPLE;
+            break;
+        default :
+            *flags |= AM_VIDEO_FLAG_B_SAMPLE;
+            break;
+    }
+}
+}
\ No newline at end of file
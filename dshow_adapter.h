@@ -0,0 +1,33 @@
+#ifndef _DSHOW_ADAPTER_H_
+#define _DSHOW_ADAPTER_H_
+
+#include <windows.h>
+
+#include <boost/shared_ptr.hpp>
+
+struct IMediaSample;
+class CMediaType;
+class CCodecContext;
+class CSWScale;
+
+// Translates between DirectShow media types and samples and the decode core,
+// which only deals with plain format values.
+namespace dshow_adapter
+{
+bool IsSubTypeSupported(const CMediaType& mediaType);
+
+// The parameter sets that come with the format block, NULL if there are none.
+void GetExtraData(const CMediaType& mediaType, const void** data, int* size);
+
+// Starts on an idle codec of the same format if CCodecCache has one.
+boost::shared_ptr<CCodecContext> CreateCodec(const CMediaType& mediaType);
+
+// Follows the output format when |sample| carries a new media type, and keeps
+// the previous one otherwise.
+bool InitScale(const CCodecContext& codec, IMediaSample* sample,
+               CSWScale* scale);
+
+void ReviseTypeSpecFlags(int firstFieldType, int picType, DWORD* flags);
+}
+
+#endif  // _DSHOW_ADAPTER_H_
\ No newline at end of file
@@ -0,0 +1,154 @@
+#ifndef _DXVA_H264_H_
+#define _DXVA_H264_H_
+
+// The DXVA H.264 picture parameter, scaling matrix and slice control
+// structures, and the few HRESULT codes the builders return. Windows takes
+// them from the SDK, other platforms get layout compatible declarations so
+// the pic-param builders can run without an accelerator.
+#if defined(_WIN32)
+
+#include <windows.h>
+#include <vfwmsgs.h>
+#include <dxva.h>
+
+#else
+
+#include "chromium/base/basictypes.h"
+
+typedef int32 HRESULT;
+typedef uint8 UCHAR;
+typedef int8 CHAR;
+typedef uint16 USHORT;
+typedef int16 SHORT;
+typedef uint32 UINT;
+typedef int32 INT;
+
+#define S_OK                        static_cast<HRESULT>(0)
+#define S_FALSE                     static_cast<HRESULT>(1)
+#define E_FAIL                      static_cast<HRESULT>(0x80004005)
+#define VFW_E_INVALID_FILE_FORMAT   static_cast<HRESULT>(0x8004022F)
+#define SUCCEEDED(r)                (static_cast<HRESULT>(r) >= 0)
+#define FAILED(r)                   (static_cast<HRESULT>(r) < 0)
+
+#pragma pack(push, 1)
+
+struct DXVA_PicEntry_H264
+{
+    union
+    {
+        struct
+        {
+            UCHAR Index7Bits : 7;
+            UCHAR AssociatedFlag : 1;
+        };
+        UCHAR bPicEntry;
+    };
+};
+
+struct DXVA_PicParams_H264
+{
+    USHORT wFrameWidthInMbsMinus1;
+    USHORT wFrameHeightInMbsMinus1;
+    DXVA_PicEntry_H264 CurrPic;
+    UCHAR num_ref_frames;
+    union
+    {
+        struct
+        {
+            USHORT field_pic_flag : 1;
+            USHORT MbaffFrameFlag : 1;
+            USHORT residual_colour_transform_flag : 1;
+            USHORT sp_for_switch_flag : 1;
+            USHORT chroma_format_idc : 2;
+            USHORT RefPicFlag : 1;
+            USHORT constrained_intra_pred_flag : 1;
+            USHORT weighted_pred_flag : 1;
+            USHORT weighted_bipred_idc : 2;
+            USHORT MbsConsecutiveFlag : 1;
+            USHORT frame_mbs_only_flag : 1;
+            USHORT transform_8x8_mode_flag : 1;
+            USHORT MinLumaBipredSize8x8Flag : 1;
+            USHORT IntraPicFlag : 1;
+        };
+        USHORT wBitFields;
+    };
+    UCHAR bit_depth_luma_minus8;
+    UCHAR bit_depth_chroma_minus8;
+    USHORT Reserved16Bits;
+    UINT StatusReportFeedbackNumber;
+    DXVA_PicEntry_H264 RefFrameList[16];
+    INT CurrFieldOrderCnt[2];
+    INT FieldOrderCntList[16][2];
+    CHAR pic_init_qs_minus26;
+    CHAR chroma_qp_index_offset;
+    CHAR second_chroma_qp_index_offset;
+    UCHAR ContinuationFlag;
+    CHAR pic_init_qp_minus26;
+    UCHAR num_ref_idx_l0_active_minus1;
+    UCHAR num_ref_idx_l1_active_minus1;
+    UCHAR Reserved8BitsA;
+    USHORT FrameNumList[16];
+    UINT UsedForReferenceFlags;
+    USHORT NonExistingFrameFlags;
+    USHORT frame_num;
+    UCHAR log2_max_frame_num_minus4;
+    UCHAR pic_order_cnt_type;
+    UCHAR log2_max_pic_order_cnt_lsb_minus4;
+    UCHAR delta_pic_order_always_zero_flag;
+    UCHAR direct_8x8_inference_flag;
+    UCHAR entropy_coding_mode_flag;
+    UCHAR pic_order_present_flag;
+    UCHAR num_slice_groups_minus1;
+    UCHAR slice_group_map_type;
+    UCHAR deblocking_filter_control_present_flag;
+    UCHAR redundant_pic_cnt_present_flag;
+    UCHAR Reserved8BitsB;
+    USHORT slice_group_change_rate_minus1;
+    UCHAR SliceGroupMap[810];
+};
+
+struct DXVA_Qmatrix_H264
+{
+    UCHAR bScalingLists4x4[6][16];
+    UCHAR bScalingLists8x8[2][64];
+};
+
+struct DXVA_Slice_H264_Short
+{
+    UINT BSNALunitDataLocation;
+    UINT SliceBytesInBuffer;
+    USHORT wBadSliceChopping;
+};
+
+struct DXVA_Slice_H264_Long
+{
+    UINT BSNALunitDataLocation;
+    UINT SliceBytesInBuffer;
+    USHORT wBadSliceChopping;
+    USHORT first_mb_in_slice;
+    USHORT NumMbsForSlice;
+    USHORT BitOffsetToSliceData;
+    UCHAR slice_type;
+    UCHAR luma_log2_weight_denom;
+    UCHAR chroma_log2_weight_denom;
+    UCHAR num_ref_idx_l0_active_minus1;
+    UCHAR num_ref_idx_l1_active_minus1;
+    CHAR slice_alpha_c0_offset_div2;
+    CHAR slice_beta_offset_div2;
+    UCHAR Reserved8Bits;
+    DXVA_PicEntry_H264 RefPicList[2][32];
+    SHORT Weights[2][32][3][2];
+    CHAR slice_qs_delta;
+    CHAR slice_qp_delta;
+    UCHAR redundant_pic_cnt;
+    UCHAR direct_spatial_mv_pred_flag;
+    UCHAR cabac_init_idc;
+    UCHAR disable_deblocking_filter_idc;
+    USHORT slice_id;
+};
+
+#pragma pack(pop)
+
+#endif
+
+#endif  // _DXVA_H264_H_
\ No newline at end of file
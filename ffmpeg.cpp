@@ -3,68 +3,251 @@
 #define HAVE_AV_CONFIG_H
 #define __STDC_CONSTANT_MACROS
 #include "common/stdint.h"
+#include <algorithm>
+#include <cassert>
+#include <utility>
 #include <vector>
 
-#include <boost/intrusive_ptr.hpp>
-#include <streams.h>
-#include <dvdmedia.h>
-
-#include "common/guid_def.h"
-#include "common/dshow_util.h"
+#include "band_pool.h"
 #include "common/hardware_env.h"
-#include "common/intrusive_ptr_helper.h"
-#include "podtypes.h"
+#include "log_sink.h"
+#include "PODtypes.h"
 #include "libavcodec/dsputil.h"
 #include "libavcodec/avcodec.h"
 #include "libavcodec/h264.h"
 #include "libswscale/swscale.h"
 
 using boost::shared_ptr;
-using boost::intrusive_ptr;
+
+#if !defined(MAKEFOURCC)
+#define MAKEFOURCC(ch0, ch1, ch2, ch3)                              \
+    (static_cast<uint32>(static_cast<uint8>(ch0)) |                 \
+        (static_cast<uint32>(static_cast<uint8>(ch1)) << 8) |       \
+        (static_cast<uint32>(static_cast<uint8>(ch2)) << 16) |      \
+        (static_cast<uint32>(static_cast<uint8>(ch3)) << 24))
+#endif
 
 extern "C" int av_h264_decode_frame(void*, int*, int64*, const void*, int);
 extern "C" void av_init_packet(AVPacket* p);
 
 namespace
 {
-void releaseCodec(AVCodecContext* cont)
+const int fourCCP010 = MAKEFOURCC('P', '0', '1', '0');
+const int fourCCP016 = MAKEFOURCC('P', '0', '1', '6');
+const int fourCCYV12 = MAKEFOURCC('Y', 'V', '1', '2');
+
+// The spec never needs more frames in the DPB.
+const int maxDPBFrames = 16;
+
+// Fewer rows aren't worth waking a thread for.
+const int minBandHeight = 256;
+
+struct TLevelLimit
 {
-    if (cont)
+    int LevelIDC;
+    int MaxDPBMbs;
+};
+
+// H.264 table A-1. Level 1b shares level_idc 11 with level 1.1 in some
+// profiles, which takes the larger limit.
+const TLevelLimit levelLimits[] = {
+    { 9, 396 },
+    { 10, 396 },
+    { 11, 900 },
+    { 12, 2376 },
+    { 13, 2376 },
+    { 20, 2376 },
+    { 21, 4752 },
+    { 22, 8100 },
+    { 30, 8100 },
+    { 31, 18000 },
+    { 32, 20480 },
+    { 40, 32768 },
+    { 41, 32768 },
+    { 42, 34816 },
+    { 50, 110400 },
+    { 51, 184320 },
+    { 52, 184320 }
+};
+
+int getMaxDPBMbs(int levelIDC)
+{
+    for (int i = 0; i < arraysize(levelLimits); ++i)
+        if (levelLimits[i].LevelIDC == levelIDC)
+            return levelLimits[i].MaxDPBMbs;
+
+    return 0;
+}
+
+// Bytes per sample of the planar 4:2:0 pictures the decoder hands out, 0
+// for anything else. libavcodec keeps 9 and 10-bit samples in formats of
+// their own, only deeper ones come as YUV420P16.
+int planarBytesPerSample(int pixelFormat)
+{
+    switch (pixelFormat)
     {
-        avcodec_close(cont);
-        av_free(cont);
+        case PIX_FMT_YUV420P:
+            return 1;
+        case PIX_FMT_YUV420P9LE:
+        case PIX_FMT_YUV420P10LE:
+        case PIX_FMT_YUV420P16LE:
+            return 2;
+        default:
+            return 0;
     }
 }
 
-struct SupportedType
+PixelFormat planarFormat(int bitDepth)
 {
-    const GUID& SubType;
-    int FourCC;
-};
+    if (bitDepth <= 8)
+        return PIX_FMT_YUV420P;
 
-const SupportedType supportedTypes[] = {
-    { MEDIASUBTYPE_H264, '462H' },
-    { MEDIASUBTYPE_h264, '462h' },
-    { MEDIASUBTYPE_X264, '462X' },
-    { MEDIASUBTYPE_x264, '462x' },
-    { MEDIASUBTYPE_VSSH, 'HSSV' },
-    { MEDIASUBTYPE_vssh, 'hssv' },
-    { MEDIASUBTYPE_DAVC, 'CVAD' },
-    { MEDIASUBTYPE_davc, 'cvad' },
-    { MEDIASUBTYPE_PAVC, 'CVAP' },
-    { MEDIASUBTYPE_pavc, 'cvap' },
-    { MEDIASUBTYPE_AVC1, '1CVA' },
-    { MEDIASUBTYPE_avc1, '1cva' },
-    { MEDIASUBTYPE_H264_bis, '1cva' }
-};
+    if (9 == bitDepth)
+        return PIX_FMT_YUV420P9LE;
 
-int getFourCCFromSubType(const GUID& subType)
+    if (10 == bitDepth)
+        return PIX_FMT_YUV420P10LE;
+
+    return PIX_FMT_YUV420P16LE;
+}
+
+void getVisibleRect(const SPS& sps, int* left, int* top, int* width,
+                    int* height)
 {
-    for (int i = 0; i < arraysize(supportedTypes); ++i)
-        if (supportedTypes[i].SubType == subType)
-            return supportedTypes[i].FourCC;
+    *left = 0;
+    *top = 0;
+
+    // Frame cropping offsets are in chroma sample units, and in field pair
+    // units vertically for interlaced streams.
+    const int fieldFactor = 2 - sps.frame_mbs_only_flag;
+    const int cropUnitX = ((1 == sps.chroma_format_idc) ||
+        (2 == sps.chroma_format_idc)) ? 2 : 1;
+    const int cropUnitY =
+        ((1 == sps.chroma_format_idc) ? 2 : 1) * fieldFactor;
+    const int codedWidth = sps.mb_width * 16;
+    const int codedHeight = sps.mb_height * 16 * fieldFactor;
+    if (!sps.crop)
+    {
+        *width = codedWidth;
+        *height = codedHeight;
+        return;
+    }
 
-    return 0;
+    *left = sps.crop_left * cropUnitX;
+    *top = sps.crop_top * cropUnitY;
+    *width = codedWidth - (sps.crop_left + sps.crop_right) * cropUnitX;
+    *height = codedHeight - (sps.crop_top + sps.crop_bottom) * cropUnitY;
+}
+
+// Offsets and sizes of the NAL units in |data|, framed with |nalLength| byte
+// big-endian lengths or with start codes if it is 0.
+void findNALUnits(const uint8* data, int size, int nalLength,
+                  std::vector<std::pair<int, int> >* nals)
+{
+    if (nalLength)
+    {
+        for (int pos = 0; pos + nalLength <= size;)
+        {
+            int nalSize = 0;
+            for (int i = 0; i < nalLength; ++i)
+                nalSize = (nalSize << 8) | data[pos + i];
+
+            pos += nalLength;
+            if ((nalSize < 0) || (nalSize > size - pos))
+                break;
+
+            nals->push_back(std::make_pair(pos, nalSize));
+            pos += nalSize;
+        }
+
+        return;
+    }
+
+    const int first = static_cast<int>(nals->size());
+    int start = -1;
+    for (int i = 0; i + 2 < size; ++i)
+    {
+        if (data[i] || data[i + 1] || (data[i + 2] != 1))
+            continue;
+
+        if (start >= 0)
+            nals->push_back(std::make_pair(start, i - start));
+
+        start = i + 3;
+        i += 2;
+    }
+
+    if (start >= 0)
+        nals->push_back(std::make_pair(start, size - start));
+
+    // Zeros before the next start code aren't part of the NAL unit.
+    for (int i = first; i < static_cast<int>(nals->size()); ++i)
+        while (((*nals)[i].second > 0) &&
+               !data[(*nals)[i].first + (*nals)[i].second - 1])
+            --(*nals)[i].second;
+}
+
+// Appends the SPS and PPS NAL units of an avcC record, or of parameter sets
+// with start codes, to |packet|, framed with |nalLength| byte big-endian
+// lengths or with start codes if it is 0.
+void appendParameterSets(const uint8* data, int size, int nalLength,
+                         std::vector<uint8>* packet)
+{
+    std::vector<std::pair<int, int> > nals;   // Offset and size
+    if ((size > 6) && (1 == data[0]))
+    {
+        int pos = 5;
+        for (int set = 0; (set < 2) && (pos < size); ++set)
+        {
+            // 5 bits of SPS count, a full byte of PPS count.
+            const int count = data[pos++] & (set ? 0xFF : 0x1F);
+            for (int i = 0; (i < count) && (pos + 2 <= size); ++i)
+            {
+                const int nalSize = (data[pos] << 8) | data[pos + 1];
+                pos += 2;
+                if (pos + nalSize > size)
+                    break;
+
+                nals.push_back(std::make_pair(pos, nalSize));
+                pos += nalSize;
+            }
+        }
+    }
+    else
+    {
+        findNALUnits(data, size, 0, &nals);
+    }
+
+    for (int i = 0; i < static_cast<int>(nals.size()); ++i)
+    {
+        const int nalSize = nals[i].second;
+        if (!nalSize)
+            continue;
+
+        if (nalLength)
+        {
+            for (int b = nalLength - 1; b >= 0; --b)
+                packet->push_back(static_cast<uint8>(nalSize >> (b * 8)));
+        }
+        else
+        {
+            const uint8 startCode[] = {0, 0, 0, 1};
+            packet->insert(packet->end(), startCode,
+                           startCode + arraysize(startCode));
+        }
+
+        const uint8* nal = data + nals[i].first;
+        packet->insert(packet->end(), nal, nal + nalSize);
+    }
+}
+
+void releaseCodec(AVCodecContext* cont)
+{
+    if (cont)
+    {
+        avcodec_close(cont);
+        av_free(cont);
+    }
 }
 
 enum KYCbCrRGBMatrixCoefType
@@ -134,11 +317,53 @@ void initYCbCr2RGBCoef(TYCbCr2RGBCoef* c,
 
 }
 
+// Source planes offset by the SPS cropping, and the output planes they go
+// to. Dst[i] receives source plane i.
+struct CSWScale::TPlanes
+{
+    uint8* Src[4];
+    int SrcStride[4];
+    uint8* Dst[4];
+    stride_t DstStride[4];
+};
+
+class CSWScale::CConvertJob : public CBandPool::CJob
+{
+public:
+    CConvertJob(CSWScale* scale, const TPlanes* planes)
+        : m_scale(scale)
+        , m_planes(planes)
+    {
+    }
+
+    virtual void RunBand(int band) { m_scale->convertBand(*m_planes, band); }
+
+private:
+    CSWScale* m_scale;
+    const TPlanes* m_planes;
+};
+
 CSWScale::CSWScale()
-    : m_cont()
-    , m_width(0)
+    : m_width(0)
     , m_height(0)
     , m_outCsp(0)
+    , m_outFourCC(0)
+    , m_srcLeft(0)
+    , m_srcTop(0)
+    , m_srcWidth(0)
+    , m_srcHeight(0)
+    , m_srcFormat(-1)
+    , m_chromaShiftX(0)
+    , m_chromaShiftY(0)
+    , m_srcBytesPerSample(1)
+    , m_reducePlane(NULL)
+    , m_reduceShift(0)
+    , m_packP01x(NULL)
+    , m_packShift(0)
+    , m_threadCount(1)
+    , m_bandTops()
+    , m_conts()
+    , m_bandPool()
 {
 }
 
@@ -146,24 +371,193 @@ CSWScale::~CSWScale()
 {
 }
 
-bool CSWScale::Init(const CCodecContext& codec, IMediaSample* sample)
+bool CSWScale::Init(const CCodecContext& codec, int width, int height,
+                    int outFourCC)
 {
-    if (m_cont)
-        return true;
-    
-    AM_MEDIA_TYPE* m;
-    if (FAILED(sample->GetMediaType(&m)) || !m)
+    const int outCsp = (fourCCYV12 == outFourCC) ?
+        (FF_CSP_420P | FF_CSP_FLAGS_YUV_ADJ) : FF_CSP_YUY2;
+    setOutputFormat(width, height, outCsp, outFourCC);
+    return initConversion(codec);
+}
+
+bool CSWScale::Convert(const CVideoFrame& frame, void* buf)
+{
+    const AVFrame* rawFrame = const_cast<CVideoFrame&>(frame).getFrame();
+
+    // SPS cropping is applied by offsetting the source planes, no copy.
+    TPlanes planes;
+    for (int i = 0; i < 4; ++i)
+    {
+        const int left = i ? (m_srcLeft >> m_chromaShiftX) : m_srcLeft;
+        const int top = i ? (m_srcTop >> m_chromaShiftY) : m_srcTop;
+        planes.Src[i] = rawFrame->data[i] ?
+            rawFrame->data[i] + top * rawFrame->linesize[i] +
+                left * m_srcBytesPerSample :
+            NULL;
+        planes.SrcStride[i] = rawFrame->linesize[i];
+    }
+
+    uint8* dest = reinterpret_cast<uint8*>(buf);
+    if (m_packP01x)
+    {
+        planes.Dst[0] = dest;
+        planes.Dst[1] = dest + m_width * 2 * m_height;
+        planes.DstStride[0] = m_width * 2;
+        planes.DstStride[1] = m_width * 2;
+    }
+    else if (m_reducePlane)
+    {
+        // YV12 stores V before U.
+        planes.Dst[0] = dest;
+        planes.Dst[2] = dest + m_width * m_height;
+        planes.Dst[1] = planes.Dst[2] + (m_width >> 1) * (m_height >> 1);
+        planes.DstStride[0] = m_width;
+        planes.DstStride[1] = m_width >> 1;
+        planes.DstStride[2] = m_width >> 1;
+    }
+    else
+    {
+        const TcspInfo* outcspInfo = csp_getInfo(m_outCsp);
+        for (int i = 0; i < 4; ++i)
+        {
+            planes.DstStride[i] = m_width >> outcspInfo->shiftX[i];
+            if (!i)
+                planes.Dst[i] = dest;
+            else
+                planes.Dst[i] = planes.Dst[i - 1] + planes.DstStride[i - 1] *
+                    (m_height >> outcspInfo->shiftY[i - 1]);
+        }
+
+        int csp = m_outCsp;
+        if (outcspInfo->id == FF_CSP_420P)
+            csp_yuv_adj_to_plane(csp, outcspInfo, (m_height + 1) / 2 * 2,
+                                 (unsigned char**)planes.Dst,
+                                 planes.DstStride);
+        else
+            csp_yuv_adj_to_plane(csp,outcspInfo, m_height,
+                                 (unsigned char**)planes.Dst,
+                                 planes.DstStride);
+    }
+
+    const int bandCount = static_cast<int>(m_bandTops.size()) - 1;
+    if (m_bandPool && (bandCount > 1))
+    {
+        CConvertJob job(this, &planes);
+        m_bandPool->Run(&job, bandCount);
+    }
+    else
+    {
+        for (int i = 0; i < bandCount; ++i)
+            convertBand(planes, i);
+    }
+
+    return true;
+}
+
+void CSWScale::SetThreadCount(int count)
+{
+    count = std::max(count, 1);
+    if (count == m_threadCount)
+        return;
+
+    // The bands, and the libswscale context of each, are set up again by the
+    // next Init().
+    m_threadCount = count;
+    m_conts.clear();
+    m_reducePlane = NULL;
+    m_packP01x = NULL;
+}
+
+void CSWScale::setOutputFormat(int width, int height, int outCsp,
+                               int outFourCC)
+{
+    if ((width != m_width) || (height != m_height) || (outCsp != m_outCsp) ||
+        (outFourCC != m_outFourCC))
+    {
+        m_width = width;
+        m_height = height;
+        m_outCsp = outCsp;
+        m_outFourCC = outFourCC;
+        m_conts.clear();
+        m_reducePlane = NULL;
+        m_packP01x = NULL;
+    }
+}
+
+bool CSWScale::initConversion(const CCodecContext& codec)
+{
+    // Nothing to do until the output format is known.
+    if (!m_width || !m_height)
         return false;
 
-    BITMAPINFOHEADER header;
-    if (!ExtractBitmapInfoFromMediaType(*m, &header))
+    int left;
+    int top;
+    int width;
+    int height;
+    codec.GetVisibleRect(&left, &top, &width, &height);
+
+    const AVCodecContext* codecCont =
+        const_cast<CCodecContext&>(codec).getCodecContext();
+    if ((!m_conts.empty() || m_reducePlane || m_packP01x) &&
+        (left == m_srcLeft) &&
+        (top == m_srcTop) && (width == m_srcWidth) &&
+        (height == m_srcHeight) && (codecCont->pix_fmt == m_srcFormat))
+        return true;
+
+    m_srcLeft = left;
+    m_srcTop = top;
+    m_srcWidth = width;
+    m_srcHeight = height;
+    m_srcFormat = codecCont->pix_fmt;
+    avcodec_get_chroma_sub_sample(codecCont->pix_fmt, &m_chromaShiftX,
+                                  &m_chromaShiftY);
+    m_srcBytesPerSample = std::max(planarBytesPerSample(codecCont->pix_fmt), 1);
+
+    const bool useSSE2 =
+        !!(codecCont->dsp_mask & CHardwareEnv::PROCESSOR_FEATURE_SSE2);
+
+    // P010/P016 are packed by our own kernels, from either 8-bit or high bit
+    // depth pictures. Anything else has to be 8-bit for libswscale.
+    m_packP01x = NULL;
+    if ((fourCCP010 == m_outFourCC) || (fourCCP016 == m_outFourCC))
+    {
+        if (!planarBytesPerSample(codecCont->pix_fmt))
+            return false;
+
+        m_packP01x = sw_kernels::GetPackP01xFunc(m_srcBytesPerSample, useSSE2);
+        m_packShift = 16 - codec.GetBitDepth();
+        m_conts.clear();
+        m_reducePlane = NULL;
+        initBands(true);
+        return !!m_packP01x;
+    }
+
+    if (m_srcBytesPerSample > 1)
         return false;
 
-    m_width = header.biWidth;
-    m_height = abs(header.biHeight);
-    m_outCsp = (MEDIASUBTYPE_YV12 == m->subtype) ?
-        (FF_CSP_420P | FF_CSP_FLAGS_YUV_ADJ) : FF_CSP_YUY2;
-    DeleteMediaType(m);
+    // Reduced YV12 output (previews) is box filtered straight from the
+    // decoded planes into the sample.
+    m_reducePlane = NULL;
+    if (((FF_CSP_420P | FF_CSP_FLAGS_YUV_ADJ) == m_outCsp) &&
+        (PIX_FMT_YUV420P == codecCont->pix_fmt))
+    {
+        for (int shift = 1; shift <= 2; ++shift)
+        {
+            if (((m_srcWidth >> shift) == m_width) &&
+                ((m_srcHeight >> shift) == m_height))
+            {
+                m_reducePlane = sw_kernels::GetReducePlaneFunc(shift, useSSE2);
+                m_reduceShift = shift;
+            }
+        }
+
+        if (m_reducePlane)
+        {
+            m_conts.clear();
+            initBands(true);
+            return true;
+        }
+    }
 
     TYCbCr2RGBCoef coeffs;
     initYCbCr2RGBCoef(&coeffs, YCBCR_RGB_COEFF_ITUR_BT601, 0, 235, 16, 255.0,
@@ -171,16 +565,18 @@ bool CSWScale::Init(const CCodecContext& codec, IMediaSample* sample)
     int32 swscaleTable[7];
     SwsParams params = {0};
 
-    const AVCodecContext* codecCont =
-        const_cast<CCodecContext&>(codec).getCodecContext();
     if (codecCont->dsp_mask & CHardwareEnv::PROCESSOR_FEATURE_MMX)
         params.cpu |= SWS_CPU_CAPS_MMX | SWS_CPU_CAPS_MMX2;
 
     if (codecCont->dsp_mask & CHardwareEnv::PROCESSOR_FEATURE_3DNOW)
         params.cpu |= SWS_CPU_CAPS_3DNOW;
 
-    params.methodLuma.method = SWS_POINT;
-    params.methodChroma.method = SWS_POINT;
+    // Point resizing only fits the picture into the old output size while the
+    // output media type is being renegotiated after a resolution change.
+    // Reduced output is filtered.
+    const bool reduced = (m_width < m_srcWidth) && (m_height < m_srcHeight);
+    params.methodLuma.method = reduced ? SWS_BILINEAR : SWS_POINT;
+    params.methodChroma.method = reduced ? SWS_BILINEAR : SWS_POINT;
 
     swscaleTable[0] = static_cast<int32>(coeffs.VrMul * 65536 + 0.5);
     swscaleTable[1] = static_cast<int32>(coeffs.UbMul * 65536 + 0.5);
@@ -190,48 +586,119 @@ bool CSWScale::Init(const CCodecContext& codec, IMediaSample* sample)
     swscaleTable[5] = static_cast<int32>(coeffs.YSub * 65536);
     swscaleTable[6] = coeffs.RGBAdd1;
 
-    m_cont.reset(
-        sws_getContext(
-            codecCont->width, codecCont->height,
-            csp_ffdshow2mplayer(csp_lavc2ffdshow(codecCont->pix_fmt)),
-            codecCont->width, codecCont->height,
-            csp_ffdshow2mplayer(m_outCsp), &params,
-            NULL, NULL, swscaleTable),
-        sws_freeContext);
+    // Bands get a context each, which only works out without scaling.
+    const bool splittable =
+        (m_width == m_srcWidth) && (m_height == m_srcHeight);
+    initBands(splittable);
+    m_conts.clear();
+    for (int i = 0; i + 1 < static_cast<int>(m_bandTops.size()); ++i)
+    {
+        const int height = m_bandTops[i + 1] - m_bandTops[i];
+        shared_ptr<void> cont(
+            sws_getContext(
+                m_srcWidth, splittable ? height : m_srcHeight,
+                csp_ffdshow2mplayer(csp_lavc2ffdshow(codecCont->pix_fmt)),
+                m_width, height,
+                csp_ffdshow2mplayer(m_outCsp), &params,
+                NULL, NULL, swscaleTable),
+            sws_freeContext);
+        if (!cont)
+        {
+            m_conts.clear();
+            return false;
+        }
+
+        m_conts.push_back(cont);
+    }
+
     return true;
 }
 
-bool CSWScale::Convert(const CVideoFrame& frame, void* buf)
+void CSWScale::initBands(bool splittable)
 {
-    uint8* dst[4];
-    stride_t srcStride[4];
-    stride_t dstStride[4];
+    int bandCount = 1;
+    if (splittable)
+        bandCount = std::max(1, std::min(m_threadCount,
+                                         m_height / minBandHeight));
+
+    // Whole macroblock rows, so chroma rows line up for any subsampling.
+    const int bandHeight = ((m_height + bandCount - 1) / bandCount + 15) & ~15;
+    m_bandTops.clear();
+    for (int top = 0; top < m_height; top += bandHeight)
+        m_bandTops.push_back(top);
+
+    m_bandTops.push_back(m_height);
+    bandCount = static_cast<int>(m_bandTops.size()) - 1;
+    if (bandCount < 2)
+        m_bandPool.reset();
+    else if (!m_bandPool || (m_bandPool->GetThreadCount() != bandCount - 1))
+        m_bandPool.reset(new CBandPool(bandCount - 1));
+}
+
+void CSWScale::convertBand(const TPlanes& planes, int band)
+{
+    const int top = m_bandTops[band];
+    const int bottom = m_bandTops[band + 1];
+    if (m_packP01x)
+    {
+        // Pictures not yet renegotiated are packed into the top left corner.
+        const int height = std::min(m_height, m_srcHeight);
+        const int first = std::min(top, height);
+        const int rows = std::min(bottom, height) - first;
+        if (rows <= 0)
+            return;
+
+        const uint8* src[3];
+        for (int i = 0; i < 3; ++i)
+            src[i] = planes.Src[i] + (i ? (first >> 1) : first) *
+                planes.SrcStride[i];
+
+        m_packP01x(src, planes.SrcStride,
+                   planes.Dst[0] + first * planes.DstStride[0],
+                   planes.Dst[1] + (first >> 1) * planes.DstStride[1],
+                   planes.DstStride[0], std::min(m_width, m_srcWidth), rows,
+                   m_packShift);
+        return;
+    }
+
+    if (m_reducePlane)
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            const int first = i ? (top >> 1) : top;
+            const int last = i ? (bottom >> 1) : bottom;
+            m_reducePlane(
+                planes.Src[i] + (first << m_reduceShift) * planes.SrcStride[i],
+                planes.SrcStride[i],
+                planes.Dst[i] + first * planes.DstStride[i],
+                planes.DstStride[i], i ? (m_width >> 1) : m_width,
+                last - first);
+        }
 
+        return;
+    }
+
+    // A single band may be scaled, more are cut from an unscaled picture.
+    const int bandCount = static_cast<int>(m_bandTops.size()) - 1;
+    const int srcRows = (bandCount > 1) ? (bottom - top) : m_srcHeight;
     const TcspInfo* outcspInfo = csp_getInfo(m_outCsp);
-    const AVFrame* rawFrame = const_cast<CVideoFrame&>(frame).getFrame();
+    uint8* src[4];
+    stride_t srcStride[4];
+    uint8* dst[4];
+    stride_t dstStride[4];
     for (int i = 0; i < 4; ++i)
     {
-        srcStride[i] = static_cast<stride_t>(rawFrame->linesize[i]);
-        dstStride[i] = m_width >> outcspInfo->shiftX[i];
-        if (!i)
-            dst[i] = reinterpret_cast<uint8*>(buf);
-        else
-            dst[i] = dst[i - 1] + dstStride[i - 1] *
-                (m_height >> outcspInfo->shiftY[i - 1]);
+        const int srcTop = i ? (top >> m_chromaShiftY) : top;
+        src[i] = planes.Src[i] ?
+            planes.Src[i] + srcTop * planes.SrcStride[i] : NULL;
+        srcStride[i] = static_cast<stride_t>(planes.SrcStride[i]);
+        dst[i] = planes.Dst[i] +
+            (top >> outcspInfo->shiftY[i]) * planes.DstStride[i];
+        dstStride[i] = planes.DstStride[i];
     }
 
-    int csp = m_outCsp;
-    if (outcspInfo->id == FF_CSP_420P)
-        csp_yuv_adj_to_plane(csp, outcspInfo, (m_height + 1) / 2 * 2,
-                             (unsigned char**)dst, dstStride);
-    else
-        csp_yuv_adj_to_plane(csp,outcspInfo, m_height,
-                             (unsigned char**)dst,dstStride);
-
-    sws_scale_ordered(reinterpret_cast<SwsContext*>(m_cont.get()),
-                      const_cast<uint8_t**>(rawFrame->data), srcStride, 0,
-                      m_height, dst, dstStride);
-    return true;
+    sws_scale_ordered(reinterpret_cast<SwsContext*>(m_conts[band].get()), src,
+                      srcStride, 0, srcRows, dst, dstStride);
 }
 
 //------------------------------------------------------------------------------
@@ -256,46 +723,9 @@ bool CVideoFrame::GetTime(int64* start, int64* stop)
     return true;
 }
 
-void CVideoFrame::SetTypeSpecificFlags(IMediaSample* sample)
+int64 CVideoFrame::GetPictureTag() const
 {
-    assert(sample);
-    intrusive_ptr<IMediaSample2> sample2;
-    HRESULT r = sample->QueryInterface(IID_IMediaSample2,
-                                       reinterpret_cast<void**>(&sample2));
-    if (FAILED(r))
-        return;
-
-    AM_SAMPLE2_PROPERTIES props;
-    if (SUCCEEDED(sample2->GetProperties(sizeof(props),
-                                         reinterpret_cast<BYTE*>(&props))))
-    {
-        props.dwTypeSpecificFlags &= ~0x7F;
-        AVFrame* frame = m_frame.get();
-        if (!frame->interlaced_frame)
-            props.dwTypeSpecificFlags |= AM_VIDEO_FLAG_WEAVE;
-        else
-        {
-            if(frame->top_field_first)
-                props.dwTypeSpecificFlags |= AM_VIDEO_FLAG_FIELD1FIRST;
-        }
-
-        switch (frame->pict_type)
-        {
-            case FF_I_TYPE :
-            case FF_SI_TYPE :
-                props.dwTypeSpecificFlags |= AM_VIDEO_FLAG_I_SAMPLE;
-                break;
-            case FF_P_TYPE :
-            case FF_SP_TYPE :
-                props.dwTypeSpecificFlags |= AM_VIDEO_FLAG_P_SAMPLE;
-                break;
-            default :
-                props.dwTypeSpecificFlags |= AM_VIDEO_FLAG_B_SAMPLE;
-                break;
-            }
-
-        sample2->SetProperties(sizeof(props), (BYTE*)&props);
-    }
+    return m_frame->reordered_opaque;
 }
 
 inline AVFrame* CVideoFrame::getFrame()
@@ -304,28 +734,28 @@ inline AVFrame* CVideoFrame::getFrame()
 }
 
 //------------------------------------------------------------------------------
-void CCodecContext::ReviseTypeSpecFlags(int firstFieldType, int picType,
-                                        DWORD* flags)
+void CCodecContext::GetPictureFlags(int firstFieldType, int picType,
+                                    bool* progressive, bool* topFieldFirst,
+                                    KCodingType* codingType)
 {
-    assert(flags);
-
-    if (PICT_FRAME == firstFieldType)
-        *flags |= AM_VIDEO_FLAG_WEAVE;
-    else if(PICT_TOP_FIELD == firstFieldType)
-        *flags |= AM_VIDEO_FLAG_FIELD1FIRST;
+    assert(progressive);
+    assert(topFieldFirst);
+    assert(codingType);
 
+    *progressive = (PICT_FRAME == firstFieldType);
+    *topFieldFirst = (PICT_TOP_FIELD == firstFieldType);
     switch (picType)
     {
         case FF_I_TYPE:
         case FF_SI_TYPE:
-            *flags |= AM_VIDEO_FLAG_I_SAMPLE;
+            *codingType = CODING_TYPE_I;
             break;
         case FF_P_TYPE:
         case FF_SP_TYPE:
-            *flags |= AM_VIDEO_FLAG_P_SAMPLE;
+            *codingType = CODING_TYPE_P;
             break;
         default :
-            *flags |= AM_VIDEO_FLAG_B_SAMPLE;
+            *codingType = CODING_TYPE_B;
             break;
     }
 }
@@ -345,32 +775,17 @@ CCodecContext::~CCodecContext()
     }
 }
 
-bool CCodecContext::Init(AVCodec* c, const CMediaType& mediaType)
+bool CCodecContext::Init(AVCodec* c, int fourCC, int width, int height,
+                         int nalLength, const void* extraData,
+                         int extraDataSize)
 {
-    BITMAPINFOHEADER header;
-    if (!ExtractBitmapInfoFromMediaType(mediaType, &header))
-        return false;
-
     AVCodecContext* cont = m_cont.get();
-    cont->width = header.biWidth;
-    cont->height = abs(header.biHeight);
-    cont->codec_tag = header.biCompression;
+    cont->width = width;
+    cont->height = height;
+    cont->codec_tag = fourCC;
+    if (nalLength)
+        cont->nal_length_size = nalLength;
 
-    if (FORMAT_MPEG2Video == *mediaType.FormatType())
-    {
-        if (!header.biCompression)
-        {
-            cont->codec_tag = mediaType.Subtype()->Data1;
-        }
-        else if (('1cva' == cont->codec_tag) || ('1CVA' == cont->codec_tag))
-        {
-            MPEG2VIDEOINFO* m =
-                reinterpret_cast<MPEG2VIDEOINFO*>(mediaType.Format());
-            cont->nal_length_size = m->dwFlags;
-        }
-    }
-
-    cont->codec_tag = getFourCCFromSubType(*mediaType.Subtype());
     cont->workaround_bugs = FF_BUG_AUTODETECT;
     cont->error_concealment = FF_EC_DEBLOCK | FF_EC_GUESS_MVS;
     cont->error_recognition = FF_ER_CAREFUL;
@@ -383,16 +798,35 @@ bool CCodecContext::Init(AVCodec* c, const CMediaType& mediaType)
     cont->release_buffer = avcodec_default_release_buffer;
     cont->reget_buffer = avcodec_default_reget_buffer;
     cont->handle_user_data =
-        reinterpret_cast<void (__cdecl*)(AVCodecContext*,const uint8_t *,int)>(
+        reinterpret_cast<void (*)(AVCodecContext*,const uint8_t *,int)>(
             handleUserData);
 
-    allocExtraData(mediaType);
+    setExtraData(extraData, extraDataSize);
     if (avcodec_open(cont, c) < 0)
         return false;
 
+    if (extraDataSize)
+    {
+        parseExtraData(nalLength);
+        prewarmFramePool();
+    }
+
     return true;
 }
 
+int CCodecContext::GetVideoProfile() const
+{
+    H264Context* info = reinterpret_cast<H264Context*>(m_cont->priv_data);
+    if (!info)
+        return -1;
+
+    SPS* s = info->sps_buffers[0];
+    if (s)
+        return s->profile_idc;
+
+    return -1;
+}
+
 int CCodecContext::GetVideoLevel() const
 {
     H264Context* info = reinterpret_cast<H264Context*>(m_cont->priv_data);
@@ -406,6 +840,19 @@ int CCodecContext::GetVideoLevel() const
     return -1;
 }
 
+int CCodecContext::GetBitDepth() const
+{
+    H264Context* info = reinterpret_cast<H264Context*>(m_cont->priv_data);
+    if (!info)
+        return 8;
+
+    SPS* s = info->sps_buffers[0];
+    if (s && (s->bit_depth_luma > 8))
+        return s->bit_depth_luma;
+
+    return 8;
+}
+
 int CCodecContext::GetRefFrameCount() const
 {
     H264Context* info = reinterpret_cast<H264Context*>(m_cont->priv_data);
@@ -419,6 +866,59 @@ int CCodecContext::GetRefFrameCount() const
     return -1;
 }
 
+// Pictures a decoder may have to hold before the next one in output order is
+// complete.
+int CCodecContext::GetReorderDepth() const
+{
+    H264Context* info = reinterpret_cast<H264Context*>(m_cont->priv_data);
+    if (!info)
+        return -1;
+
+    SPS* s = info->sps_buffers[0];
+    if (!s)
+        return -1;
+
+    // Without the VUI bitstream restrictions any reference frame can be
+    // output late.
+    if (s->bitstream_restriction_flag)
+        return s->num_reorder_frames;
+
+    return s->ref_frame_count;
+}
+
+// libavcodec drops max_dec_frame_buffering while parsing the VUI. It is at
+// least the number of reference frames and the reorder depth, which is what
+// encoders giving the bitstream restrictions set it to. Otherwise the level
+// limit at this picture size applies, as the spec says.
+int CCodecContext::GetDPBFrameCount() const
+{
+    H264Context* info = reinterpret_cast<H264Context*>(m_cont->priv_data);
+    if (!info)
+        return -1;
+
+    SPS* s = info->sps_buffers[0];
+    if (!s || !s->mb_width || !s->mb_height)
+        return -1;
+
+    int frames = maxDPBFrames;
+    if (s->bitstream_restriction_flag)
+    {
+        frames = std::max(s->ref_frame_count, s->num_reorder_frames);
+    }
+    else
+    {
+        const int frameMbs =
+            s->mb_width * s->mb_height * (2 - s->frame_mbs_only_flag);
+        const int maxDPBMbs = getMaxDPBMbs(s->level_idc);
+        if (maxDPBMbs)
+            frames = maxDPBMbs / frameMbs;
+    }
+
+    // Streams exceeding their level still get their reference frames.
+    frames = std::max(frames, s->ref_frame_count);
+    return std::max(1, std::min(frames, maxDPBFrames));
+}
+
 int CCodecContext::GetWidth() const
 {
     return m_cont.get()->width;
@@ -434,6 +934,91 @@ int CCodecContext::GetNALLength() const
     return m_cont.get()->nal_length_size;
 }
 
+void CCodecContext::GetVisibleRect(int* left, int* top, int* width,
+                                   int* height) const
+{
+    assert(left);
+    assert(top);
+    assert(width);
+    assert(height);
+
+    *left = 0;
+    *top = 0;
+    *width = m_cont->width;
+    *height = m_cont->height;
+
+    H264Context* info = reinterpret_cast<H264Context*>(m_cont->priv_data);
+    if (!info)
+        return;
+
+    // No SPS parsed yet.
+    SPS* s = info->sps_buffers[0];
+    if (s && s->mb_width && s->mb_height)
+        getVisibleRect(*s, left, top, width, height);
+}
+
+bool CCodecContext::IsInterlaced() const
+{
+    H264Context* info = reinterpret_cast<H264Context*>(m_cont->priv_data);
+    if (!info)
+        return false;
+
+    SPS* s = info->sps_buffers[0];
+    return s && !s->frame_mbs_only_flag;
+}
+
+void CCodecContext::GetCodedSize(int* width, int* height) const
+{
+    assert(width);
+    assert(height);
+
+    *width = m_cont->width;
+    *height = m_cont->height;
+
+    H264Context* info = reinterpret_cast<H264Context*>(m_cont->priv_data);
+    if (!info)
+        return;
+
+    SPS* s = info->sps_buffers[0];
+    if (s && s->mb_width && s->mb_height)
+    {
+        *width = s->mb_width * 16;
+        *height = s->mb_height * 16 * (2 - s->frame_mbs_only_flag);
+    }
+}
+
+bool CCodecContext::IsIDRPicture() const
+{
+    H264Context* info = reinterpret_cast<H264Context*>(m_cont->priv_data);
+    if (!info)
+        return false;
+
+    return (NAL_IDR_SLICE == info->nal_unit_type);
+}
+
+int CCodecContext::GetRecoveryFrameCount() const
+{
+    // The SEI state is reset at the beginning of every decoded packet, so a
+    // non-negative count means the last packet carried a recovery point.
+    H264Context* info = reinterpret_cast<H264Context*>(m_cont->priv_data);
+    if (!info)
+        return -1;
+
+    return info->sei_recovery_frame_cnt;
+}
+
+// Error resilience counts down the macroblocks of every slice decoded
+// without errors, what is left over was concealed. Frame threads count in
+// contexts of their own.
+bool CCodecContext::HasConcealedErrors() const
+{
+    H264Context* info = reinterpret_cast<H264Context*>(m_cont->priv_data);
+    if (!info || (m_cont->thread_count > 1))
+        return false;
+
+    return info->s.error_count > 0;
+}
+
 bool CCodecContext::IsRefFrameInUse(int frameNum) const
 {
     H264Context* info = reinterpret_cast<H264Context*>(m_cont->priv_data);
@@ -466,6 +1051,11 @@ void CCodecContext::SetThreadNumber(int n)
         avcodec_thread_init(m_cont.get(), n);
 }
 
+void CCodecContext::SetSkipLoopFilter(bool skip)
+{
+    m_cont->skip_loop_filter = skip ? AVDISCARD_ALL : AVDISCARD_DEFAULT;
+}
+
 void CCodecContext::SetSliceLong(void* sliceLong)
 {
     H264Context* info = reinterpret_cast<H264Context*>(m_cont->priv_data);
@@ -479,6 +1069,11 @@ void CCodecContext::UpdateTime(int64 start, int64 stop)
     m_cont.get()->reordered_opaque2 = stop;
 }
 
+void CCodecContext::SetPictureTag(int64 tag)
+{
+    m_cont.get()->reordered_opaque = tag;
+}
+
 void CCodecContext::PreDecodeBuffer(const void* data, int size, int* framePOC,
                                     int* outPOC, int64* startTime)
 {
@@ -519,6 +1114,70 @@ void CCodecContext::FlushBuffers()
     avcodec_flush_buffers(m_cont.get());
 }
 
+// The extradata libavcodec parsed stays, the parameter sets of the new
+// stream are decoded as a packet of their own and replace those with the
+// same IDs.
+void CCodecContext::Reuse(const void* extraData, int extraDataSize)
+{
+    FlushBuffers();
+    SetSliceLong(NULL);
+    SetSkipLoopFilter(false);
+    UpdateTime(0, 0);
+    if (!extraDataSize)
+        return;
+
+    std::vector<uint8> packet;
+    appendParameterSets(reinterpret_cast<const uint8*>(extraData),
+                        extraDataSize, GetNALLength(), &packet);
+    if (packet.empty())
+        return;
+
+    const int size = static_cast<int>(packet.size());
+    packet.resize(size + FF_INPUT_BUFFER_PADDING_SIZE, 0);
+    decodeWithoutPicture(&packet[0], size);
+}
+
+// Fills the frame pool of libavcodec for the DPB, the picture being decoded
+// and the one being output, so the first pictures don't allocate. Done once,
+// as the codec is created and no picture is held yet.
+void CCodecContext::prewarmFramePool()
+{
+    H264Context* info = reinterpret_cast<H264Context*>(m_cont->priv_data);
+    const int frameCount = GetDPBFrameCount();
+    if (!info || (frameCount < 0))
+        return;
+
+    // Frame threads keep pools of their own.
+    AVCodecContext* cont = m_cont.get();
+    const SPS* s = info->sps_buffers[0];
+    if ((cont->thread_count > 1) || (s->chroma_format_idc != 1))
+        return;
+
+    // The pool hands out pictures of the size and format get_buffer() sees,
+    // which are only set by the first slice header. They are set for the
+    // allocation and put back, the slice header sets them for real.
+    const int width = cont->width;
+    const int height = cont->height;
+    const PixelFormat pixelFormat = cont->pix_fmt;
+    int left;
+    int top;
+    getVisibleRect(*s, &left, &top, &cont->width, &cont->height);
+    cont->pix_fmt = planarFormat(s->bit_depth_luma);
+
+    std::vector<AVFrame> frames(frameCount + 2);
+    int allocated = 0;
+    while ((allocated < static_cast<int>(frames.size())) &&
+           (cont->get_buffer(cont, &frames[allocated]) >= 0))
+        ++allocated;
+
+    for (int i = 0; i < allocated; ++i)
+        cont->release_buffer(cont, &frames[i]);
+
+    cont->width = width;
+    cont->height = height;
+    cont->pix_fmt = pixelFormat;
+}
+
 void CCodecContext::handleUserData(AVCodecContext* c, const void* buf,
                                    int bufSize)
 {
@@ -529,42 +1188,37 @@ AVCodecContext* CCodecContext::getCodecContext()
     return m_cont.get();
 }
 
-void CCodecContext::allocExtraData(const CMediaType& mediaType)
+// libavcodec leaves the parameter sets of the extradata to the first packet.
+// Decoding an access unit delimiter parses them now, while the codec is still
+// single threaded, so the picture size, profile and DPB are known at connect.
+void CCodecContext::parseExtraData(int nalLength)
 {
-    const void* data = NULL;
-    int size = 0;
+    AVCodecContext* cont = m_cont.get();
+    const uint8* extraData = cont->extradata;
+    if (!nalLength && (cont->extradata_size > 4) && (1 == extraData[0]))
+        nalLength = (extraData[4] & 3) + 1;
+
+    uint8 packet[6 + FF_INPUT_BUFFER_PADDING_SIZE] = {0};
+    int size = nalLength ? nalLength - 1 : 3;
+    packet[size++] = nalLength ? 2 : 1;
+    packet[size++] = NAL_AUD;
+    packet[size++] = 0xF0;
+    decodeWithoutPicture(packet, size);
+}
 
-    if (FORMAT_VideoInfo == *mediaType.FormatType())
-    {
-        size = mediaType.FormatLength() - sizeof(VIDEOINFOHEADER);
-        data = size ? mediaType.Format() + sizeof(VIDEOINFOHEADER) : NULL;
-    }
-    else if (FORMAT_VideoInfo2 == *mediaType.FormatType())
-    {
-        size = mediaType.FormatLength() - sizeof(VIDEOINFOHEADER2);
-        data = size?mediaType.Format() + sizeof(VIDEOINFOHEADER2) : NULL;
-    }
-    else if (FORMAT_MPEGVideo == *mediaType.FormatType())
-    {
-        MPEG1VIDEOINFO* mpeg1info =
-            reinterpret_cast<MPEG1VIDEOINFO*>(mediaType.Format());
-        if (mpeg1info->cbSequenceHeader)
-        {
-            size = mpeg1info->cbSequenceHeader;
-            data = mpeg1info->bSequenceHeader;
-        }
-    }
-    else if (FORMAT_MPEG2Video == *mediaType.FormatType())
-    {
-        MPEG2VIDEOINFO* mpeg2info =
-            reinterpret_cast<MPEG2VIDEOINFO*>(mediaType.Format());
-        if (mpeg2info->cbSequenceHeader)
-        {
-            size = mpeg2info->cbSequenceHeader;
-            data = reinterpret_cast<const void*>(mpeg2info->dwSequenceHeader);
-        }
-    }
+void CCodecContext::decodeWithoutPicture(const void* data, int size)
+{
+    // A packet without a picture isn't an error then.
+    AVCodecContext* cont = m_cont.get();
+    const AVDiscard skipFrame = cont->skip_frame;
+    cont->skip_frame = AVDISCARD_NONREF;
+    CVideoFrame frame;
+    Decode(&frame, data, size);
+    cont->skip_frame = skipFrame;
+}
 
+void CCodecContext::setExtraData(const void* data, int size)
+{
     if (size)
     {
         m_cont.get()->extradata_size = size;
@@ -576,36 +1230,26 @@ void CCodecContext::allocExtraData(const CMediaType& mediaType)
 }
 
 //------------------------------------------------------------------------------
-bool CFFMPEG::IsSubTypeSupported(const CMediaType& mediaType)
-{
-    for (int i = 0; i < arraysize(supportedTypes); ++i)
-        if (supportedTypes[i].SubType == *mediaType.Subtype())
-            return true;
-
-    return false;
-}
-
 int CFFMPEG::GetInputBufferPaddingSize()
 {
     return FF_INPUT_BUFFER_PADDING_SIZE;
 }
 
-shared_ptr<CCodecContext> CFFMPEG::CreateCodec(const CMediaType& mediaType)
+shared_ptr<CCodecContext> CFFMPEG::CreateCodec(int fourCC, int width,
+                                               int height, int nalLength,
+                                               const void* extraData,
+                                               int extraDataSize)
 {
-    if (IsSubTypeSupported(mediaType))
-    {
-        AVCodec* c = avcodec_find_decoder(CODEC_ID_H264);
-        if (!c)
-            return shared_ptr<CCodecContext>();
+    AVCodec* c = avcodec_find_decoder(CODEC_ID_H264);
+    if (!c)
+        return shared_ptr<CCodecContext>();
 
-        shared_ptr<CCodecContext> cont(new CCodecContext());
-        if (!cont->Init(c, mediaType))
-            return shared_ptr<CCodecContext>();
-
-        return cont;
-    }
+    shared_ptr<CCodecContext> cont(new CCodecContext());
+    if (!cont->Init(c, fourCC, width, height, nalLength, extraData,
+                    extraDataSize))
+        return shared_ptr<CCodecContext>();
 
-    return shared_ptr<CCodecContext>();
+    return cont;
 }
 
 CFFMPEG::CFFMPEG()
@@ -622,9 +1266,5 @@ CFFMPEG::~CFFMPEG()
 
 void CFFMPEG::logCallback(void* p, int level, const char* format, va_list v)
 {
-    const int debugMessageSize = 1024;
-    boost::scoped_array<char> buf(new char[debugMessageSize]);
-    buf[0] = L'\0';
-    _vsnprintf_s(buf.get(), debugMessageSize, debugMessageSize - 1, format, v);
-    OutputDebugStringA(buf.get());
+    CLogSink::get()->Log(level, format, v);
 }
\ No newline at end of file
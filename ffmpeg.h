@@ -1,30 +1,71 @@
 #ifndef _FFMPEG_H_
 #define _FFMPEG_H_
 
+#include <cstdarg>
+#include <vector>
+
 #include <boost/shared_ptr.hpp>
 #include <boost/scoped_array.hpp>
+#include <boost/scoped_ptr.hpp>
 
 #include "chromium/base/singleton.h"
+#include "sw_kernels.h"
 
-struct IMediaSample;
-class CMediaType;
+class CBandPool;
 class CVideoFrame;
 class CCodecContext;
+
+// Large pictures are converted in bands of rows, on a pool of threads of
+// their own. Bands start on macroblock rows, so chroma rows never straddle
+// two bands.
 class CSWScale
 {
 public:
     CSWScale();
     ~CSWScale();
 
-    bool Init(const CCodecContext& codec, IMediaSample* sample);
+    // Converts to a |width| x |height| picture of |outFourCC| (YV12, YUY2, P010
+    // or P016).
+    bool Init(const CCodecContext& codec, int width, int height,
+              int outFourCC);
     bool Convert(const CVideoFrame& frame, void* buf);
     int GetOutCsp() const { return m_outCsp; }
+    int GetWidth() const { return m_width; }
+    int GetHeight() const { return m_height; }
+    int GetOutFourCC() const { return m_outFourCC; }
+
+    // Threads a picture is converted on, the caller's included; 1 by default.
+    void SetThreadCount(int count);
 
 private:
-    boost::shared_ptr<void> m_cont;
+    struct TPlanes;
+    class CConvertJob;
+
+    void setOutputFormat(int width, int height, int outCsp, int outFourCC);
+    bool initConversion(const CCodecContext& codec);
+    void initBands(bool splittable);
+    void convertBand(const TPlanes& planes, int band);
+
     int m_width;
     int m_height;
     int m_outCsp;
+    int m_outFourCC;
+    int m_srcLeft;
+    int m_srcTop;
+    int m_srcWidth;
+    int m_srcHeight;
+    int m_srcFormat;
+    int m_chromaShiftX;
+    int m_chromaShiftY;
+    int m_srcBytesPerSample;
+    sw_kernels::ReducePlaneFunc m_reducePlane;
+    int m_reduceShift;
+    sw_kernels::PackP01xFunc m_packP01x;
+    int m_packShift;
+    int m_threadCount;
+    std::vector<int> m_bandTops;    // Output rows, plus the height
+    std::vector<boost::shared_ptr<void> > m_conts;  // libswscale, per band
+    boost::scoped_ptr<CBandPool> m_bandPool;
 };
 
 //------------------------------------------------------------------------------
@@ -38,7 +79,10 @@ public:
     bool IsComplete() const { return m_isComplete; }
     void SetComplete(bool complete) { m_isComplete = complete; }
     bool GetTime(int64* start, int64* stop);
-    void SetTypeSpecificFlags(IMediaSample* sample);
+
+    // What CCodecContext::SetPictureTag() was given for the packet the
+    // picture started in.
+    int64 GetPictureTag() const;
 
 private:
     friend class CCodecContext;
@@ -55,35 +99,85 @@ struct AVCodecContext;
 class CCodecContext
 {
 public:
-    static void ReviseTypeSpecFlags(int firstFieldType, int picType,
-                                    DWORD* flags);
+    enum KCodingType
+    {
+        CODING_TYPE_I,
+        CODING_TYPE_P,
+        CODING_TYPE_B
+    };
+
+    // Describes a picture whose first field is |firstFieldType| (PICT_*) and
+    // whose slices are |picType| (FF_*_TYPE).
+    static void GetPictureFlags(int firstFieldType, int picType,
+                                bool* progressive, bool* topFieldFirst,
+                                KCodingType* codingType);
 
     CCodecContext();
     ~CCodecContext();
 
-    bool Init(AVCodec* c, const CMediaType& mediaType);
+    // |nalLength| is the size of the AVCC NAL unit lengths, 0 for Annex-B
+    // streams. |extraData| is the avcC record or the Annex-B parameter sets,
+    // which are parsed right away.
+    bool Init(AVCodec* c, int fourCC, int width, int height, int nalLength,
+              const void* extraData, int extraDataSize);
+    int GetVideoProfile() const;
     int GetVideoLevel() const;
+    int GetBitDepth() const;
     int GetRefFrameCount() const;
+    int GetReorderDepth() const;
+
+    // Frames the decoded picture buffer holds, -1 before the SPS is known.
+    int GetDPBFrameCount() const;
+
+    // Whether the SPS allows field pictures, false before it is known.
+    bool IsInterlaced() const;
     int GetWidth() const;
     int GetHeight() const;
     int GetNALLength() const;
+    void GetVisibleRect(int* left, int* top, int* width, int* height) const;
+
+    // The macroblock aligned size the decoder writes, cropping aside.
+    void GetCodedSize(int* width, int* height) const;
+
+    // Of the picture being decoded. Frame threads keep the state of their
+    // pictures to themselves, so these are for a single threaded codec.
+    bool IsIDRPicture() const;
+    int GetRecoveryFrameCount() const;
+
+    // False if unknown, with frame threads.
+    bool HasConcealedErrors() const;
     bool IsRefFrameInUse(int frameNum) const;
     void SetThreadNumber(int n);
+    void SetSkipLoopFilter(bool skip);
     void SetSliceLong(void* sliceLong);
     void UpdateTime(int64 start, int64 stop);
+
+    // Tags the pictures the next packets start, in place of the start time
+    // UpdateTime() gives them. The frame hands the tag back, whichever thread
+    // decoded it.
+    void SetPictureTag(int64 tag);
     void PreDecodeBuffer(const void* data, int size, int* framePOC, int* outPOC,
                          int64* startTime);
     const void* GetPrivateData() const;
     int Decode(CVideoFrame* frame, const void* buf, int size);
     void FlushBuffers();
 
+    // Readies a codec that decoded another stream for one of the same
+    // format, which comes with |extraData|. The frame pool and the decoding
+    // threads are kept, a decoder that wants another thread count sets its
+    // own.
+    void Reuse(const void* extraData, int extraDataSize);
+
 private:
     friend class CSWScale;
 
     static void handleUserData(AVCodecContext* c, const void* buf, int bufSize);
 
     AVCodecContext* getCodecContext();
-    void allocExtraData(const CMediaType& mediaType);
+    void parseExtraData(int nalLength);
+    void prewarmFramePool();
+    void decodeWithoutPicture(const void* data, int size);
+    void setExtraData(const void* data, int size);
 
     boost::shared_ptr<AVCodecContext> m_cont;
     boost::scoped_array<int8> m_extraData;
@@ -93,9 +187,10 @@ private:
 class CFFMPEG : public Singleton<CFFMPEG>
 {
 public:
-    static bool IsSubTypeSupported(const CMediaType& mediaType);
     static int GetInputBufferPaddingSize();
-    static boost::shared_ptr<CCodecContext> CreateCodec(const CMediaType& mediaType);
+    static boost::shared_ptr<CCodecContext> CreateCodec(
+        int fourCC, int width, int height, int nalLength,
+        const void* extraData, int extraDataSize);
 
     CFFMPEG();
     ~CFFMPEG();
@@ -1,9 +1,12 @@
 #include "h264_decoder.h"
 
+#include <algorithm>
 #include <limits>
 
 #include <initguid.h>
 
+#include "decoder_stats.h"
+#include "dshow_adapter.h"
 #include "ffmpeg.h"
 #include "h264_detail.h"
 #include "common/hardware_env.h"
@@ -11,6 +14,7 @@
 #include "common/intrusive_ptr_helper.h"
 #include "chromium/base/platform_thread.h"
 
+using std::deque;
 using std::vector;
 using boost::shared_ptr;
 using boost::intrusive_ptr;
@@ -33,141 +37,42 @@ const int maxSlices = 16;
         PlatformThread::YieldCurrentThread();\
     } while (++retry < maxRetry);\
 }
-}
-
-enum KNALUType
-{
-    NALU_TYPE_SLICE = 1,
-    NALU_TYPE_DPA = 2,
-    NALU_TYPE_DPB = 3,
-    NALU_TYPE_DPC = 4,
-    NALU_TYPE_IDR = 5,
-    NALU_TYPE_SEI = 6,
-    NALU_TYPE_SPS = 7,
-    NALU_TYPE_PPS = 8,
-    NALU_TYPE_AUD = 9,
-    NALU_TYPE_EOSEQ = 10,
-    NALU_TYPE_EOSTREAM = 11,
-    NALU_TYPE_FILL = 12
-};
-
-class CH264NALU
-{
-public:
-    KNALUType GetType() const { return unitType; };
-    bool IsRefFrame() const { return (referenceIdc != 0); };
-
-    int GetDataLength() const { return m_curPos - m_dataPos; };
-    const BYTE* GetDataBuffer() { return m_buffer + m_dataPos; };
-    int GetRoundedDataLength() const
-    {
-        int size = m_curPos - m_dataPos;
-        return size + 128 - (size % 128);
-    }
-
-    int GetLength() const { return m_curPos - m_startPos; };
-    const BYTE* GetNALBuffer() { return m_buffer + m_startPos; };
-    bool IsEOF() const { return m_curPos >= m_size; };
-
-    void SetBuffer (const void* buffer, int size, int NALSize);
-    bool ReadNext();
-    int GetRawDataSize() const { return m_size; }
-    const void* GetRawDataBuffer() const { return m_buffer; }
-
-private:
-    bool moveToNextStartcode();
 
-    int forbiddenBit;       // should be always FALSE
-    int referenceIdc;       // NALU_PRIORITY_xxxx
-    KNALUType unitType;     // NALU_TYPE_xxxx    
+// The pictures the software decoder follows from parsing to output, libavcodec
+// holds no more than a DPB of them back.
+const int maxParsedPictures = 32;
 
-    int m_startPos;         // NALU start (including startcode / size)
-    int m_dataPos;          // Useful part
-    unsigned m_dataLen;     // Length of the NAL unit (Excluding the start
-                            // code, which does not belong to the NALU)
+// More than the pictures one packet holds slices of, which is one or the
+// fields of a pair.
+const int maxPacketPictures = 4;
 
-    const BYTE* m_buffer;
-    int m_curPos;
-    int m_nextRTP;
-    int m_size;
-    int m_NALSize;
-};
+// Pictures after a flush are unclean until this is counted down.
+const int unknownUncleanFrames = std::numeric_limits<int>::max();
 
-void CH264NALU::SetBuffer(const void* buffer, int size, int NALSize)
+void setUncleanFlag(bool clean, DWORD* flags)
 {
-    m_buffer = reinterpret_cast<const BYTE*>(buffer);
-    m_size = size;
-    m_NALSize = NALSize;
-    m_curPos = 0;
-    m_nextRTP = 0;
-
-    m_startPos = 0;
-    m_dataPos = 0;
+    if (clean)
+        *flags &= ~typeSpecificFlagUnclean;
+    else
+        *flags |= typeSpecificFlagUnclean;
 }
 
-bool CH264NALU::moveToNextStartcode()
+void setUncleanFlag(bool clean, IMediaSample* sample)
 {
-    int buffEnd =
-        (m_nextRTP > 0) ? std::min(m_nextRTP, m_size - 4) : m_size - 4;
-
-    for (int i = m_curPos; i < buffEnd; i++)
-    {
-        if ((*(reinterpret_cast<const DWORD*>(m_buffer + i)) & 0x00FFFFFF) ==
-            0x00010000)
-        {
-            // Find next AnnexB Nal
-            m_curPos = i;
-            return true;
-        }
-    }
+    intrusive_ptr<IMediaSample2> sample2;
+    HRESULT r = sample->QueryInterface(IID_IMediaSample2,
+                                       reinterpret_cast<void**>(&sample2));
+    if (FAILED(r))
+        return;
 
-    if (m_NALSize && (m_nextRTP < m_size))
+    AM_SAMPLE2_PROPERTIES props;
+    if (SUCCEEDED(sample2->GetProperties(sizeof(props),
+                                         reinterpret_cast<BYTE*>(&props))))
     {
-        m_curPos = m_nextRTP;
-        return true;
+        setUncleanFlag(clean, &props.dwTypeSpecificFlags);
+        sample2->SetProperties(sizeof(props), reinterpret_cast<BYTE*>(&props));
     }
-
-    m_curPos = m_size;
-    return false;
 }
-
-bool CH264NALU::ReadNext()
-{
-    if (m_curPos >= m_size)
-        return false;
-
-    if (m_NALSize && (m_curPos == m_nextRTP))
-    {
-        // RTP Nalu type : (XX XX) XX XX NAL..., with XX XX XX XX or XX XX equal
-        // to NAL size
-        m_startPos = m_curPos;
-        m_dataPos = m_curPos + m_NALSize;
-        int temp = 0;
-        for (int i = 0; i < m_NALSize; ++i)
-            temp = (temp << 8) + m_buffer[m_curPos++];
-
-        m_nextRTP += temp + m_NALSize;
-        moveToNextStartcode();
-    }
-    else
-    {
-        // Remove trailing bits
-        while (!m_buffer[m_curPos] &&
-            ((*(reinterpret_cast<const DWORD*>(m_buffer + m_curPos)) &
-                0x00FFFFFF) != 0x00010000))
-            m_curPos++;
-
-        // AnnexB Nalu : 00 00 01 NAL...
-        m_startPos = m_curPos;
-        m_curPos += 3;
-        m_dataPos = m_curPos;
-        moveToNextStartcode();
-    }
-
-    forbiddenBit = (m_buffer[m_dataPos]>>7) & 1;
-    referenceIdc = (m_buffer[m_dataPos]>>5) & 3;
-    unitType = static_cast<KNALUType>(m_buffer[m_dataPos] & 0x1f);
-    return true;
 }
 
 //------------------------------------------------------------------------------
@@ -193,6 +98,8 @@ void CH264Decoder::CDecodedPic::Reinit()
     SliceType = 0;
     CodecSpecific = -1;
     DisplayCount = 0;
+    Clean = true;
+    Hidden = false;
     m_sample = NULL;
 }
 
@@ -200,31 +107,121 @@ CH264Decoder::~CH264Decoder()
 {
 }
 
-CH264Decoder::CH264Decoder(const GUID& decoderID, CCodecContext* preDecode)
+CH264Decoder::CH264Decoder(const GUID& decoderID, CCodecContext* preDecode,
+                           CDecoderStats* stats)
     : m_decoderID(decoderID)
     , m_preDecode(preDecode)
-    , m_flushed(false)
+    , m_stats(stats)
+    , m_fastStart(FAST_START_RECOVERY)
+    , m_flushed(true)
+    , m_uncleanFrames(unknownUncleanFrames)
+    , m_frameNum(-1)
+    , m_leadingPictures(false)
+    , m_intraPOC(0)
+    , m_intraFrameNum(-1)
     , m_fieldSurface(-1)
     , m_fieldSample()
     , m_displayCount(1)
 {
     assert(preDecode);
+    assert(stats);
 }
 
 void CH264Decoder::Flush()
 {
     m_flushed = true;
+    m_uncleanFrames = unknownUncleanFrames;
+    m_frameNum = -1;
+    m_leadingPictures = false;
     m_fieldSurface = -1;
     m_fieldSample = NULL;
     m_displayCount = 1;
 }
 
+// An IDR picture is clean at once, a recovery point once frame_num has moved
+// on by its recovery frame count. frame_num only moves on with reference
+// frames: the fields of a pair, and the non-reference pictures ahead of the
+// next reference, share one. An I picture without a recovery point is taken
+// as one with a count of 0.
+//
+// Unlike after an IDR picture, the pictures that follow a non-IDR I picture
+// in decoding order but come out ahead of it, the leading pictures of an open
+// GOP, may refer to the pictures lost with the flush. They are unclean, up to
+// the next reference picture behind the I picture in output order.
+bool CH264Decoder::startPicture(const CH264PictureParser::TPicture& picture,
+                                bool* show, bool* clean)
+{
+    assert(show);
+    assert(clean);
+    if ((picture.FrameNum != m_frameNum) && (m_uncleanFrames > 0) &&
+        (m_uncleanFrames != unknownUncleanFrames))
+        --m_uncleanFrames;
+
+    m_frameNum = picture.FrameNum;
+    bool leading = false;
+    if (m_leadingPictures && picture.HasPOC)
+    {
+        if (picture.POC < m_intraPOC)
+            leading = true;
+        else if (picture.Reference && (picture.FrameNum != m_intraFrameNum))
+            m_leadingPictures = false;
+    }
+
+    const bool wasUnclean = (m_uncleanFrames > 0);
+    if (picture.IDR)
+        m_uncleanFrames = 0;
+    else if (picture.RecoveryFrameCount >= 0)
+        m_uncleanFrames =
+            std::min(m_uncleanFrames, picture.RecoveryFrameCount);
+    else if (picture.Intra)
+        m_uncleanFrames = 0;
+
+    if (picture.IDR)
+    {
+        m_leadingPictures = false;
+    }
+    else if (picture.Intra && wasUnclean && !m_uncleanFrames &&
+             picture.HasPOC)
+    {
+        m_leadingPictures = true;
+        m_intraPOC = picture.POC;
+        m_intraFrameNum = picture.FrameNum;
+    }
+
+    // Streams using intra refresh may never send an I picture.
+    if (picture.IDR || picture.Intra || (picture.RecoveryFrameCount >= 0))
+        m_flushed = false;
+
+    // The clean policy decodes from the same point as the recovery one, the
+    // pictures predicted from it need the references.
+    *clean = !m_uncleanFrames && !leading;
+    switch (m_fastStart)
+    {
+        case FAST_START_CLEAN:
+            *show = *clean;
+            return !m_flushed;
+        case FAST_START_RECOVERY:
+            *show = !m_flushed;
+            return !m_flushed;
+        default:
+            *show = true;
+            return true;
+    }
+}
+
 //------------------------------------------------------------------------------
-CH264SWDecoder::CH264SWDecoder(CCodecContext* preDecode)
-    : CH264Decoder(GUID_NULL, preDecode)
+CH264SWDecoder::CH264SWDecoder(CCodecContext* preDecode,
+                               CDecoderStats* stats, const void* extraData,
+                               int extraDataSize)
+    : CH264Decoder(GUID_NULL, preDecode, stats)
     , m_frame(new CVideoFrame)
     , m_scale(new CSWScale)
+    , m_threads()
+    , m_decoding(false)
+    , m_parser()
+    , m_parsedPictures()
 {
+    m_parser.Init(extraData, extraDataSize, preDecode->GetNALLength());
 }
 
 CH264SWDecoder::~CH264SWDecoder()
@@ -234,32 +231,231 @@ CH264SWDecoder::~CH264SWDecoder()
 bool CH264SWDecoder::Init(const DDPIXELFORMAT& pixelFormat,
                           int64 averageTimePerFrame)
 {
-    getPreDecode()->SetThreadNumber(
-        CHardwareEnv::get()->GetNumOfLogicalProcessors());
+    // The parameter sets of the media type are parsed by now, so the threads
+    // are set up before the first Decode() rather than by it. A format change
+    // in the middle of the stream keeps the threads.
+    if (!m_decoding)
+    {
+        const double frameRate = (averageTimePerFrame > 0) ?
+            10000000.0 / averageTimePerFrame : 0.0;
+        m_threads.reset(new CThreadBudget::CClient(frameRate));
+        applyThreadBudget();
+    }
+
+    getStats()->SetSurfaceOccupancy(0, 0);
     return true;
 }
 
 HRESULT CH264SWDecoder::Decode(const void* data, int size, int64 start,
-                               int64 stop, IMediaSample* outSample,
+                               int64 stop, CH264OutputSink* sink,
                                int* bytesUsed)
 {
-    if (!m_scale->Init(*getPreDecode(), outSample))
-        return E_FAIL;
+    assert(sink);
+    assert(bytesUsed);
+
+    // libavcodec consumes H.264 packets whole, so each is parsed once.
+    const bool startsIDR = trackPictures(data, size);
+
+    // Picks up the share of the thread budget, which moves as other streams
+    // start and stop or the SPS shows up, after a flush. Nothing after an IDR
+    // picture refers to the pictures before it, so when the share has moved
+    // the codec is drained and flushed there too.
+    int width;
+    int height;
+    getCodedSize(&width, &height);
+    if (m_decoding && startsIDR && m_threads->IsOutdated(width, height))
+    {
+        HRESULT r = drain(sink);
+        if (FAILED(r))
+            return r;
+
+        getPreDecode()->FlushBuffers();
+        m_decoding = false;
+    }
+
+    if (!m_decoding)
+    {
+        applyThreadBudget();
+        m_decoding = true;
+    }
+
+    if (!m_parsedPictures.empty())
+        getPreDecode()->SetPictureTag(m_parsedPictures.back().Picture.Number);
 
-    int usedBytes = getPreDecode()->Decode(m_frame.get(), data, size);
+    int usedBytes;
+    {
+        CDecoderStats::CStageTimer timer(getStats(),
+                                         CDecoderStats::STAGE_DECODE);
+        usedBytes = getPreDecode()->Decode(m_frame.get(), data, size);
+    }
+    if (usedBytes < 0) // Broken data, drop the rest of the buffer.
+        return S_FALSE;
+
+    *bytesUsed = usedBytes;
     if (!m_frame->IsComplete()) // Not enough data to build a frame.
         return S_OK;
 
-    BYTE* buf;
-    HRESULT r = outSample->GetPointer(&buf);
+    return outputFrame(sink);
+}
+
+HRESULT CH264SWDecoder::outputFrame(CH264OutputSink* sink)
+{
+    getStats()->Count(CDecoderStats::COUNTER_FRAMES_DECODED);
+    if (getPreDecode()->HasConcealedErrors())
+        getStats()->Count(CDecoderStats::COUNTER_FRAMES_CONCEALED);
+
+    // libavcodec has decoded the picture by now, whatever the policy.
+    bool show;
+    bool clean;
+    if (!takeParsedPicture(m_frame->GetPictureTag(), &show, &clean) ||
+        !show)
+    {
+        getStats()->Count(CDecoderStats::COUNTER_FRAMES_DROPPED);
+        return S_OK;
+    }
+
+    intrusive_ptr<IMediaSample> outSample;
+    HRESULT r =
+        sink->GetOutputSample(reinterpret_cast<IMediaSample**>(&outSample));
     if (FAILED(r))
         return r;
 
-    if (!m_scale->Convert(*m_frame, buf))
+    setUncleanFlag(clean, outSample.get());
+    if (!clean)
+        getStats()->Count(CDecoderStats::COUNTER_FRAMES_UNCLEAN);
+
+    // Initialize after decoding, since a new SPS may have changed the picture
+    // size.
+    if (!dshow_adapter::InitScale(*getPreDecode(), outSample.get(),
+                                  m_scale.get()))
         return E_FAIL;
 
-    *bytesUsed = usedBytes;
-    return S_OK;
+    BYTE* buf;
+    r = outSample->GetPointer(&buf);
+    if (FAILED(r))
+        return r;
+
+    {
+        CDecoderStats::CStageTimer timer(getStats(),
+                                         CDecoderStats::STAGE_CONVERSION);
+        if (!m_scale->Convert(*m_frame, buf))
+            return E_FAIL;
+    }
+
+    return sink->DeliverOutputSample(outSample.get());
+}
+
+// Empty packets push out the pictures libavcodec holds back for reordering.
+HRESULT CH264SWDecoder::drain(CH264OutputSink* sink)
+{
+    for (;;)
+    {
+        getPreDecode()->Decode(m_frame.get(), NULL, 0);
+        if (!m_frame->IsComplete())
+            return S_OK;
+
+        HRESULT r = outputFrame(sink);
+        if (FAILED(r))
+            return r;
+    }
+}
+
+// The codec has been flushed by now, so its threads can be changed again.
+void CH264SWDecoder::Flush()
+{
+    m_decoding = false;
+    m_parser.Reset();
+    m_parsedPictures.clear();
+    CH264Decoder::Flush();
+}
+
+// The frames come out reordered, so what startPicture() needs is taken from
+// each packet before it is decoded. Frame threads keep what libavcodec parses
+// to themselves, the packets are parsed here.
+bool CH264SWDecoder::trackPictures(const void* data, int size)
+{
+    CH264PictureParser::TPicture pictures[maxPacketPictures];
+    const int count = m_parser.Parse(data, size, pictures, maxPacketPictures);
+    bool startsIDR = false;
+    for (int i = 0; i < count; ++i)
+    {
+        if (!m_parsedPictures.empty() &&
+            (m_parsedPictures.back().Picture.Number == pictures[i].Number))
+        {
+            m_parsedPictures.back().Picture = pictures[i];
+            continue;
+        }
+
+        // The previous picture is complete, its turn in decoding order has
+        // come.
+        if (!m_parsedPictures.empty() && !m_parsedPictures.back().Started)
+            startParsedPicture(&m_parsedPictures.back());
+
+        TParsedPicture picture;
+        picture.Picture = pictures[i];
+        picture.Started = false;
+        picture.Show = false;
+        picture.Clean = false;
+        m_parsedPictures.push_back(picture);
+        startsIDR = startsIDR || picture.Picture.IDR;
+
+        // Pictures libavcodec never outputs are forgotten.
+        if (static_cast<int>(m_parsedPictures.size()) > maxParsedPictures)
+            m_parsedPictures.pop_front();
+    }
+
+    return startsIDR;
+}
+
+void CH264SWDecoder::startParsedPicture(TParsedPicture* picture)
+{
+    startPicture(picture->Picture, &picture->Show, &picture->Clean);
+    picture->Started = true;
+}
+
+// Returns false for a frame that wasn't parsed since the flush.
+bool CH264SWDecoder::takeParsedPicture(int64 number, bool* show, bool* clean)
+{
+    assert(show);
+    assert(clean);
+    for (deque<TParsedPicture>::iterator i = m_parsedPictures.begin();
+         i != m_parsedPictures.end(); ++i)
+    {
+        if (i->Picture.Number != number)
+            continue;
+
+        // Without reordering a frame comes out before the next picture.
+        if (!i->Started)
+            startParsedPicture(&*i);
+
+        *show = i->Show;
+        *clean = i->Clean;
+        m_parsedPictures.erase(i);
+        return true;
+    }
+
+    return false;
+}
+
+void CH264SWDecoder::getCodedSize(int* width, int* height) const
+{
+    if (!m_parser.GetCodedSize(width, height))
+    {
+        *width = 0;
+        *height = 0;
+    }
+}
+
+void CH264SWDecoder::applyThreadBudget()
+{
+    int width;
+    int height;
+    getCodedSize(&width, &height);
+    if (m_threads->Apply(getPreDecode(), width, height))
+        getStats()->SetThreadCount(m_threads->GetThreadCount());
+
+    // Band conversion shares the stream's threads rather than every core.
+    m_scale->SetThreadCount(m_threads->GetThreadCount());
 }
 
 //------------------------------------------------------------------------------
@@ -344,20 +540,23 @@ DXVA_BufferDescription* CH264DXVA1Decoder::CDXVABuffers::GetBufferDesc()
 
 CH264DXVA1Decoder::CH264DXVA1Decoder(const GUID& decoderID,
                                      CCodecContext* preDecode,
+                                     CDecoderStats* stats,
                                      IAMVideoAccelerator* accel,
                                      int picEntryCount)
-    : CH264Decoder(decoderID, preDecode)
+    : CH264Decoder(decoderID, preDecode, stats)
     , m_accel(accel)
     , m_picParams()
     , m_sliceLong()
     , m_sliceShort()
     , m_useLongSlice(false)
+    , m_buildBitStream(NULL)
     , m_decodedPics()
     , m_execBuffers(accel)
     , m_outPOC(-1)
     , m_outStart(std::numeric_limits<int64>::min())
     , m_lastFrameTime(0)
     , m_estTimePerFrame(1)
+    , m_bumpedStart(std::numeric_limits<int64>::min())
 {
     assert(accel);
 
@@ -399,6 +598,10 @@ bool CH264DXVA1Decoder::Init(const DDPIXELFORMAT& pixelFormat,
 {
     assert(m_accel);
 
+    // The pre-decode parse is single threaded, a software decoder of the
+    // same connection or of the cached codec may have left threads.
+    getPreDecode()->SetThreadNumber(1);
+
     DXVA_ConfigPictureDecode configRequested;
     memset(&configRequested, 0, sizeof(configRequested));
     configRequested.guidConfigBitstreamEncryption = DXVA_NoEncrypt;
@@ -439,47 +642,87 @@ bool CH264DXVA1Decoder::Init(const DDPIXELFORMAT& pixelFormat,
 
     getPreDecode()->SetSliceLong(&m_sliceLong[0]);
     m_useLongSlice = (config.bConfigBitstreamRaw != 2);
+    m_buildBitStream = h264_detail::GetBitStreamBuilder(
+        m_useLongSlice, getPreDecode()->GetNALLength());
+    if (!m_buildBitStream)
+        return false;
+
     m_estTimePerFrame = averageTimePerFrame;
+    getStats()->SetThreadCount(0);
+    updateSurfaceOccupancy();
     return true;
 }
 
 HRESULT CH264DXVA1Decoder::Decode(const void* data, int size, int64 start,
-                                  int64 stop, IMediaSample* outSample,
+                                  int64 stop, CH264OutputSink* sink,
                                   int* bytesUsed)
 {
     assert(data);
+    assert(sink);
     assert(bytesUsed);
     assert(getPreDecode());
 
     int framePOC;
     int outPOC;
     int64 startTime;
-    getPreDecode()->PreDecodeBuffer(data, size, &framePOC, &outPOC, &startTime);
-    TRACE(L"\n Predecode done. framePOC: %d, outPOC: %d, start: %.4f",
-          framePOC, outPOC, startTime / 10000000.0f);
+    {
+        CDecoderStats::CStageTimer timer(getStats(),
+                                         CDecoderStats::STAGE_PRE_DECODE);
+        getPreDecode()->PreDecodeBuffer(data, size, &framePOC, &outPOC,
+                                        &startTime);
+        timer.SetPicture(-1, framePOC);
+    }
 
     // If parsing fail (probably no PPS/SPS), continue anyway it may arrived
     // later (happen on truncated streams).
     int fieldType;
     int sliceType;
-    if (FAILED(h264_detail::BuildPicParams(getPreDecode(), &m_picParams,
-                                           &fieldType, &sliceType)))
-        return S_FALSE;
-
     DXVA_Qmatrix_H264 scalingMatrix;
-    if (FAILED(h264_detail::BuildScalingMatrix(getPreDecode(), &scalingMatrix)))
-        return S_FALSE;
+    {
+        CDecoderStats::CStageTimer timer(getStats(),
+                                         CDecoderStats::STAGE_PIC_PARAMS);
+        if (FAILED(h264_detail::BuildPicParams(getPreDecode(), &m_picParams,
+                                               &fieldType, &sliceType)))
+            return S_FALSE;
+
+        if (FAILED(h264_detail::BuildScalingMatrix(getPreDecode(),
+                                                   &scalingMatrix)))
+            return S_FALSE;
+    }
 
-    // Wait I frame after a flush.
-    if (getFlushed() && !m_picParams.IntraPicFlag)
+    // The pre-decode codec is single threaded, what it parsed is current.
+    CH264PictureParser::TPicture picture = CH264PictureParser::TPicture();
+    picture.IDR = getPreDecode()->IsIDRPicture();
+    picture.Intra = !!m_picParams.IntraPicFlag;
+    picture.Reference = !!m_picParams.RefPicFlag;
+    picture.FrameNum = m_picParams.frame_num;
+    picture.HasPOC = true;
+    picture.POC = framePOC;
+    picture.RecoveryFrameCount = getPreDecode()->GetRecoveryFrameCount();
+
+    // Hidden pictures are decoded only if something may refer to them. The
+    // second field of a pair always is, to keep the pair together.
+    bool show;
+    bool clean;
+    if (!startPicture(picture, &show, &clean) ||
+        (!show && !m_picParams.RefPicFlag && !m_picParams.field_pic_flag))
+    {
+        getStats()->Count(CDecoderStats::COUNTER_FRAMES_DROPPED);
         return S_FALSE;
+    }
 
     int surfaceIndex;
     intrusive_ptr<IMediaSample> sampleToDeliver;
-    HRESULT r = getFreeSurfaceIndex(&surfaceIndex, &sampleToDeliver);
+    HRESULT r = getFreeSurfaceIndex(sink, &surfaceIndex, &sampleToDeliver);
     if (FAILED(r))
         return r;
 
+    if (-1 == surfaceIndex)
+    {
+        getStats()->Count(CDecoderStats::COUNTER_FRAMES_DROPPED);
+        return S_FALSE;
+    }
+
     h264_detail::SetCurrentPicIndex(surfaceIndex, &m_picParams, getPreDecode());
 
     r = beginFrame(surfaceIndex);
@@ -533,16 +776,19 @@ HRESULT CH264DXVA1Decoder::Decode(const void* data, int size, int64 start,
         return r;
 
     r = endFrame(surfaceIndex);
+    if (SUCCEEDED(r))
+        getStats()->Count(CDecoderStats::COUNTER_FRAMES_DECODED);
 
     bool added = addToStandby(surfaceIndex, sampleToDeliver,
                               m_picParams.RefPicFlag, start, stop,
                               m_picParams.field_pic_flag, fieldType, sliceType,
-                              framePOC);
+                              framePOC, clean, show);
     h264_detail::UpdateRefFramesList(&m_picParams, getPreDecode());
     clearUnusedRefFrames();
+    updateSurfaceOccupancy();
     if (added)
     {
-        r = displayNextFrame(outSample);
+        r = displayNextFrame(sink);
         if (outPOC != std::numeric_limits<int>::min())
         {
             m_outPOC = outPOC;
@@ -550,7 +796,6 @@ HRESULT CH264DXVA1Decoder::Decode(const void* data, int size, int64 start,
         }
     }
 
-    setFlushed(false);
     *bytesUsed = size;
     return S_OK;
 }
@@ -562,12 +807,16 @@ void CH264DXVA1Decoder::Flush()
 
     m_outPOC = -1;
     m_lastFrameTime = 0;
+    m_bumpedStart = std::numeric_limits<int64>::min();
     CH264Decoder::Flush();
+    updateSurfaceOccupancy();
 }
 
 HRESULT CH264DXVA1Decoder::getFreeSurfaceIndex(
-    int* surfaceIndex, intrusive_ptr<IMediaSample>* sampleToDeliver)
+    CH264OutputSink* sink, int* surfaceIndex,
+    intrusive_ptr<IMediaSample>* sampleToDeliver)
 {
+    assert(sink);
     assert(surfaceIndex);
     assert(sampleToDeliver);
 
@@ -579,6 +828,20 @@ HRESULT CH264DXVA1Decoder::getFreeSurfaceIndex(
         return S_FALSE;
     }
 
+    // -1 if every surface holds a picture the codec still predicts from, the
+    // picture is then dropped.
+    *surfaceIndex = findFreeSurface();
+    if (-1 == *surfaceIndex)
+    {
+        getStats()->Count(CDecoderStats::COUNTER_SURFACE_EXHAUSTED);
+        return recoverSurface(sink, surfaceIndex);
+    }
+
+    return S_OK;
+}
+
+int CH264DXVA1Decoder::findFreeSurface()
+{
     int findResult = -1;
     int minDisplay = std::numeric_limits<int>::max();
     for (int i = 0; i < static_cast<int>(m_decodedPics.size()); ++i)
@@ -591,15 +854,43 @@ HRESULT CH264DXVA1Decoder::getFreeSurfaceIndex(
         }
     }
 
-    if (findResult != -1)
+    return findResult;
+}
+
+// Makes room without dropping the DPB, so decoding goes on without waiting
+// for the next I frame: surfaces the codec no longer references are freed,
+// then undisplayed pictures are shown ahead of their turn, which frees the
+// references among them the codec is done with. References still in use are
+// never taken away, the pictures predicted from them would be corrupt.
+HRESULT CH264DXVA1Decoder::recoverSurface(CH264OutputSink* sink,
+                                          int* surfaceIndex)
+{
+    clearUnusedRefFrames();
+    *surfaceIndex = findFreeSurface();
+    HRESULT r = S_OK;
+    while (-1 == *surfaceIndex)
     {
-        *surfaceIndex = findResult;
-        return S_OK;
+        const int undisplayed = findUndisplayedFrame();
+        if (-1 == undisplayed)
+            break;
+
+        // Shown in time order, as displayNextFrame() does.
+        CDecodedPic& pic = m_decodedPics[undisplayed];
+        if (pic.Start <= m_bumpedStart)
+            pic.Hidden = true;
+        else
+            m_bumpedStart = pic.Start;
+
+        r = displayFrame(undisplayed, sink);
+        if (FAILED(r))
+            break;
+
+        clearUnusedRefFrames();
+        *surfaceIndex = findFreeSurface();
     }
 
-    assert(false);
-    Flush();
-    return E_UNEXPECTED;
+    updateSurfaceOccupancy();
+    return FAILED(r) ? r : S_OK;
 }
 
 HRESULT CH264DXVA1Decoder::beginFrame(int surfaceIndex)
@@ -611,6 +902,9 @@ HRESULT CH264DXVA1Decoder::beginFrame(int surfaceIndex)
     info.dwSizeOutputData = 0;
     info.pOutputData = NULL;
 
+    CDecoderStats::CStageTimer timer(getStats(),
+                                     CDecoderStats::STAGE_ACCELERATOR_WAIT);
+    timer.SetPicture(surfaceIndex, m_picParams.CurrFieldOrderCnt[0]);
     HRESULT r;
     for (int i = 0; i < 20; ++i)
     {
@@ -639,6 +933,7 @@ HRESULT CH264DXVA1Decoder::endFrame(int surfaceIndex)
 
 HRESULT CH264DXVA1Decoder::execute()
 {
+    CDecoderStats::CStageTimer timer(getStats(), CDecoderStats::STAGE_EXECUTE);
     DWORD func = 0x01000000;
     int32 result;
     HRESULT r = m_accel->Execute(
@@ -652,92 +947,19 @@ HRESULT CH264DXVA1Decoder::execute()
     return r;
 }
 
-bool CH264DXVA1Decoder::updateRefFrameSliceLong(int slice, int dataOffset,
-                                                int sliceLength)
-{
-    if (slice >= static_cast<int>(m_sliceLong.size()))
-        return false;
-
-    m_sliceLong[slice].BSNALunitDataLocation = dataOffset;
-    m_sliceLong[slice].SliceBytesInBuffer = sliceLength;
-    m_sliceLong[slice].slice_id = slice;
-    h264_detail::UpdateRefFrameSliceLong(&m_picParams, getPreDecode(),
-                                         &m_sliceLong[slice]);
-    if (slice)
-    {
-        m_sliceLong[slice].NumMbsForSlice =
-            m_sliceLong[slice].first_mb_in_slice -
-            m_sliceLong[slice - 1].first_mb_in_slice;
-
-        m_sliceLong[slice - 1].NumMbsForSlice =
-            m_sliceLong[slice].NumMbsForSlice;
-    }
-    return true;
-}
-
-bool CH264DXVA1Decoder::updateRefFrameSliceShort(int slice, int dataOffset,
-                                                 int sliceLength)
-{
-    if (slice >= static_cast<int>(m_sliceShort.size()))
-        return false;
-
-    m_sliceShort[slice].BSNALunitDataLocation = dataOffset;
-    m_sliceShort[slice].SliceBytesInBuffer = sliceLength;
-    return true;
-}
-
 int CH264DXVA1Decoder::buildBitStreamAndRefFrameSlice(const void* data,
                                                       int size, void* dest)
 {
     assert(data);
     assert(dest);
-
-    CH264NALU block;
-    block.SetBuffer(data, size, getPreDecode()->GetNALLength());
-
-    bool (CH264DXVA1Decoder::*updateFunc)(int, int, int) =
-        m_useLongSlice ?
-            &CH264DXVA1Decoder::updateRefFrameSliceLong :
-            &CH264DXVA1Decoder::updateRefFrameSliceShort;
-
-    int8* destCursor = reinterpret_cast<int8*>(dest);
-    int dataOffset = 0;
-    int slice = 0;
-    while (block.ReadNext())
-    {
-        if ((NALU_TYPE_SLICE == block.GetType()) ||
-            (NALU_TYPE_IDR == block.GetType()))
-        {
-            // Skip the NALU if the data length is below 0.
-            if (block.GetDataLength() < 0)
-                break;
-
-            // For AVC1, put startcode 0x000001
-            destCursor[0] = 0;
-            destCursor[1] = 0;
-            destCursor[2] = 1;
-
-            // Copy NALU
-            memcpy(destCursor + 3, block.GetDataBuffer(),
-                   block.GetDataLength());
-
-            // Update slice control buffer
-            int NALLength = block.GetDataLength() + 3;
-            if (!(this->*updateFunc)(slice, dataOffset, NALLength))
-                break;
-
-            dataOffset += NALLength;
-            destCursor += NALLength;
-            slice++;
-        }
-    }
-
-    // Complete with zero padding (buffer size should be a multiple of 128)
-    int padding  = 128 - (dataOffset % 128);
-    memset(destCursor, 0, padding);
-    m_sliceLong[slice - 1].SliceBytesInBuffer += padding;
-    m_sliceShort[slice - 1].SliceBytesInBuffer += padding;
-    m_execBuffers.ReviseLastDataSize(dataOffset + padding);
+    assert(m_buildBitStream);
+
+    int destSize;
+    const int slice = m_buildBitStream(
+        data, size, getPreDecode(), &m_picParams,
+        m_useLongSlice ? &m_sliceLong[0] : NULL,
+        m_useLongSlice ? NULL : &m_sliceShort[0], maxSlices, dest, &destSize);
+    m_execBuffers.ReviseLastDataSize(destSize);
     return slice;
 }
 
@@ -745,7 +967,8 @@ bool CH264DXVA1Decoder::addToStandby(int surfaceIndex,
                                      const intrusive_ptr<IMediaSample>& sample,
                                      bool isRefPicture, int64 start, int64 stop,
                                      bool isField, int fieldType, int sliceType,
-                                     int codecSpecific)
+                                     int codecSpecific, bool clean,
+                                     bool show)
 {
     CDecodedPic& ref = m_decodedPics[surfaceIndex];
     if (isField && (-1 == getFieldSurface()))
@@ -756,6 +979,8 @@ bool CH264DXVA1Decoder::addToStandby(int surfaceIndex,
         ref.Start = start;
         ref.Stop = stop;
         ref.CodecSpecific = codecSpecific;
+        ref.Clean = clean;
+        ref.Hidden = !show;
         return false;
     }
 
@@ -775,6 +1000,13 @@ bool CH264DXVA1Decoder::addToStandby(int surfaceIndex,
         ref.Stop = stop;
         ref.FirstFieldType = fieldType;
         ref.CodecSpecific = codecSpecific;
+        ref.Clean = clean;
+        ref.Hidden = !show;
+    }
+    else
+    {
+        ref.Clean = ref.Clean && clean;
+        ref.Hidden = ref.Hidden || !show;
     }
 
     setFieldSurface(-1);
@@ -839,6 +1071,31 @@ int CH264DXVA1Decoder::findEarliestFrame()
     return index;
 }
 
+// The undisplayed picture first in display order, whether or not its turn
+// has come. It keeps the time it was decoded with, only a picture without
+// one is timed after the last picture shown.
+int CH264DXVA1Decoder::findUndisplayedFrame()
+{
+    int index = -1;
+    for (int i = 0; i < static_cast<int>(m_decodedPics.size()); ++i)
+    {
+        if (m_decodedPics[i].InUse && !m_decodedPics[i].Displayed)
+        {
+            if ((-1 == index) || (m_decodedPics[i].CodecSpecific <
+                                  m_decodedPics[index].CodecSpecific))
+                index = i;
+        }
+    }
+
+    if ((index >= 0) && (m_decodedPics[index].Start < 0))
+    {
+        m_decodedPics[index].Start = m_lastFrameTime;
+        m_decodedPics[index].Stop = m_lastFrameTime + m_estTimePerFrame;
+    }
+
+    return index;
+}
+
 void CH264DXVA1Decoder::setTypeSpecificFlags(const CDecodedPic& pic,
                                              IMediaSample* sample)
 {
@@ -854,36 +1111,72 @@ void CH264DXVA1Decoder::setTypeSpecificFlags(const CDecodedPic& pic,
                                         reinterpret_cast<BYTE*>(&props))))
     {
         props.dwTypeSpecificFlags &= ~0x7F;
-        CCodecContext::ReviseTypeSpecFlags(pic.FirstFieldType, pic.SliceType,
+        dshow_adapter::ReviseTypeSpecFlags(pic.FirstFieldType, pic.SliceType,
                                            &props.dwTypeSpecificFlags);
+        setUncleanFlag(pic.Clean, &props.dwTypeSpecificFlags);
 
         sample2->SetProperties(sizeof(props),
                                reinterpret_cast<BYTE*>(&props));
     }
 }
 
-HRESULT CH264DXVA1Decoder::displayNextFrame(IMediaSample* sample)
+// Pictures whose turn comes after a later one was shown ahead of it would go
+// out backwards in time, they are dropped instead.
+HRESULT CH264DXVA1Decoder::displayNextFrame(CH264OutputSink* sink)
 {
     int earliest = findEarliestFrame();
     if (earliest < 0)
         return S_FALSE;
 
+    if (m_decodedPics[earliest].Start <= m_bumpedStart)
+        m_decodedPics[earliest].Hidden = true;
+
+    return displayFrame(earliest, sink);
+}
+
+HRESULT CH264DXVA1Decoder::displayFrame(int index, CH264OutputSink* sink)
+{
+    // Hidden pictures take their turn like the others, unseen.
     HRESULT r = S_FALSE;
-    CDecodedPic& picRef = m_decodedPics[earliest];
-    if (picRef.Start >= 0)
+    CDecodedPic& picRef = m_decodedPics[index];
+    if ((picRef.Start >= 0) && !picRef.Hidden)
     {
         // For DXVA1, query a media sample at the last time (only one in the
         // allocator)
-        sample->SetTime(&picRef.Start, &picRef.Stop);
-        sample->SetMediaTime(NULL, NULL);
-        setTypeSpecificFlags(picRef, sample);
+        intrusive_ptr<IMediaSample> sample;
+        r = sink->GetOutputSample(reinterpret_cast<IMediaSample**>(&sample));
         if (SUCCEEDED(r))
-            r = m_accel->DisplayFrame(earliest, sample);
+        {
+            sample->SetTime(&picRef.Start, &picRef.Stop);
+            sample->SetMediaTime(NULL, NULL);
+            setTypeSpecificFlags(picRef, sample.get());
+
+            CDecoderStats::CStageTimer timer(getStats(),
+                                             CDecoderStats::STAGE_DELIVER);
+            timer.SetPicture(index, picRef.CodecSpecific);
+            r = m_accel->DisplayFrame(index, sample.get());
+        }
     }
 
+    getStats()->Count((S_OK == r) ? CDecoderStats::COUNTER_FRAMES_OUTPUT :
+                                    CDecoderStats::COUNTER_FRAMES_DROPPED);
+    if ((S_OK == r) && !picRef.Clean)
+        getStats()->Count(CDecoderStats::COUNTER_FRAMES_UNCLEAN);
+
     picRef.Displayed = true;
     if (!picRef.RefPicture)
-        freePictureSlot(earliest);
+        freePictureSlot(index);
 
     return r;
+}
+
+void CH264DXVA1Decoder::updateSurfaceOccupancy()
+{
+    int inUse = 0;
+    for (int i = 0; i < static_cast<int>(m_decodedPics.size()); ++i)
+        if (m_decodedPics[i].InUse)
+            ++inUse;
+
+    getStats()->SetSurfaceOccupancy(inUse,
+                                    static_cast<int>(m_decodedPics.size()));
 }
\ No newline at end of file
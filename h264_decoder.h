@@ -1,6 +1,7 @@
 #ifndef _H264_DECODER_H_
 #define _H264_DECODER_H_
 
+#include <deque>
 #include <vector>
 
 #include <boost/intrusive_ptr.hpp>
@@ -14,12 +15,42 @@
 #include <dxva.h>
 
 #include "chromium/base/basictypes.h"
+#include "h264_detail.h"
+#include "h264_picture_parser.h"
+#include "thread_budget.h"
+
+// Where the decoders get their output samples from and hand the filled ones
+// to. A sample is only asked for once a picture is ready for display.
+class CH264OutputSink
+{
+public:
+    virtual ~CH264OutputSink() {}
+
+    virtual HRESULT GetOutputSample(IMediaSample** sample) = 0;
+    virtual HRESULT DeliverOutputSample(IMediaSample* sample) = 0;
+};
+
+// How pictures are shown after a flush or a new connection, e.g. on a
+// channel change, until the stream reaches one that doesn't depend on the
+// references it lost.
+enum KFastStart
+{
+    FAST_START_CLEAN = 0,       // Only pictures without missing references
+    FAST_START_RECOVERY = 1,    // From the first I picture or recovery point
+    FAST_START_CONCEALED = 2,   // All, missing references are concealed
+};
+
+// Set in dwTypeSpecificFlags of output samples that may still show errors
+// from missing references, above the bits of AM_VIDEO_FLAG.
+const DWORD typeSpecificFlagUnclean = 0x00010000;
 
 class CCodecContext;
+class CDecoderStats;
 class CH264Decoder
 {
 public:
-    CH264Decoder(const GUID& decoderID, CCodecContext* preDecode);
+    CH264Decoder(const GUID& decoderID, CCodecContext* preDecode,
+                 CDecoderStats* stats);
     virtual ~CH264Decoder();
 
     const GUID& GetDecoderID() const { return m_decoderID; }
@@ -27,10 +58,10 @@ public:
     virtual bool Init(const DDPIXELFORMAT& pixelFormat,
                       int64 averageTimePerFrame) = 0;
     virtual HRESULT Decode(const void* data, int size, int64 start, int64 stop,
-                           IMediaSample* outSample, int* bytesUsed) = 0;
-    virtual HRESULT DisplayNextFrame(IMediaSample* sample) { return E_NOTIMPL; }
+                           CH264OutputSink* sink, int* bytesUsed) = 0;
     virtual void Flush();
     virtual bool NeedCustomizeAllocator() { return false; }
+    void SetFastStart(KFastStart fastStart) { m_fastStart = fastStart; }
 
 protected:
     struct TDeocdedPicDesc
@@ -44,6 +75,8 @@ protected:
         int SliceType;
         int CodecSpecific;
         int DisplayCount;
+        bool Clean;         // No missing references since the last flush
+        bool Hidden;        // Decoded as a reference, never shown
     };
 
     class CDecodedPic : public TDeocdedPicDesc
@@ -63,8 +96,15 @@ protected:
     };
 
     CCodecContext* getPreDecode() { return m_preDecode; }
-    bool getFlushed() const { return m_flushed; }
-    void setFlushed(bool flushed) { m_flushed = flushed; }
+    CDecoderStats* getStats() { return m_stats; }
+
+    // Follows the pictures in decoding order after a flush, |picture|
+    // describes the next one. Returns false if the fast start policy doesn't
+    // start before it, so it needn't be decoded. |show| is false for pictures
+    // that are decoded as references only.
+    bool startPicture(const CH264PictureParser::TPicture& picture, bool* show,
+                      bool* clean);
+
     int getFieldSurface() const { return m_fieldSurface; }
     void setFieldSurface(int surf) { m_fieldSurface = surf; }
     const boost::intrusive_ptr<IMediaSample>& getFieldSample() const
@@ -77,7 +117,14 @@ protected:
 private:
     GUID m_decoderID;
     CCodecContext* m_preDecode;
-    bool m_flushed;
+    CDecoderStats* m_stats;
+    KFastStart m_fastStart;
+    bool m_flushed;             // Nothing to start from since the flush
+    int m_uncleanFrames;        // Until the pictures are clean
+    int m_frameNum;             // Of the last picture, -1 after a flush
+    bool m_leadingPictures;     // Behind an I picture that ended the flush
+    int m_intraPOC;             // Of that I picture
+    int m_intraFrameNum;
     int m_fieldSurface;
     boost::intrusive_ptr<IMediaSample> m_fieldSample;
     int m_displayCount;
@@ -89,17 +136,45 @@ class CSWScale;
 class CH264SWDecoder : public CH264Decoder
 {
 public:
-    explicit CH264SWDecoder(CCodecContext* preDecode);
+    // |extraData| holds the parameter sets of the media type.
+    CH264SWDecoder(CCodecContext* preDecode, CDecoderStats* stats,
+                   const void* extraData, int extraDataSize);
     virtual ~CH264SWDecoder();
 
     virtual bool Init(const DDPIXELFORMAT& pixelFormat,
                       int64 averageTimePerFrame);
     virtual HRESULT Decode(const void* data, int size, int64 start, int64 stop,
-                           IMediaSample* outSample, int* bytesUsed);
+                           CH264OutputSink* sink, int* bytesUsed);
+    virtual void Flush();
 
 private:
+    // A picture given to libavcodec, until it comes out reordered.
+    struct TParsedPicture
+    {
+        CH264PictureParser::TPicture Picture;
+        bool Started;           // Seen by startPicture()
+        bool Show;
+        bool Clean;
+    };
+
+    HRESULT outputFrame(CH264OutputSink* sink);
+    HRESULT drain(CH264OutputSink* sink);
+
+    // Of the SPS the parser knows, 0 before there is one.
+    void getCodedSize(int* width, int* height) const;
+    void applyThreadBudget();
+
+    // Returns true if |data| starts an IDR picture.
+    bool trackPictures(const void* data, int size);
+    void startParsedPicture(TParsedPicture* picture);
+    bool takeParsedPicture(int64 number, bool* show, bool* clean);
+
     boost::scoped_ptr<CVideoFrame> m_frame;
     boost::scoped_ptr<CSWScale> m_scale;
+    boost::scoped_ptr<CThreadBudget::CClient> m_threads;
+    bool m_decoding;            // Decoded since Init() or the last flush
+    CH264PictureParser m_parser;
+    std::deque<TParsedPicture> m_parsedPictures;    // Decoding order
 };
 
 //------------------------------------------------------------------------------
@@ -107,14 +182,14 @@ class CH264DXVA1Decoder : public CH264Decoder
 {
 public:
     CH264DXVA1Decoder(const GUID& decoderID, CCodecContext* preDecode,
-                      IAMVideoAccelerator* accel, int picEntryCount);
+                      CDecoderStats* stats, IAMVideoAccelerator* accel,
+                      int picEntryCount);
     virtual ~CH264DXVA1Decoder();
 
     virtual bool Init(const DDPIXELFORMAT& pixelFormat,
                       int64 averageTimePerFrame);
     virtual HRESULT Decode(const void* data, int size, int64 start, int64 stop,
-                           IMediaSample* outSample, int* bytesUsed);
-    virtual HRESULT DisplayNextFrame(IMediaSample* sample) { return S_OK; }
+                           CH264OutputSink* sink, int* bytesUsed);
     virtual void Flush();
 
 private:
@@ -140,35 +215,42 @@ private:
     };
 
     HRESULT getFreeSurfaceIndex(
-        int* surfaceIndex, boost::intrusive_ptr<IMediaSample>* sampleToDeliver);
+        CH264OutputSink* sink, int* surfaceIndex,
+        boost::intrusive_ptr<IMediaSample>* sampleToDeliver);
+    int findFreeSurface();
+    HRESULT recoverSurface(CH264OutputSink* sink, int* surfaceIndex);
     HRESULT beginFrame(int surfaceIndex);
     HRESULT endFrame(int surfaceIndex);
     HRESULT execute();
-    bool updateRefFrameSliceLong(int slice, int dataOffset, int sliceLength);
-    bool updateRefFrameSliceShort(int slice, int dataOffset, int sliceLength);
     int buildBitStreamAndRefFrameSlice(const void* data, int size, void* dest);
     bool addToStandby(int surfaceIndex,
                       const boost::intrusive_ptr<IMediaSample>& sample,
                       bool isRefPicture, int64 start, int64 stop, bool isField,
-                      int fieldType, int sliceType, int codecSpecific);
+                      int fieldType, int sliceType, int codecSpecific,
+                      bool clean, bool show);
     void clearUnusedRefFrames();
     void removeRefFrame(int surfaceIndex);
     void freePictureSlot(int surfaceIndex);
     int findEarliestFrame();
+    int findUndisplayedFrame();
     void setTypeSpecificFlags(const CDecodedPic& pic, IMediaSample* sample);
-    HRESULT displayNextFrame(IMediaSample* sample);
+    HRESULT displayNextFrame(CH264OutputSink* sink);
+    HRESULT displayFrame(int index, CH264OutputSink* sink);
+    void updateSurfaceOccupancy();
 
     boost::intrusive_ptr<IAMVideoAccelerator> m_accel;
     DXVA_PicParams_H264 m_picParams;
     std::vector<DXVA_Slice_H264_Long> m_sliceLong;
     std::vector<DXVA_Slice_H264_Short> m_sliceShort;
     bool m_useLongSlice;
+    h264_detail::BuildBitStreamFunc m_buildBitStream;
     std::vector<CDecodedPic> m_decodedPics;
     CDXVABuffers m_execBuffers;
     int m_outPOC;
     int64 m_outStart;
     int64 m_lastFrameTime;
     int64 m_estTimePerFrame;
+    int64 m_bumpedStart;        // Of the last picture shown ahead of its turn
 };
 
 #endif  // _H264_DECODER_H_
\ No newline at end of file
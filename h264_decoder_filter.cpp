@@ -5,8 +5,12 @@
 #include <initguid.h>
 #include <dvdmedia.h>
 
+#include "codec_cache.h"
+#include "decode_trace.h"
+#include "dshow_adapter.h"
 #include "ffmpeg.h"
 #include "h264_decoder.h"
+#include "h264_picture_parser.h"
 #include "chromium/base/win_util.h"
 #include "common/dshow_util.h"
 #include "common/hardware_env.h"
@@ -19,13 +23,34 @@ using boost::intrusive_ptr;
 
 namespace
 {
-inline int getDecodeSurfacesCount()
+// The most surfaces asked for, also used until the SPS is known.
+inline int getMaxDecodeSurfacesCount()
 {
     return (win_util::GetWinVersion() >= win_util::WINVERSION_VISTA) ? 22 : 16;
 }
 
+// Surfaces besides the DPB and the pictures waiting in output order: the
+// picture being decoded, and the ones the renderer has queued or shows.
+const int decodingSurfaceCount = 1;
+const int rendererSurfaceCount = 2;
+
 const wchar_t* outputPinName = L"CH264DecoderOutputPin";
 const wchar_t* inputPinName = L"CH264DecoderInputPin";
+
+const int defaultQueueDepth = 8;
+
+// Output buffers besides the reorder depth: one being decoded into, one
+// waiting for delivery and one held by the renderer.
+const int outputBufferMargin = 3;
+const int defaultReorderDepth = 2;
+const int maxOutputBufferCount = 16;
+
+// Besides the queued samples, one is being decoded and one staged by a
+// Receive call that waits for room in the queue.
+inline int getInputRingSlotCount(int queueDepth)
+{
+    return queueDepth + 2;
+}
 }
 
 CH264DecoderOutputPin::CH264DecoderOutputPin(CH264DecoderFilter* decoder,
@@ -75,7 +100,7 @@ HRESULT CH264DecoderOutputPin::GetUncompSurfacesInfo(
                                       reinterpret_cast<void**>(&accel));
         if (SUCCEEDED(r) && accel)
         {
-            const int surfCount = getDecodeSurfacesCount();
+            const int surfCount = m_decoder->GetDXVA1SurfaceCount();
             uncompBufInfo->dwMaxNumSurfaces = surfCount;
             uncompBufInfo->dwMinNumSurfaces = surfCount;
             r = m_decoder->ConfirmDXVA1UncompFormat(
@@ -94,6 +119,51 @@ HRESULT CH264DecoderOutputPin::GetUncompSurfacesInfo(
     return r;
 }
 
+HRESULT CH264DecoderOutputPin::ResizeAllocator(int bufferSize, int bufferCount)
+{
+    if (!m_pAllocator)
+        return VFW_E_NO_ALLOCATOR;
+
+    ALLOCATOR_PROPERTIES props;
+    HRESULT r = m_pAllocator->GetProperties(&props);
+    if (FAILED(r))
+        return r;
+
+    // Reuse the buffers if the picture still fits and there are enough of
+    // them. Buffers are never given back while streaming.
+    if ((props.cbBuffer >= bufferSize) && (props.cBuffers >= bufferCount))
+        return S_OK;
+
+    r = m_pAllocator->Decommit();
+    if (FAILED(r))
+        return r;
+
+    // Commit again even if the new size is refused, the allocator keeps its
+    // previous properties in that case. Samples still held downstream make
+    // it refuse with VFW_E_BUFFERS_OUTSTANDING.
+    props.cbBuffer = std::max<long>(props.cbBuffer, bufferSize);
+    props.cBuffers = std::max<long>(props.cBuffers, bufferCount);
+    ALLOCATOR_PROPERTIES actual;
+    HRESULT setResult = m_pAllocator->SetProperties(&props, &actual);
+    r = m_pAllocator->Commit();
+    if (FAILED(setResult))
+        return setResult;
+
+    if (FAILED(r))
+        return r;
+
+    return (actual.cbBuffer < bufferSize) ? E_FAIL : S_OK;
+}
+
+HRESULT CH264DecoderOutputPin::GetAllocatorProperties(
+    ALLOCATOR_PROPERTIES* props)
+{
+    if (!m_pAllocator)
+        return VFW_E_NO_ALLOCATOR;
+
+    return m_pAllocator->GetProperties(props);
+}
+
 HRESULT CH264DecoderOutputPin::SetUncompSurfacesInfo(
     DWORD actualUncompSurfacesAllocated)
 {
@@ -148,6 +218,19 @@ HRESULT CH264DecoderOutputPin::GetCreateVideoAcceleratorData(
 //------------------------------------------------------------------------------
 namespace
 {
+// Not defined by the DirectShow SDK.
+const GUID mediaSubTypeP010 =
+{
+    0x30313050, 0x0000, 0x0010,
+    { 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71 }
+};
+
+const GUID mediaSubTypeP016 =
+{
+    0x36313050, 0x0000, 0x0010,
+    { 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71 }
+};
+
 struct { const GUID& SubType; int16 PlaneCount; int16 BitCount; int FourCC; }
     supportedFormats[] =
 {
@@ -155,11 +238,33 @@ struct { const GUID& SubType; int16 PlaneCount; int16 BitCount; int FourCC; }
     { DXVA_ModeH264_E, 1, 12, MAKEFOURCC('d','x','v','a') },
     { DXVA_ModeH264_F, 1, 12, MAKEFOURCC('d','x','v','a') },
 
-    // Software formats
+    // Software formats, high bit depth first
+    { mediaSubTypeP010, 2, 24, MAKEFOURCC('P','0','1','0') },
+    { mediaSubTypeP016, 2, 24, MAKEFOURCC('P','0','1','6') },
     { MEDIASUBTYPE_YV12, 3, 12, MAKEFOURCC('Y','V','1','2') },
     { MEDIASUBTYPE_YUY2, 1, 16, MAKEFOURCC('Y','U','Y','2') }
 };
 
+inline bool isHardwareFormat(int index)
+{
+    return supportedFormats[index].FourCC == MAKEFOURCC('d','x','v','a');
+}
+
+inline bool isHighBitDepthFormat(int index)
+{
+    return (supportedFormats[index].FourCC == MAKEFOURCC('P','0','1','0')) ||
+        (supportedFormats[index].FourCC == MAKEFOURCC('P','0','1','6'));
+}
+
+bool isHardwareSubType(const GUID& subType)
+{
+    for (int i = 0; i < arraysize(supportedFormats); ++i)
+        if (subType == supportedFormats[i].SubType)
+            return isHardwareFormat(i);
+
+    return false;
+}
+
 enum KDXVAH264Compatibility
 {
     DXVA_UNSUPPORTED_LEVEL = 1,
@@ -283,7 +388,7 @@ HRESULT CH264DecoderFilter::CheckInputType(const CMediaType* inputType)
     if (MEDIATYPE_Video != *inputType->Type())
         return VFW_E_TYPE_NOT_ACCEPTED;
 
-    if (CFFMPEG::get()->IsSubTypeSupported(*inputType))
+    if (dshow_adapter::IsSubTypeSupported(*inputType))
         return S_OK;
 
     return VFW_E_TYPE_NOT_ACCEPTED;
@@ -324,13 +429,14 @@ HRESULT CH264DecoderFilter::CheckTransform(const CMediaType* inputType,
 HRESULT CH264DecoderFilter::DecideBufferSize(IMemAllocator * allocator, 
                                              ALLOCATOR_PROPERTIES* prop)
 {
+    if (!prop)
+        return E_POINTER;
+
+    AutoLock lock(m_outputTypeAccess);
     BITMAPINFOHEADER header;
     if (!ExtractBitmapInfoFromMediaType(m_pOutput->CurrentMediaType(), &header))
         return E_FAIL;
 
-    if (!prop)
-        return E_POINTER;
-
     ALLOCATOR_PROPERTIES requested = *prop;
     if (requested.cbAlign < 1) 
         requested.cbAlign = 1;
@@ -338,6 +444,12 @@ HRESULT CH264DecoderFilter::DecideBufferSize(IMemAllocator * allocator,
     if (requested.cBuffers < 1) 
         requested.cBuffers = 1;
 
+    // Enough software buffers for the decoder to keep going while the
+    // renderer holds on to a picture. What the peer asked for is the minimum.
+    const long minBuffers = requested.cBuffers;
+    if (!isHardwareSubType(*m_pOutput->CurrentMediaType().Subtype()))
+        requested.cBuffers = std::max<long>(minBuffers, getOutputBufferCount());
+
     requested.cbBuffer = header.biSizeImage;
     requested.cbPrefix = 0;
 
@@ -346,7 +458,8 @@ HRESULT CH264DecoderFilter::DecideBufferSize(IMemAllocator * allocator,
     if (FAILED(r)) 
         return r;
 
-    return (requested.cBuffers > actual.cBuffers) ||
+    m_stats.SetOutputBufferCount(actual.cBuffers);
+    return (minBuffers > actual.cBuffers) ||
         (requested.cbBuffer > actual.cbBuffer) ? E_FAIL : S_OK;
 }
 
@@ -358,6 +471,8 @@ HRESULT CH264DecoderFilter::GetMediaType(int position, CMediaType* mediaType)
     if (!mediaType)
         return E_POINTER;
 
+    // The decode thread replaces the types on a format change.
+    AutoLock lock(m_outputTypeAccess);
     if (position >= static_cast<int>(m_mediaTypes.size()))
         return VFW_S_NO_MORE_ITEMS;
 
@@ -373,9 +488,6 @@ HRESULT CH264DecoderFilter::SetMediaType(PIN_DIRECTION dir,
         if (!mediaType)
             return E_POINTER;
 
-        // Rebuild output media types.
-        m_mediaTypes.clear();
-
         // Get dimension info.
         int width;
         int height;
@@ -385,17 +497,6 @@ HRESULT CH264DecoderFilter::SetMediaType(PIN_DIRECTION dir,
                                            &aspectX, &aspectY))
             return VFW_E_TYPE_NOT_ACCEPTED;
 
-        // Get bitmap info.
-        BITMAPINFOHEADER bitmapHeader;
-        if (!ExtractBitmapInfoFromMediaType(*mediaType, &bitmapHeader))
-            return VFW_E_TYPE_NOT_ACCEPTED;
-
-        bitmapHeader.biWidth = width;
-        bitmapHeader.biHeight = height;
-        bitmapHeader.biSizeImage =
-            bitmapHeader.biWidth * bitmapHeader.biHeight *
-            bitmapHeader.biBitCount >> 3;
-
         VIDEOINFOHEADER* inputFormat =
             reinterpret_cast<VIDEOINFOHEADER*>(mediaType->Format());
         if (!inputFormat)
@@ -403,71 +504,15 @@ HRESULT CH264DecoderFilter::SetMediaType(PIN_DIRECTION dir,
 
         m_averageTimePerFrame = inputFormat->AvgTimePerFrame;
 
-        // Type 1: FORMAT_VideoInfo
-        VIDEOINFOHEADER header = {0};
-        header.bmiHeader = bitmapHeader;
-        header.bmiHeader.biXPelsPerMeter = width * aspectY;
-        header.bmiHeader.biYPelsPerMeter = height * aspectX;
-        header.AvgTimePerFrame = inputFormat->AvgTimePerFrame;
-        header.dwBitRate = inputFormat->dwBitRate;
-        header.dwBitErrorRate = inputFormat->dwBitErrorRate;
-
-        // Type 2: FORMAT_VideoInfo2
-        VIDEOINFOHEADER2 header2 = {0};
-        header2.bmiHeader = bitmapHeader;
-        header2.dwPictAspectRatioX = aspectX;
-        header2.dwPictAspectRatioY = aspectY;
-        header2.dwInterlaceFlags =
-            AMINTERLACE_IsInterlaced | AMINTERLACE_DisplayModeBobOrWeave;
-        header2.AvgTimePerFrame = inputFormat->AvgTimePerFrame;
-        header2.dwBitRate = inputFormat->dwBitRate;
-        header2.dwBitErrorRate = inputFormat->dwBitErrorRate;
-
-        // Copy source and target rectangles from input pin.
-        if (inputFormat->rcSource.right && inputFormat->rcSource.bottom)
-        {
-            header.rcSource = inputFormat->rcSource;
-            header.rcTarget = inputFormat->rcTarget;
-            header2.rcSource = inputFormat->rcSource;
-            header2.rcTarget = inputFormat->rcTarget;
-        }
-        else
-        {
-            header.rcSource.right = width;
-            header.rcTarget.right = width;
-            header.rcSource.bottom = height;
-            header.rcTarget.bottom = height;
-            header2.rcSource.right = width;
-            header2.rcTarget.right = width;
-            header2.rcSource.bottom = height;
-            header2.rcTarget.bottom = height;
-        }
-
-        for (int i = 0; i < arraysize(supportedFormats); ++i)
-        {
-            shared_ptr<CMediaType> myType(new CMediaType);
-            myType->SetType(&MEDIATYPE_Video);
-            myType->SetSubtype(&supportedFormats[i].SubType);
-            myType->SetFormatType(&FORMAT_VideoInfo);
-
-            header.bmiHeader.biBitCount = supportedFormats[i].BitCount;
-            header.bmiHeader.biPlanes = supportedFormats[i].PlaneCount;
-            header.bmiHeader.biCompression = supportedFormats[i].FourCC;
-            myType->SetFormat(reinterpret_cast<BYTE*>(&header), sizeof(header));
-
-            m_mediaTypes.push_back(myType);
-
-            shared_ptr<CMediaType> myType2(new CMediaType(*myType));
-            myType2->SetFormatType(&FORMAT_VideoInfo2);
-
-            header2.bmiHeader.biBitCount = supportedFormats[i].BitCount;
-            header2.bmiHeader.biPlanes = supportedFormats[i].PlaneCount;
-            header2.bmiHeader.biCompression = supportedFormats[i].FourCC;
-            myType2->SetFormat(reinterpret_cast<BYTE*>(&header2),
-                               sizeof(header2));
-
-            m_mediaTypes.push_back(myType2);
-        }
+        // Until the SPS is known the picture is taken as uncropped.
+        TStreamFormat format;
+        memset(&format, 0, sizeof(format));
+        format.Width = width;
+        format.Height = height;
+        format.CodedWidth = width;
+        format.CodedHeight = height;
+        format.BitDepth = 8;
+        return buildOutputMediaTypes(*mediaType, format);
     }
 
     return S_OK;
@@ -477,9 +522,24 @@ HRESULT CH264DecoderFilter::CompleteConnect(PIN_DIRECTION dir, IPin* receivePin)
 {
     if (PINDIR_INPUT == dir)
     {
-        m_preDecode = CFFMPEG::get()->CreateCodec(m_pInput->CurrentMediaType());
+        m_preDecode =
+            dshow_adapter::CreateCodec(m_pInput->CurrentMediaType());
         if (!m_preDecode)
             return VFW_E_TYPE_NOT_ACCEPTED;
+
+        m_preDecode->SetSkipLoopFilter(m_skipLoopFilter);
+
+        // If the parameter sets came with the media type, advertise the
+        // cropped picture size from the start.
+        bool outputChanged;
+        getStreamFormat(&m_streamFormat, &outputChanged);
+        if (m_streamFormat.Profile >= 0)
+        {
+            HRESULT r = buildOutputMediaTypes(m_pInput->CurrentMediaType(),
+                                              m_streamFormat);
+            if (FAILED(r))
+                return r;
+        }
     }
     else if (PINDIR_OUTPUT == dir)
     {
@@ -490,7 +550,24 @@ HRESULT CH264DecoderFilter::CompleteConnect(PIN_DIRECTION dir, IPin* receivePin)
         }
         
         if (!m_decoder) // Not support DXVA1.
-            m_decoder.reset(new CH264SWDecoder(m_preDecode.get()));
+        {
+            const void* extraData;
+            int extraDataSize;
+            dshow_adapter::GetExtraData(m_pInput->CurrentMediaType(),
+                                        &extraData, &extraDataSize);
+            m_decoder.reset(new CH264SWDecoder(m_preDecode.get(), &m_stats,
+                                               extraData, extraDataSize));
+        }
+
+        m_decoder->SetFastStart(m_fastStart);
+
+        BITMAPINFOHEADER header;
+        if (ExtractBitmapInfoFromMediaType(m_pOutput->CurrentMediaType(),
+                                           &header))
+        {
+            m_surfaceWidth = header.biWidth;
+            m_surfaceHeight = abs(header.biHeight);
+        }
     }
 
     return CTransformFilter::CompleteConnect(dir, receivePin);
@@ -500,8 +577,15 @@ HRESULT CH264DecoderFilter::BreakConnect(PIN_DIRECTION dir)
 {
     if (PINDIR_INPUT == dir)
     {
+        // The codec stays warm for the next stream of the same format.
         m_decoder.reset();
+        CCodecCache::get()->Release(m_preDecode);
         m_preDecode.reset();
+        m_randomAccessIndex.Clear();
+        m_streamOffset = 0;
+        m_segmentStart = 0;
+        m_pendingOutputType.reset();
+        m_inputRing.Clear();
     }
 
     return S_OK;
@@ -510,89 +594,176 @@ HRESULT CH264DecoderFilter::BreakConnect(PIN_DIRECTION dir)
 HRESULT CH264DecoderFilter::NewSegment(REFERENCE_TIME start,
                                        REFERENCE_TIME stop, double rate)
 {
+    CAutoLock lock(&m_csReceive);
+    if (!m_decodeThread)
     {
-        AutoLock lock(m_decodeAccess);
-        m_preDecode->FlushBuffers();
-        if (m_decoder)
-            m_decoder->Flush();
+        flushDecoder();
+        m_segmentStart = start;
+        return CTransformFilter::NewSegment(start, stop, rate);
     }
 
-    return CTransformFilter::NewSegment(start, stop, rate);
+    // Pictures of the previous segment still queued go out first.
+    TStreamItem item = TStreamItem();
+    item.Type = STREAM_ITEM_NEW_SEGMENT;
+    item.Start = start;
+    item.Stop = stop;
+    item.Rate = rate;
+    return queueInput(item);
 }
 
 HRESULT CH264DecoderFilter::Receive(IMediaSample* inSample)
 {
-    AM_SAMPLE2_PROPERTIES* const props = m_pInput->SampleProps();
-    if (props->dwStreamId != AM_STREAM_MEDIA)
-        return m_pOutput->Deliver(inSample);
+    assert(m_decodeThread);
+    HRESULT r = m_streamError;
+    if (FAILED(r))
+        return r;
+
+    TStreamItem item = TStreamItem();
+    item.FrameID = m_nextFrameID++;
+    item.Sample = inSample;
+    item.Props = *m_pInput->SampleProps();
+    if (item.Props.dwStreamId != AM_STREAM_MEDIA)
+    {
+        item.Type = STREAM_ITEM_PASS_THROUGH;
+        return queueInput(item);
+    }
 
     assert(m_decoder);
     if (!m_decoder)
         return E_UNEXPECTED;
 
     BYTE* data;
-    HRESULT r = inSample->GetPointer(&data);
+    r = inSample->GetPointer(&data);
     if (FAILED(r))
         return r;
 
     const int dataLength = inSample->GetActualDataLength();
-    const int minDataSize = dataLength + CFFMPEG::GetInputBufferPaddingSize();
-    if (inSample->GetSize() < minDataSize)
-    {
-        assert(false);
-        // Reconfigure sample size.
-    }
+    if ((dataLength < 0) || (dataLength > inSample->GetSize()))
+        return E_INVALIDARG;
 
-    // Make sure the padding bytes are initialized to 0.
-    memset(data + dataLength, 0, CFFMPEG::GetInputBufferPaddingSize());
+    // Decode from the upstream buffer when it has room for the padding. The
+    // queue holds a reference to the sample until it is decoded.
+    item.Type = STREAM_ITEM_SAMPLE;
+    item.Data = m_inputRing.Stage(data, dataLength, inSample->GetSize());
+    item.Size = dataLength;
 
-    REFERENCE_TIME start;
-    REFERENCE_TIME stop;
-    r = inSample->GetTime(&start, &stop);
+    r = inSample->GetTime(&item.Start, &item.Stop);
     if (FAILED(r))
         return r;
 
-    if ((stop <= start) && (stop != std::numeric_limits<int64>::min()))
-        stop = start + m_averageTimePerFrame;
+    if ((item.Stop <= item.Start) &&
+            (item.Stop != std::numeric_limits<int64>::min()))
+        item.Stop = item.Start + m_averageTimePerFrame;
 
-    m_preDecode->UpdateTime(start, stop);
+    // Sources that need byte accurate entry points stamp the media time of
+    // the sample with its stream position.
+    int64 offsetEnd;
+    if (FAILED(inSample->GetMediaTime(&item.Offset, &offsetEnd)))
+        item.Offset = m_streamOffset;
 
-    const int8* dataStart = reinterpret_cast<const int8*>(data);
-    int dataRemaining = dataLength;
-    while (dataRemaining > 0)
-    {
-        intrusive_ptr<IMediaSample> outSample;
-        r = InitializeOutputSample(
-            inSample, reinterpret_cast<IMediaSample**>(&outSample));
-        if (FAILED(r))
-            return r;
+    m_streamOffset += dataLength;
+    return queueInput(item);
+}
 
-        int usedBytes = 0;
-        {
-            AutoLock lock(m_decodeAccess);
-            r = m_decoder->Decode(dataStart, dataRemaining, start, stop,
-                outSample.get(), &usedBytes);
-            if (S_FALSE == r)
-                return S_OK;
+HRESULT CH264DecoderFilter::EndOfStream()
+{
+    if (!m_decodeThread)
+        return CTransformFilter::EndOfStream();
 
-            if (FAILED(r))
-                return r;
+    TStreamItem item = TStreamItem();
+    item.Type = STREAM_ITEM_END_OF_STREAM;
+    return queueInput(item);
+}
 
-            r = m_decoder->DisplayNextFrame(outSample.get());
-        }
-        if (E_NOTIMPL == r)
-            r = m_pOutput->Deliver(outSample.get());
+HRESULT CH264DecoderFilter::BeginFlush()
+{
+    if (!m_decodeThread)
+        return CTransformFilter::BeginFlush();
 
-        if (FAILED(r))
-            return r;
+    m_flushing = true;
+    wakeStreamThreads();
 
-        dataRemaining -= usedBytes;
-        dataStart += usedBytes;
+    // Downstream releases its buffers and refuses further samples, so neither
+    // stream thread stays blocked on it.
+    HRESULT r = CTransformFilter::BeginFlush();
+
+    // Let a Receive call waiting for room in the queue return.
+    {
+        CAutoLock lock(&m_csReceive);
     }
 
+    // Everything queued before the marker is dropped by the time it comes
+    // out of the delivery thread.
+    TStreamItem item = TStreamItem();
+    item.Type = STREAM_ITEM_FLUSH;
+    if (S_OK == queueInput(item))
+        waitUnlessStopped(&m_flushDone);
+
     return r;
 }
 
+HRESULT CH264DecoderFilter::EndFlush()
+{
+    m_flushing = false;
+    InterlockedExchange(&m_streamError, S_OK);
+    return CTransformFilter::EndFlush();
+}
+
+HRESULT CH264DecoderFilter::StartStreaming()
+{
+    m_inputQueue.reset(new CSPSCQueue<TStreamItem>(m_queueDepth));
+    m_outputQueue.reset(new CSPSCQueue<TStreamItem>(m_queueDepth));
+    m_inputRing.SetSlotCount(getInputRingSlotCount(m_queueDepth));
+    m_flushDone.Reset();
+    m_drainDone.Reset();
+    m_stopped.Reset();
+    m_flushing = false;
+    m_stopping = false;
+    m_streamError = S_OK;
+    m_stats.Reset();
+    m_nextFrameID = 0;
+    m_outputBufferResizeDeferred = false;
+
+    m_decodeThread.reset(
+        new CStreamThread(this, &CH264DecoderFilter::decodeLoop,
+                          "H264DecodeThread"));
+    m_deliveryThread.reset(
+        new CStreamThread(this, &CH264DecoderFilter::deliveryLoop,
+                          "H264DeliveryThread"));
+    if (!m_decodeThread->Start() || !m_deliveryThread->Start())
+    {
+        StopStreaming();
+        return E_FAIL;
+    }
+
+    return CTransformFilter::StartStreaming();
+}
+
+HRESULT CH264DecoderFilter::StopStreaming()
+{
+    m_stopping = true;
+    m_stopped.Set();
+    wakeStreamThreads();
+
+    // The decode thread may be waiting for the delivery thread, join it
+    // first.
+    m_decodeThread.reset();
+    m_deliveryThread.reset();
+    m_inputQueue.reset();
+    m_outputQueue.reset();
+    return CTransformFilter::StopStreaming();
+}
+
+HRESULT CH264DecoderFilter::Stop()
+{
+    // Release the stream threads before the base class waits for Receive.
+    CAutoLock lock(&m_csFilter);
+    m_stopping = true;
+    m_stopped.Set();
+    wakeStreamThreads();
+    return CTransformFilter::Stop();
+}
+
 HRESULT CH264DecoderFilter::ActivateDXVA1(IAMVideoAccelerator* accel,
                                           const GUID* decoderID,
                                           const AMVAUncompDataInfo& uncompInfo,
@@ -604,8 +775,11 @@ HRESULT CH264DecoderFilter::ActivateDXVA1(IAMVideoAccelerator* accel,
     if (!accel || !decoderID)
         return E_POINTER;
 
-    if (m_decoder && (m_decoder->GetDecoderID() == *decoderID))
-        return S_OK;
+    // The accelerator comes with a new set of surfaces, also when it is
+    // renegotiated after a format change. The pictures decoded into the old
+    // ones are gone, and so are the references the codec keeps to them.
+    if (m_decoder)
+        flushDecoder();
 
     m_decoder.reset();
     int campatible = checkHWCompatibilityForH264(
@@ -614,11 +788,27 @@ HRESULT CH264DecoderFilter::ActivateDXVA1(IAMVideoAccelerator* accel,
     if (DXVA_UNSUPPORTED_LEVEL == campatible)
         return E_FAIL;
 
-    m_decoder.reset(new CH264DXVA1Decoder(*decoderID, m_preDecode.get(), accel,
-                                          surfaceCount));
+    m_decoder.reset(new CH264DXVA1Decoder(*decoderID, m_preDecode.get(),
+                                          &m_stats, accel, surfaceCount));
+    m_decoder->SetFastStart(m_fastStart);
     return S_OK;
 }
 
+int CH264DecoderFilter::GetDXVA1SurfaceCount() const
+{
+    // Field pairs keep a surface pending between their fields and make the
+    // DPB accounting unreliable, they get as many surfaces as before.
+    const int maxCount = getMaxDecodeSurfacesCount();
+    const int dpbFrames = m_preDecode ? m_preDecode->GetDPBFrameCount() : -1;
+    if ((dpbFrames < 0) || m_preDecode->IsInterlaced())
+        return maxCount;
+
+    const int reorderDepth = std::max(m_preDecode->GetReorderDepth(), 0);
+    return std::min(dpbFrames + reorderDepth + decodingSurfaceCount +
+                        rendererSurfaceCount,
+                    maxCount);
+}
+
 bool CH264DecoderFilter::IsFormatSupported(const GUID& formatID)
 {
     for (int i = 0; i < arraysize(supportedFormats); ++i)
@@ -665,16 +855,813 @@ void CH264DecoderFilter::SetDXVA1PixelFormat(const DDPIXELFORMAT& pixelFormat)
     memcpy(&m_pixelFormat, &pixelFormat, sizeof(m_pixelFormat));
 }
 
+void CH264DecoderFilter::SetOutputReduction(int shift)
+{
+    assert((shift >= 0) && (shift <= 2));
+    m_outputReduction = std::max(0, std::min(shift, 2));
+}
+
+void CH264DecoderFilter::SetSkipLoopFilter(bool skip)
+{
+    AutoLock lock(m_decodeAccess);
+    m_skipLoopFilter = skip;
+    if (m_preDecode)
+        m_preDecode->SetSkipLoopFilter(skip);
+}
+
+void CH264DecoderFilter::SetFastStart(KFastStart fastStart)
+{
+    AutoLock lock(m_decodeAccess);
+    m_fastStart = fastStart;
+    if (m_decoder)
+        m_decoder->SetFastStart(fastStart);
+}
+
+void CH264DecoderFilter::SetQueueDepth(int depth)
+{
+    assert(depth > 0);
+    m_queueDepth = std::max(depth, 1);
+}
+
+void CH264DecoderFilter::SetOutputBufferCount(int count)
+{
+    assert((count >= 0) && (count <= maxOutputBufferCount));
+    m_outputBufferCount = std::max(0, std::min(count, maxOutputBufferCount));
+    m_outputBufferCountChanged = true;
+}
+
+HRESULT CH264DecoderFilter::buildOutputMediaTypes(const CMediaType& inputType,
+                                                  const TStreamFormat& format)
+{
+    const int width = format.Width;
+    const int height = format.Height;
+
+    // Get dimension info.
+    int inputWidth;
+    int inputHeight;
+    int aspectX;
+    int aspectY;
+    if (!ExtractDimensionFromMediaType(inputType, &inputWidth, &inputHeight,
+                                       &aspectX, &aspectY))
+        return VFW_E_TYPE_NOT_ACCEPTED;
+
+    // Get bitmap info.
+    BITMAPINFOHEADER bitmapHeader;
+    if (!ExtractBitmapInfoFromMediaType(inputType, &bitmapHeader))
+        return VFW_E_TYPE_NOT_ACCEPTED;
+
+    bitmapHeader.biWidth = width;
+    bitmapHeader.biHeight = height;
+
+    VIDEOINFOHEADER* inputFormat =
+        reinterpret_cast<VIDEOINFOHEADER*>(inputType.Format());
+    if (!inputFormat)
+        return E_UNEXPECTED;
+
+    // Type 1: FORMAT_VideoInfo
+    VIDEOINFOHEADER header = {0};
+    header.bmiHeader = bitmapHeader;
+    header.bmiHeader.biXPelsPerMeter = width * aspectY;
+    header.bmiHeader.biYPelsPerMeter = height * aspectX;
+    header.AvgTimePerFrame = inputFormat->AvgTimePerFrame;
+    header.dwBitRate = inputFormat->dwBitRate;
+    header.dwBitErrorRate = inputFormat->dwBitErrorRate;
+
+    // Type 2: FORMAT_VideoInfo2
+    VIDEOINFOHEADER2 header2 = {0};
+    header2.bmiHeader = bitmapHeader;
+    header2.dwPictAspectRatioX = aspectX;
+    header2.dwPictAspectRatioY = aspectY;
+    header2.dwInterlaceFlags =
+        AMINTERLACE_IsInterlaced | AMINTERLACE_DisplayModeBobOrWeave;
+    header2.AvgTimePerFrame = inputFormat->AvgTimePerFrame;
+    header2.dwBitRate = inputFormat->dwBitRate;
+    header2.dwBitErrorRate = inputFormat->dwBitErrorRate;
+
+    // Copy source and target rectangles from input pin, unless the stream
+    // has changed its picture size since.
+    if (inputFormat->rcSource.right && inputFormat->rcSource.bottom &&
+        (width == inputWidth) && (height == inputHeight))
+    {
+        header.rcSource = inputFormat->rcSource;
+        header.rcTarget = inputFormat->rcTarget;
+        header2.rcSource = inputFormat->rcSource;
+        header2.rcTarget = inputFormat->rcTarget;
+    }
+    else
+    {
+        header.rcSource.right = width;
+        header.rcTarget.right = width;
+        header.rcSource.bottom = height;
+        header.rcTarget.bottom = height;
+        header2.rcSource.right = width;
+        header2.rcTarget.right = width;
+        header2.rcSource.bottom = height;
+        header2.rcTarget.bottom = height;
+    }
+
+    // Rebuild output media types.
+    vector<shared_ptr<CMediaType> > mediaTypes;
+    for (int i = 0; i < arraysize(supportedFormats); ++i)
+    {
+        // The DXVA1 H.264 modes only decode 8-bit 4:2:0, so High10 has to
+        // be decoded in software. YV12 and YUY2 would need the samples
+        // dithered down, which libswscale isn't handed 16-bit pictures for,
+        // so only P010/P016 keep the precision. These are only offered for
+        // high bit depth streams, so that the renderers don't prefer them
+        // for common streams.
+        if ((format.BitDepth > 8) != isHighBitDepthFormat(i))
+            continue;
+
+        // Reduced output only applies to the software formats.
+        const int shift = isHardwareFormat(i) ? 0 : m_outputReduction;
+        const int outWidth = width >> shift;
+        const int outHeight = height >> shift;
+
+        shared_ptr<CMediaType> myType(new CMediaType);
+        myType->SetType(&MEDIATYPE_Video);
+        myType->SetSubtype(&supportedFormats[i].SubType);
+        myType->SetFormatType(&FORMAT_VideoInfo);
+
+        VIDEOINFOHEADER formatHeader = header;
+        formatHeader.bmiHeader.biBitCount = supportedFormats[i].BitCount;
+        formatHeader.bmiHeader.biPlanes = supportedFormats[i].PlaneCount;
+        formatHeader.bmiHeader.biCompression = supportedFormats[i].FourCC;
+        formatHeader.bmiHeader.biSizeImage =
+            outWidth * outHeight * supportedFormats[i].BitCount >> 3;
+        if (isHardwareFormat(i) && ((format.CodedWidth != width) ||
+            (format.CodedHeight != height)))
+        {
+            // DXVA surfaces hold the whole coded picture, the renderer crops
+            // it as the rectangles tell.
+            formatHeader.bmiHeader.biWidth = format.CodedWidth;
+            formatHeader.bmiHeader.biHeight = format.CodedHeight;
+            formatHeader.bmiHeader.biSizeImage = format.CodedWidth *
+                format.CodedHeight * supportedFormats[i].BitCount >> 3;
+            SetRect(&formatHeader.rcSource, format.Left, format.Top,
+                    format.Left + width, format.Top + height);
+            formatHeader.rcTarget = formatHeader.rcSource;
+        }
+        else if (shift)
+        {
+            formatHeader.bmiHeader.biWidth = outWidth;
+            formatHeader.bmiHeader.biHeight = outHeight;
+            SetRect(&formatHeader.rcSource, 0, 0, outWidth, outHeight);
+            formatHeader.rcTarget = formatHeader.rcSource;
+        }
+        myType->SetFormat(reinterpret_cast<BYTE*>(&formatHeader),
+                          sizeof(formatHeader));
+
+        mediaTypes.push_back(myType);
+
+        shared_ptr<CMediaType> myType2(new CMediaType(*myType));
+        myType2->SetFormatType(&FORMAT_VideoInfo2);
+
+        VIDEOINFOHEADER2 formatHeader2 = header2;
+        formatHeader2.bmiHeader = formatHeader.bmiHeader;
+        formatHeader2.rcSource = formatHeader.rcSource;
+        formatHeader2.rcTarget = formatHeader.rcTarget;
+        myType2->SetFormat(reinterpret_cast<BYTE*>(&formatHeader2),
+                           sizeof(formatHeader2));
+
+        mediaTypes.push_back(myType2);
+    }
+
+    AutoLock lock(m_outputTypeAccess);
+    m_mediaTypes.swap(mediaTypes);
+    return S_OK;
+}
+
+// Returns true if |format| differs from the one being output.
+bool CH264DecoderFilter::getStreamFormat(TStreamFormat* format,
+                                         bool* outputChanged) const
+{
+    assert(format);
+    assert(outputChanged);
+
+    // The output is cropped as the SPS tells.
+    m_preDecode->GetVisibleRect(&format->Left, &format->Top, &format->Width,
+                                &format->Height);
+    m_preDecode->GetCodedSize(&format->CodedWidth, &format->CodedHeight);
+    format->Profile = m_preDecode->GetVideoProfile();
+    format->Level = m_preDecode->GetVideoLevel();
+    format->BitDepth = m_preDecode->GetBitDepth();
+
+    *outputChanged = (format->Left != m_streamFormat.Left) ||
+        (format->Top != m_streamFormat.Top) ||
+        (format->Width != m_streamFormat.Width) ||
+        (format->Height != m_streamFormat.Height) ||
+        (format->CodedWidth != m_streamFormat.CodedWidth) ||
+        (format->CodedHeight != m_streamFormat.CodedHeight) ||
+        (format->BitDepth != m_streamFormat.BitDepth);
+
+    // Profile and level are unknown until the first SPS has been parsed.
+    return *outputChanged ||
+        ((m_streamFormat.Profile >= 0) &&
+            (format->Profile != m_streamFormat.Profile)) ||
+        ((m_streamFormat.Level >= 0) &&
+            (format->Level != m_streamFormat.Level));
+}
+
+// |format| only becomes the stream format once the output follows it, a
+// failure leaves the previous format and its media types in place.
+HRESULT CH264DecoderFilter::renegotiateOutput(const TStreamFormat& format,
+                                              bool outputChanged)
+{
+    const TStreamFormat previousFormat = m_streamFormat;
+    vector<shared_ptr<CMediaType> > previousTypes;
+    {
+        AutoLock lock(m_outputTypeAccess);
+        previousTypes = m_mediaTypes;
+    }
+
+    m_streamFormat = format;
+    if (!outputChanged)
+        return S_OK;
+
+    HRESULT r = changeOutputType();
+    if (FAILED(r))
+    {
+        m_streamFormat = previousFormat;
+        AutoLock lock(m_outputTypeAccess);
+        m_mediaTypes.swap(previousTypes);
+        return r;
+    }
+
+    // Decoded pictures are kept, only the decoder configuration is rebuilt.
+    AutoLock lock(m_decodeAccess);
+    if (!m_decoder->Init(m_pixelFormat, m_averageTimePerFrame))
+        return E_FAIL;
+
+    return S_OK;
+}
+
+HRESULT CH264DecoderFilter::changeOutputType()
+{
+    HRESULT r = buildOutputMediaTypes(m_pInput->CurrentMediaType(),
+                                      m_streamFormat);
+    if (FAILED(r))
+        return r;
+
+    // Keep the current subtype if it is still offered, otherwise (bit
+    // depth change) take the first one of the same format type.
+    shared_ptr<CMediaType> newType;
+    {
+        AutoLock lock(m_outputTypeAccess);
+        const CMediaType& current = m_pOutput->CurrentMediaType();
+        for (int i = 0; i < static_cast<int>(m_mediaTypes.size()); ++i)
+        {
+            if (*m_mediaTypes[i]->FormatType() != *current.FormatType())
+                continue;
+
+            if (*m_mediaTypes[i]->Subtype() == *current.Subtype())
+            {
+                newType = m_mediaTypes[i];
+                break;
+            }
+
+            if (!newType)
+                newType = m_mediaTypes[i];
+        }
+    }
+
+    if (!newType)
+        return VFW_E_TYPE_NOT_ACCEPTED;
+
+    BITMAPINFOHEADER header;
+    if (!ExtractBitmapInfoFromMediaType(*newType, &header))
+        return E_FAIL;
+
+    IPin* downstream = m_pOutput->GetConnected();
+    if (!downstream)
+        return VFW_E_NOT_CONNECTED;
+
+    CH264DecoderOutputPin* output =
+        static_cast<CH264DecoderOutputPin*>(m_pOutput);
+    const bool isDXVA1 = (m_decoder->GetDecoderID() != GUID_NULL);
+    const bool fitsSurfaces = !isDXVA1 ||
+        ((m_streamFormat.CodedWidth <= m_surfaceWidth) &&
+            (m_streamFormat.CodedHeight <= m_surfaceHeight));
+    bool reconnect =
+        !fitsSurfaces || (S_OK != downstream->QueryAccept(newType.get()));
+    if (!reconnect && !isDXVA1)
+    {
+        // Buffers are kept when the picture shrinks. Bigger ones can't be
+        // allocated while the renderer holds on to the picture it shows,
+        // reconnecting makes it let go.
+        r = output->ResizeAllocator(header.biSizeImage,
+                                    getOutputBufferCount());
+        if (VFW_E_BUFFERS_OUTSTANDING == r)
+            reconnect = true;
+        else if (FAILED(r))
+            return r;
+    }
+
+    if (reconnect)
+    {
+        // Let the renderer reallocate. For DXVA1 the surfaces are
+        // negotiated again through IAMVideoAcceleratorNotify.
+        r = downstream->ReceiveConnection(m_pOutput, newType.get());
+        if (FAILED(r))
+            return r;
+
+        if (!isDXVA1)
+        {
+            r = output->ResizeAllocator(header.biSizeImage,
+                                        getOutputBufferCount());
+            if (FAILED(r))
+                return r;
+        }
+
+        AutoLock lock(m_outputTypeAccess);
+        m_surfaceWidth = m_streamFormat.CodedWidth;
+        m_surfaceHeight = m_streamFormat.CodedHeight;
+    }
+
+    AutoLock lock(m_outputTypeAccess);
+    m_pOutput->SetMediaType(newType.get());
+    m_pendingOutputType = newType;
+
+    return S_OK;
+}
+
+// Taken from the data rather than from the codec, which frame threads leave
+// behind.
+void CH264DecoderFilter::recordEntryPoint(const void* data, int size,
+                                          int64 offset, int64 start)
+{
+    bool isIDR;
+    int recoveryFrameCount;
+    if (!CH264PictureParser::FindEntryPoint(data, size,
+                                            m_preDecode->GetNALLength(),
+                                            &isIDR, &recoveryFrameCount))
+        return;
+
+    CRandomAccessIndex::TEntryPoint entryPoint;
+    entryPoint.Offset = offset;
+    entryPoint.Start = start;
+    entryPoint.IsIDR = isIDR;
+    entryPoint.RecoveryFrameCount = isIDR ? 0 : recoveryFrameCount;
+    m_randomAccessIndex.Add(entryPoint);
+}
+
+HRESULT CH264DecoderFilter::queueInput(const TStreamItem& item)
+{
+    AutoLock lock(m_inputQueueAccess);
+    while (!m_inputQueue->TryPush(item))
+    {
+        // Samples still queued are dropped while flushing, but the markers
+        // have to get through.
+        if (m_stopping || (m_flushing && item.Sample))
+            return S_FALSE;
+
+        m_inputPopped.Wait();
+    }
+
+    m_inputPushed.Set();
+    return S_OK;
+}
+
+HRESULT CH264DecoderFilter::queueOutput(const TStreamItem& item)
+{
+    while (!m_outputQueue->TryPush(item))
+    {
+        if (m_stopping)
+            return S_FALSE;
+
+        m_outputPopped.Wait();
+    }
+
+    m_outputPushed.Set();
+    return S_OK;
+}
+
+void CH264DecoderFilter::decodeLoop()
+{
+    for (;;)
+    {
+        TStreamItem item;
+        if (!m_inputQueue->TryPop(&item))
+        {
+            if (m_stopping)
+                return;
+
+            m_inputPushed.Wait();
+            continue;
+        }
+
+        m_inputPopped.Set();
+        CDecodeTrace::get()->SetCurrentFrame(item.FrameID);
+        switch (item.Type)
+        {
+            case STREAM_ITEM_SAMPLE:
+                if (!m_flushing && !m_stopping && SUCCEEDED(m_streamError))
+                    setStreamError(decodeSample(item));
+
+                break;
+            case STREAM_ITEM_NEW_SEGMENT:
+                flushDecoder();
+                m_segmentStart = item.Start;
+                queueOutput(item);
+                break;
+            default:
+                queueOutput(item);
+                break;
+        }
+    }
+}
+
+void CH264DecoderFilter::deliveryLoop()
+{
+    for (;;)
+    {
+        TStreamItem item;
+        if (!m_outputQueue->TryPop(&item))
+        {
+            if (m_stopping)
+                return;
+
+            m_outputPushed.Wait();
+            continue;
+        }
+
+        m_outputPopped.Set();
+        CDecodeTrace::get()->SetCurrentFrame(item.FrameID);
+        const bool dropped = m_flushing || m_stopping;
+        switch (item.Type)
+        {
+            case STREAM_ITEM_SAMPLE:
+                if (dropped || FAILED(m_streamError))
+                {
+                    m_stats.Count(CDecoderStats::COUNTER_FRAMES_DROPPED);
+                }
+                else
+                {
+                    CDecoderStats::CStageTimer timer(
+                        &m_stats, CDecoderStats::STAGE_DELIVER);
+                    HRESULT r = m_pOutput->Deliver(item.Sample.get());
+                    m_stats.Count(SUCCEEDED(r) ?
+                        CDecoderStats::COUNTER_FRAMES_OUTPUT :
+                        CDecoderStats::COUNTER_FRAMES_DROPPED);
+                    setStreamError(r);
+                }
+                break;
+            case STREAM_ITEM_PASS_THROUGH:
+                if (!dropped && SUCCEEDED(m_streamError))
+                    setStreamError(m_pOutput->Deliver(item.Sample.get()));
+
+                break;
+            case STREAM_ITEM_NEW_SEGMENT:
+                m_pOutput->DeliverNewSegment(item.Start, item.Stop,
+                                             item.Rate);
+                break;
+            case STREAM_ITEM_END_OF_STREAM:
+                if (!dropped)
+                    m_pOutput->DeliverEndOfStream();
+
+                break;
+            case STREAM_ITEM_FLUSH:
+                m_flushDone.Set();
+                break;
+            case STREAM_ITEM_DRAIN:
+                m_drainDone.Set();
+                break;
+            default:
+                assert(false);
+                break;
+        }
+    }
+}
+
+HRESULT CH264DecoderFilter::decodeSample(const TStreamItem& item)
+{
+    m_preDecode->UpdateTime(item.Start, item.Stop);
+    m_stats.Count(CDecoderStats::COUNTER_FRAMES_IN);
+
+    // Output samples are only taken from the allocator for pictures that are
+    // ready, most chunks of a sliced stream need none.
+    COutputSink sink(this, item);
+
+    const int8* dataStart = item.Data;
+    int dataRemaining = item.Size;
+    bool retryResize = m_outputBufferResizeDeferred &&
+        !!(item.Props.dwSampleFlags & AM_SAMPLE_SPLICEPOINT);
+    HRESULT r = S_OK;
+    while (dataRemaining > 0)
+    {
+        // Follow SPS changes before holding any output sample, so that the
+        // allocator can be resized. A format the downstream filter refuses
+        // fails the stream.
+        TStreamFormat format;
+        bool outputChanged;
+        const bool formatChanged = getStreamFormat(&format, &outputChanged);
+        if (formatChanged || m_outputBufferCountChanged || retryResize)
+        {
+            drainOutput();
+            if (formatChanged)
+            {
+                r = renegotiateOutput(format, outputChanged);
+                if (FAILED(r))
+                    return r;
+            }
+
+            // The reorder depth may have changed along with the SPS. More
+            // buffers only help, if the renderer still holds samples the
+            // resize is tried again at the next sync point.
+            m_outputBufferCountChanged = false;
+            retryResize = false;
+            r = updateOutputBufferCount();
+            m_outputBufferResizeDeferred = (VFW_E_BUFFERS_OUTSTANDING == r);
+            if (FAILED(r) && !m_outputBufferResizeDeferred)
+                return r;
+        }
+
+        int usedBytes = 0;
+        {
+            AutoLock lock(m_decodeAccess);
+            r = m_decoder->Decode(dataStart, dataRemaining, item.Start,
+                                  item.Stop, &sink, &usedBytes);
+            if (S_OK == r)
+                recordEntryPoint(dataStart, usedBytes, item.Offset,
+                                 m_segmentStart + item.Start);
+        }
+        if (S_FALSE == r)
+            return S_OK;
+
+        if (FAILED(r))
+            return r;
+
+        // Nothing consumed and nothing to show, wait for more data.
+        if (usedBytes <= 0)
+            return S_OK;
+
+        dataRemaining -= usedBytes;
+        dataStart += usedBytes;
+    }
+
+    return r;
+}
+
+// CTransformFilter::InitializeOutputSample() reads the properties of the
+// sample the input pin is receiving, which on the decode thread is already a
+// later one.
+HRESULT CH264DecoderFilter::initializeOutputSample(const TStreamItem& item,
+                                                   IMediaSample** outSample)
+{
+    assert(outSample);
+    const AM_SAMPLE2_PROPERTIES& props = item.Props;
+    DWORD flags = m_bSampleSkipped ? AM_GBF_PREVFRAMESKIPPED : 0;
+    if (!(props.dwSampleFlags & AM_SAMPLE_SPLICEPOINT))
+        flags |= AM_GBF_NOTASYNCPOINT;
+
+    REFERENCE_TIME start = props.tStart;
+    REFERENCE_TIME stop = props.tStop;
+    HRESULT r;
+    {
+        CDecoderStats::CStageTimer timer(&m_stats,
+                                         CDecoderStats::STAGE_ALLOCATOR_WAIT);
+        r = m_pOutput->GetDeliveryBuffer(
+            outSample,
+            (props.dwSampleFlags & AM_SAMPLE_TIMEVALID) ? &start : NULL,
+            (props.dwSampleFlags & AM_SAMPLE_STOPVALID) ? &stop : NULL, flags);
+    }
+    if (FAILED(r))
+        return r;
+
+    intrusive_ptr<IMediaSample2> sample2;
+    r = (*outSample)->QueryInterface(IID_IMediaSample2,
+                                     reinterpret_cast<void**>(&sample2));
+    if (SUCCEEDED(r))
+    {
+        AM_SAMPLE2_PROPERTIES outProps;
+        r = sample2->GetProperties(FIELD_OFFSET(AM_SAMPLE2_PROPERTIES, tStart),
+                                   reinterpret_cast<BYTE*>(&outProps));
+        if (FAILED(r))
+            return r;
+
+        outProps.dwTypeSpecificFlags = props.dwTypeSpecificFlags;
+        outProps.dwSampleFlags =
+            (outProps.dwSampleFlags & AM_SAMPLE_TYPECHANGED) |
+            (props.dwSampleFlags & ~AM_SAMPLE_TYPECHANGED);
+        outProps.tStart = props.tStart;
+        outProps.tStop = props.tStop;
+        outProps.cbData = FIELD_OFFSET(AM_SAMPLE2_PROPERTIES, dwStreamId);
+        sample2->SetProperties(FIELD_OFFSET(AM_SAMPLE2_PROPERTIES, dwStreamId),
+                               reinterpret_cast<BYTE*>(&outProps));
+    }
+    else
+    {
+        if (props.dwSampleFlags & AM_SAMPLE_TIMEVALID)
+            (*outSample)->SetTime(&start, &stop);
+
+        if (props.dwSampleFlags & AM_SAMPLE_SPLICEPOINT)
+            (*outSample)->SetSyncPoint(TRUE);
+
+        if (props.dwSampleFlags & AM_SAMPLE_DATADISCONTINUITY)
+            (*outSample)->SetDiscontinuity(TRUE);
+    }
+
+    if (props.dwSampleFlags & AM_SAMPLE_DATADISCONTINUITY)
+        m_bSampleSkipped = FALSE;
+
+    return S_OK;
+}
+
+int CH264DecoderFilter::getOutputBufferCount() const
+{
+    if (m_outputBufferCount > 0)
+        return m_outputBufferCount;
+
+    int reorderDepth = m_preDecode ? m_preDecode->GetReorderDepth() : -1;
+    if (reorderDepth < 0)
+        reorderDepth = defaultReorderDepth;
+
+    return std::min(reorderDepth + outputBufferMargin, maxOutputBufferCount);
+}
+
+// DXVA1 pictures stay in the accelerator surfaces, only the software path
+// depends on the allocator depth.
+HRESULT CH264DecoderFilter::updateOutputBufferCount()
+{
+    if (isHardwareSubType(*m_pOutput->CurrentMediaType().Subtype()))
+        return S_OK;
+
+    BITMAPINFOHEADER header;
+    if (!ExtractBitmapInfoFromMediaType(m_pOutput->CurrentMediaType(),
+                                        &header))
+        return E_FAIL;
+
+    CH264DecoderOutputPin* output =
+        static_cast<CH264DecoderOutputPin*>(m_pOutput);
+    HRESULT r =
+        output->ResizeAllocator(header.biSizeImage, getOutputBufferCount());
+
+    ALLOCATOR_PROPERTIES props;
+    if (SUCCEEDED(output->GetAllocatorProperties(&props)))
+        m_stats.SetOutputBufferCount(props.cBuffers);
+
+    return r;
+}
+
+//------------------------------------------------------------------------------
+CH264DecoderFilter::COutputSink::COutputSink(CH264DecoderFilter* filter,
+                                             const TStreamItem& item)
+    : m_filter(filter)
+    , m_item(item)
+{
+    assert(filter);
+}
+
+CH264DecoderFilter::COutputSink::~COutputSink()
+{
+}
+
+HRESULT CH264DecoderFilter::COutputSink::GetOutputSample(IMediaSample** sample)
+{
+    assert(sample);
+    HRESULT r = m_filter->initializeOutputSample(m_item, sample);
+    if (FAILED(r))
+        return r;
+
+    if (m_filter->m_pendingOutputType)
+    {
+        (*sample)->SetMediaType(m_filter->m_pendingOutputType.get());
+        m_filter->m_pendingOutputType.reset();
+    }
+
+    return S_OK;
+}
+
+HRESULT CH264DecoderFilter::COutputSink::DeliverOutputSample(
+    IMediaSample* sample)
+{
+    TStreamItem delivery = TStreamItem();
+    delivery.Type = STREAM_ITEM_SAMPLE;
+    delivery.FrameID = m_item.FrameID;
+    delivery.Sample = sample;
+    return m_filter->queueOutput(delivery);
+}
+
+//------------------------------------------------------------------------------
+// Waits until the pictures queued for delivery have been handed downstream,
+// so that the output allocator can be reconfigured.
+void CH264DecoderFilter::drainOutput()
+{
+    TStreamItem item = TStreamItem();
+    item.Type = STREAM_ITEM_DRAIN;
+    if (S_OK == queueOutput(item))
+        waitUnlessStopped(&m_drainDone);
+}
+
+// The stream threads stop answering the flush and drain markers once they
+// have seen m_stopping, so a stop has to release the wait as well.
+void CH264DecoderFilter::waitUnlessStopped(CAMEvent* done)
+{
+    assert(done);
+    HANDLE events[] = { *done, m_stopped };
+    WaitForMultipleObjects(arraysize(events), events, FALSE, INFINITE);
+}
+
+void CH264DecoderFilter::flushDecoder()
+{
+    AutoLock lock(m_decodeAccess);
+    m_preDecode->FlushBuffers();
+    if (m_decoder)
+        m_decoder->Flush();
+}
+
+void CH264DecoderFilter::wakeStreamThreads()
+{
+    m_inputPushed.Set();
+    m_inputPopped.Set();
+    m_outputPushed.Set();
+    m_outputPopped.Set();
+}
+
+// Keeps the first failure, Receive() reports it upstream.
+void CH264DecoderFilter::setStreamError(HRESULT r)
+{
+    if (FAILED(r))
+        InterlockedCompareExchange(&m_streamError, r, S_OK);
+}
+
+//------------------------------------------------------------------------------
+CH264DecoderFilter::CStreamThread::CStreamThread(CH264DecoderFilter* filter,
+                                                 Loop loop, const char* name)
+    : m_filter(filter)
+    , m_loop(loop)
+    , m_name(name)
+    , m_handle()
+    , m_started(false)
+{
+    assert(filter);
+    assert(loop);
+}
+
+CH264DecoderFilter::CStreamThread::~CStreamThread()
+{
+    if (m_started)
+        PlatformThread::Join(m_handle);
+}
+
+bool CH264DecoderFilter::CStreamThread::Start()
+{
+    m_started = PlatformThread::Create(0, this, &m_handle);
+    return m_started;
+}
+
+void CH264DecoderFilter::CStreamThread::ThreadMain()
+{
+    PlatformThread::SetName(m_name);
+    (m_filter->*m_loop)();
+    CDecodeTrace::get()->ReleaseThread();
+}
+
 CH264DecoderFilter::CH264DecoderFilter(IUnknown* aggregator, HRESULT* r)
     : CTransformFilter(L"H264DecodeFilter", aggregator, CLSID_NULL)
     , m_mediaTypes()
+    , m_outputTypeAccess()
     , m_preDecode()
     , m_pixelFormat()
     , m_decodeAccess()
     , m_decoder()
     , m_averageTimePerFrame(1)
+    , m_randomAccessIndex()
+    , m_streamOffset(0)
+    , m_segmentStart(0)
+    , m_inputRing(getInputRingSlotCount(defaultQueueDepth),
+                  CFFMPEG::GetInputBufferPaddingSize())
+    , m_streamFormat()
+    , m_surfaceWidth(0)
+    , m_surfaceHeight(0)
+    , m_pendingOutputType()
+    , m_outputReduction(0)
+    , m_skipLoopFilter(false)
+    , m_fastStart(FAST_START_RECOVERY)
+    , m_queueDepth(defaultQueueDepth)
+    , m_inputQueue()
+    , m_outputQueue()
+    , m_inputQueueAccess()
+    , m_inputPushed()
+    , m_inputPopped()
+    , m_outputPushed()
+    , m_outputPopped()
+    , m_flushDone()
+    , m_drainDone()
+    , m_stopped(TRUE)
+    , m_flushing(false)
+    , m_stopping(false)
+    , m_streamError(S_OK)
+    , m_decodeThread()
+    , m_deliveryThread()
+    , m_outputBufferCount(0)
+    , m_outputBufferCountChanged(false)
+    , m_outputBufferResizeDeferred(false)
+    , m_stats()
+    , m_nextFrameID(0)
 {
     memset(&m_pixelFormat, 0, sizeof(m_pixelFormat));
+    memset(&m_streamFormat, 0, sizeof(m_streamFormat));
 
     if (m_pInput)
         delete m_pInput;
@@ -12,6 +12,12 @@
 
 #include "chromium/base/basictypes.h"
 #include "chromium/base/lock.h"
+#include "chromium/base/platform_thread.h"
+#include "decoder_stats.h"
+#include "h264_decoder.h"
+#include "padded_input_ring.h"
+#include "random_access_index.h"
+#include "spsc_queue.h"
 
 class CH264DecoderFilter;
 class CH264DecoderOutputPin : public CTransformOutputPin,
@@ -34,6 +40,9 @@ public:
     virtual HRESULT __stdcall GetCreateVideoAcceleratorData(
         const GUID* profileID, DWORD* miscDataSize, void** miscData);
 
+    HRESULT ResizeAllocator(int bufferSize, int bufferCount);
+    HRESULT GetAllocatorProperties(ALLOCATOR_PROPERTIES* props);
+
 private:
     CH264DecoderFilter* m_decoder;
     int m_DXVA1SurfCount;
@@ -43,7 +52,6 @@ private:
 
 //------------------------------------------------------------------------------
 class CCodecContext;
-class CH264Decoder;
 class CH264DecoderFilter : public CTransformFilter
 {
 public:
@@ -64,25 +72,204 @@ public:
     virtual HRESULT NewSegment(REFERENCE_TIME start, REFERENCE_TIME stop,
                                double rate);
     virtual HRESULT Receive(IMediaSample* sample);
+    virtual HRESULT EndOfStream();
+    virtual HRESULT BeginFlush();
+    virtual HRESULT EndFlush();
+    virtual HRESULT StartStreaming();
+    virtual HRESULT StopStreaming();
+    virtual HRESULT __stdcall Stop();
 
     HRESULT ActivateDXVA1(IAMVideoAccelerator* accel, const GUID* decoderID,
                           const AMVAUncompDataInfo& uncompInfo,
                           int surfaceCount);
+
+    // Sized to the DPB of the stream, so high resolutions don't hold more
+    // video memory than they can use.
+    int GetDXVA1SurfaceCount() const;
     bool IsFormatSupported(const GUID& formatID);
     HRESULT ConfirmDXVA1UncompFormat(IAMVideoAccelerator* accel,
                                      const GUID* decoderID,
                                      DDPIXELFORMAT* pixelFormat);
     void SetDXVA1PixelFormat(const DDPIXELFORMAT& pixelFormat);
 
+    // Shrinks the software output by 2^shift (up to 4:1) for previews. Takes
+    // effect when the output media types are next built.
+    void SetOutputReduction(int shift);
+
+    // Skipping the loop filter trades picture quality for decoding speed on
+    // the software path.
+    void SetSkipLoopFilter(bool skip);
+
+    // Number of samples queued ahead of the decode thread, and of decoded
+    // pictures queued ahead of the delivery thread. Takes effect when
+    // streaming starts next.
+    void SetQueueDepth(int depth);
+
+    // Overrides the software output buffer count derived from the reorder
+    // depth of the stream, 0 goes back to it. While streaming the allocator
+    // only grows, a lower count takes effect on the next connection.
+    void SetOutputBufferCount(int count);
+
+    // How pictures are shown after a flush or a connection until the stream
+    // gets clean. Output samples that aren't clean yet carry
+    // typeSpecificFlagUnclean.
+    void SetFastStart(KFastStart fastStart);
+
+    // Counters and stage timings of the current stream, restarted whenever
+    // streaming starts.
+    const CDecoderStats& GetStats() const { return m_stats; }
+    const CRandomAccessIndex& GetRandomAccessIndex() const
+    {
+        return m_randomAccessIndex;
+    }
+
 protected:
     CH264DecoderFilter(IUnknown* aggregator, HRESULT* r);
 
 private:
+    // Width and Height are the visible size at Left/Top of the coded
+    // picture.
+    struct TStreamFormat
+    {
+        int Left;
+        int Top;
+        int Width;
+        int Height;
+        int CodedWidth;
+        int CodedHeight;
+        int Profile;
+        int Level;
+        int BitDepth;
+    };
+
+    enum KStreamItemType
+    {
+        STREAM_ITEM_SAMPLE = 0,
+        STREAM_ITEM_PASS_THROUGH = 1,
+        STREAM_ITEM_NEW_SEGMENT = 2,
+        STREAM_ITEM_END_OF_STREAM = 3,
+        STREAM_ITEM_FLUSH = 4,
+        STREAM_ITEM_DRAIN = 5
+    };
+
+    // Samples and in-band stream events, in stream order, from the upstream
+    // thread to the decode thread and from there to the delivery thread.
+    struct TStreamItem
+    {
+        int Type;
+        int FrameID;            // Input sample number, for the trace
+        boost::intrusive_ptr<IMediaSample> Sample;
+        AM_SAMPLE2_PROPERTIES Props;
+        const int8* Data;       // Padded input
+        int Size;
+        int64 Offset;
+        REFERENCE_TIME Start;
+        REFERENCE_TIME Stop;
+        double Rate;            // New segment only
+    };
+
+    class CStreamThread : public PlatformThread::Delegate
+    {
+    public:
+        typedef void (CH264DecoderFilter::*Loop)();
+
+        CStreamThread(CH264DecoderFilter* filter, Loop loop,
+                      const char* name);
+        virtual ~CStreamThread();
+
+        bool Start();
+
+        // PlatformThread::Delegate
+        virtual void ThreadMain();
+
+    private:
+        CH264DecoderFilter* m_filter;
+        Loop m_loop;
+        const char* m_name;
+        PlatformThreadHandle m_handle;
+        bool m_started;
+    };
+
+    // Hands the decoder output samples set up after the input sample being
+    // decoded.
+    class COutputSink : public CH264OutputSink
+    {
+    public:
+        COutputSink(CH264DecoderFilter* filter, const TStreamItem& item);
+        virtual ~COutputSink();
+
+        // CH264OutputSink
+        virtual HRESULT GetOutputSample(IMediaSample** sample);
+        virtual HRESULT DeliverOutputSample(IMediaSample* sample);
+
+    private:
+        CH264DecoderFilter* m_filter;
+        const TStreamItem& m_item;
+    };
+
+    HRESULT buildOutputMediaTypes(const CMediaType& inputType,
+                                  const TStreamFormat& format);
+    bool getStreamFormat(TStreamFormat* format, bool* outputChanged) const;
+    HRESULT renegotiateOutput(const TStreamFormat& format,
+                              bool outputChanged);
+    HRESULT changeOutputType();
+    void recordEntryPoint(const void* data, int size, int64 offset,
+                          int64 start);
+    int getOutputBufferCount() const;
+    HRESULT updateOutputBufferCount();
+    HRESULT queueInput(const TStreamItem& item);
+    HRESULT queueOutput(const TStreamItem& item);
+    void decodeLoop();
+    void deliveryLoop();
+    HRESULT decodeSample(const TStreamItem& item);
+    HRESULT initializeOutputSample(const TStreamItem& item,
+                                   IMediaSample** outSample);
+    void drainOutput();
+    void waitUnlessStopped(CAMEvent* done);
+    void flushDecoder();
+    void wakeStreamThreads();
+    void setStreamError(HRESULT r);
+
     std::vector<boost::shared_ptr<CMediaType> > m_mediaTypes;
+
+    // Guards m_mediaTypes and the output pin type against the decode thread.
+    Lock m_outputTypeAccess;
     boost::shared_ptr<CCodecContext> m_preDecode;
     DDPIXELFORMAT m_pixelFormat;
     Lock m_decodeAccess;
     int64 m_averageTimePerFrame;
+    CRandomAccessIndex m_randomAccessIndex;
+    int64 m_streamOffset;
+    int64 m_segmentStart;       // Of the samples being decoded
+    CPaddedInputRing m_inputRing;
+    TStreamFormat m_streamFormat;
+    int m_surfaceWidth;
+    int m_surfaceHeight;
+    boost::shared_ptr<CMediaType> m_pendingOutputType;
+    int m_outputReduction;
+    bool m_skipLoopFilter;
+    KFastStart m_fastStart;
+    int m_queueDepth;
+    boost::scoped_ptr<CSPSCQueue<TStreamItem> > m_inputQueue;
+    boost::scoped_ptr<CSPSCQueue<TStreamItem> > m_outputQueue;
+    Lock m_inputQueueAccess;    // Keeps m_inputQueue single producer
+    CAMEvent m_inputPushed;
+    CAMEvent m_inputPopped;
+    CAMEvent m_outputPushed;
+    CAMEvent m_outputPopped;
+    CAMEvent m_flushDone;
+    CAMEvent m_drainDone;
+    CAMEvent m_stopped;         // Manual reset, set once streaming stops
+    volatile bool m_flushing;
+    volatile bool m_stopping;
+    volatile LONG m_streamError;
+    boost::scoped_ptr<CStreamThread> m_decodeThread;
+    boost::scoped_ptr<CStreamThread> m_deliveryThread;
+    int m_outputBufferCount;
+    volatile bool m_outputBufferCountChanged;
+    bool m_outputBufferResizeDeferred;
+    CDecoderStats m_stats;
+    int m_nextFrameID;
 
     // Put it into a first-release position.
     boost::shared_ptr<CH264Decoder> m_decoder;
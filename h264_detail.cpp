@@ -1,10 +1,10 @@
 #include "h264_detail.h"
 
+#include <cassert>
+#include <cstring>
 #include <vector>
 #include <limits>
 
-#include <vfwmsgs.h>
-
 #define HAVE_AV_CONFIG_H
 #define __STDC_CONSTANT_MACROS
 
@@ -15,6 +15,7 @@
 #include "libavcodec/avcodec.h"
 #include "libavcodec/h264.h"
 #include "ffmpeg.h"
+#include "h264_nalu.h"
 
 namespace
 {
@@ -60,6 +61,112 @@ void copyScalingMatrix(DXVA_Qmatrix_H264* dest, const DXVA_Qmatrix_H264* source)
             dest->bScalingLists8x8[i][j] =
                 source->bScalingLists8x8[i][ZZScan8[j]];
 }
+
+void updateSlice(const CCodecContext* cont,
+                 const DXVA_PicParams_H264* picParams,
+                 DXVA_Slice_H264_Long* slices, int slice, int dataOffset,
+                 int sliceLength)
+{
+    slices[slice].BSNALunitDataLocation = dataOffset;
+    slices[slice].SliceBytesInBuffer = sliceLength;
+    slices[slice].slice_id = slice;
+    h264_detail::UpdateRefFrameSliceLong(picParams, cont, &slices[slice]);
+    if (slice)
+    {
+        slices[slice].NumMbsForSlice =
+            slices[slice].first_mb_in_slice -
+            slices[slice - 1].first_mb_in_slice;
+
+        slices[slice - 1].NumMbsForSlice = slices[slice].NumMbsForSlice;
+    }
+}
+
+void updateSlice(const CCodecContext* cont,
+                 const DXVA_PicParams_H264* picParams,
+                 DXVA_Slice_H264_Short* slices, int slice, int dataOffset,
+                 int sliceLength)
+{
+    slices[slice].BSNALunitDataLocation = dataOffset;
+    slices[slice].SliceBytesInBuffer = sliceLength;
+}
+
+template <class Slice>
+Slice* selectSlices(DXVA_Slice_H264_Long* sliceLong,
+                    DXVA_Slice_H264_Short* sliceShort);
+
+template <>
+DXVA_Slice_H264_Long* selectSlices<DXVA_Slice_H264_Long>(
+    DXVA_Slice_H264_Long* sliceLong, DXVA_Slice_H264_Short* sliceShort)
+{
+    assert(sliceLong);
+    return sliceLong;
+}
+
+template <>
+DXVA_Slice_H264_Short* selectSlices<DXVA_Slice_H264_Short>(
+    DXVA_Slice_H264_Long* sliceLong, DXVA_Slice_H264_Short* sliceShort)
+{
+    assert(sliceShort);
+    return sliceShort;
+}
+
+// One instance per slice format and NAL length, so that the per NAL loop
+// makes no indirect call and doesn't branch on either.
+template <class Slice, int NALLength>
+int buildBitStream(const void* data, int size, const CCodecContext* cont,
+                   const DXVA_PicParams_H264* picParams,
+                   DXVA_Slice_H264_Long* sliceLong,
+                   DXVA_Slice_H264_Short* sliceShort, int maxSlices,
+                   void* dest, int* destSize)
+{
+    assert(data);
+    assert(dest);
+    assert(destSize);
+
+    Slice* slices = selectSlices<Slice>(sliceLong, sliceShort);
+    CH264NALU block;
+    block.SetBuffer(data, size, NALLength);
+
+    int8* destCursor = reinterpret_cast<int8*>(dest);
+    int dataOffset = 0;
+    int slice = 0;
+    while (block.ReadNext<NALLength>())
+    {
+        if ((NALU_TYPE_SLICE == block.GetType()) ||
+            (NALU_TYPE_IDR == block.GetType()))
+        {
+            // Skip the NALU if the data length is below 0.
+            if ((block.GetDataLength() < 0) || (slice >= maxSlices))
+                break;
+
+            // For AVC1, put startcode 0x000001
+            destCursor[0] = 0;
+            destCursor[1] = 0;
+            destCursor[2] = 1;
+
+            // Copy NALU
+            memcpy(destCursor + 3, block.GetDataBuffer(),
+                   block.GetDataLength());
+
+            // Update slice control buffer
+            int length = block.GetDataLength() + 3;
+            updateSlice(cont, picParams, slices, slice, dataOffset, length);
+
+            dataOffset += length;
+            destCursor += length;
+            slice++;
+        }
+    }
+
+    // Complete with zero padding (buffer size should be a multiple of 128)
+    int padding  = 128 - (dataOffset % 128);
+    memset(destCursor, 0, padding);
+    if (slice)
+        slices[slice - 1].SliceBytesInBuffer += padding;
+
+    *destSize = dataOffset + padding;
+    return slice;
+}
 }
 
 namespace h264_detail
@@ -153,7 +260,6 @@ HRESULT BuildPicParams(const CCodecContext* cont,
 {
     assert(cont);
     assert(picParams);
-    assert(scalingMatrix);
     assert(fieldType);
     assert(sliceType);
 
@@ -379,7 +485,7 @@ void UpdateRefFramesList(DXVA_PicParams_H264* picParams,
 
             picParams->RefFrameList[i].AssociatedFlag = associatedFlag;
             picParams->RefFrameList[i].Index7Bits =
-                reinterpret_cast<UCHAR>(pic->opaque);
+                static_cast<UCHAR>(reinterpret_cast<intptr_t>(pic->opaque));
         }
         else
         {
@@ -393,4 +499,44 @@ void UpdateRefFramesList(DXVA_PicParams_H264* picParams,
 
     picParams->UsedForReferenceFlags = usedForReferenceFlags;
 }
+
+BuildBitStreamFunc GetBitStreamBuilder(bool longSlices, int nalLength)
+{
+    const BuildBitStreamFunc builders[2][5] = {
+        {
+            buildBitStream<DXVA_Slice_H264_Short, 0>,
+            buildBitStream<DXVA_Slice_H264_Short, 1>,
+            buildBitStream<DXVA_Slice_H264_Short, 2>,
+            buildBitStream<DXVA_Slice_H264_Short, 3>,
+            buildBitStream<DXVA_Slice_H264_Short, 4>
+        },
+        {
+            buildBitStream<DXVA_Slice_H264_Long, 0>,
+            buildBitStream<DXVA_Slice_H264_Long, 1>,
+            buildBitStream<DXVA_Slice_H264_Long, 2>,
+            buildBitStream<DXVA_Slice_H264_Long, 3>,
+            buildBitStream<DXVA_Slice_H264_Long, 4>
+        }
+    };
+    assert((nalLength >= 0) && (nalLength < arraysize(builders[0])));
+    if ((nalLength < 0) || (nalLength >= arraysize(builders[0])))
+        return NULL;
+
+    return builders[longSlices ? 1 : 0][nalLength];
+}
+
+int BuildBitStream(const void* data, int size, int nalLength,
+                   const CCodecContext* cont,
+                   const DXVA_PicParams_H264* picParams,
+                   DXVA_Slice_H264_Long* sliceLong,
+                   DXVA_Slice_H264_Short* sliceShort, int maxSlices,
+                   void* dest, int* destSize)
+{
+    BuildBitStreamFunc build = GetBitStreamBuilder(!!sliceLong, nalLength);
+    if (!build)
+        return 0;
+
+    return build(data, size, cont, picParams, sliceLong, sliceShort,
+                 maxSlices, dest, destSize);
+}
 } // namespace h264_detail
\ No newline at end of file
@@ -1,8 +1,7 @@
 #ifndef _H264_DETAIL_H_
 #define _H264_DETAIL_H_
 
-#include <windows.h>
-#include <dxva.h>
+#include "dxva_h264.h"
 
 class CCodecContext;
 
@@ -20,6 +19,28 @@ void SetCurrentPicIndex(int index, DXVA_PicParams_H264* picParams,
                         CCodecContext* cont);
 void UpdateRefFramesList(DXVA_PicParams_H264* picParams,
                          const CCodecContext* cont);
+
+// Copies the slices of an access unit into |dest| behind Annex-B start codes,
+// zero padded to a multiple of 128 bytes, and fills in a slice control entry
+// per slice. Either |sliceLong| or |sliceShort| is given, with room for
+// |maxSlices| entries, |cont| and |picParams| are only used for long ones.
+// Returns the number of slices, |destSize| receives the bytes written.
+int BuildBitStream(const void* data, int size, int nalLength,
+                   const CCodecContext* cont,
+                   const DXVA_PicParams_H264* picParams,
+                   DXVA_Slice_H264_Long* sliceLong,
+                   DXVA_Slice_H264_Short* sliceShort, int maxSlices,
+                   void* dest, int* destSize);
+
+// BuildBitStream() for one slice format and NAL length, picked once when the
+// stream is set up. NULL for an unsupported NAL length.
+typedef int (*BuildBitStreamFunc)(const void* data, int size,
+                                  const CCodecContext* cont,
+                                  const DXVA_PicParams_H264* picParams,
+                                  DXVA_Slice_H264_Long* sliceLong,
+                                  DXVA_Slice_H264_Short* sliceShort,
+                                  int maxSlices, void* dest, int* destSize);
+BuildBitStreamFunc GetBitStreamBuilder(bool longSlices, int nalLength);
 }
 
 #endif  // _H264_DETAIL_H_
\ No newline at end of file
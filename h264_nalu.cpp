@@ -0,0 +1,121 @@
+#include "h264_nalu.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace
+{
+// Big-endian; the loop is unrolled for a constant size.
+template <int NALSize>
+int readNALSize(const uint8* data)
+{
+    int size = 0;
+    for (int i = 0; i < NALSize; ++i)
+        size = (size << 8) + data[i];
+
+    return size;
+}
+}
+
+void CH264NALU::SetBuffer(const void* buffer, int size, int NALSize)
+{
+    m_buffer = reinterpret_cast<const uint8*>(buffer);
+    m_size = size;
+    m_NALSize = NALSize;
+    m_curPos = 0;
+    m_nextRTP = 0;
+
+    m_startPos = 0;
+    m_dataPos = 0;
+}
+
+template <int NALSize>
+bool CH264NALU::moveToNextStartcode()
+{
+    int buffEnd =
+        (m_nextRTP > 0) ? std::min(m_nextRTP, m_size - 4) : m_size - 4;
+
+    for (int i = m_curPos; i < buffEnd; i++)
+    {
+        if ((*(reinterpret_cast<const uint32*>(m_buffer + i)) & 0x00FFFFFF) ==
+            0x00010000)
+        {
+            // Find next AnnexB Nal
+            m_curPos = i;
+            return true;
+        }
+    }
+
+    if (NALSize && (m_nextRTP < m_size))
+    {
+        m_curPos = m_nextRTP;
+        return true;
+    }
+
+    m_curPos = m_size;
+    return false;
+}
+
+template <int NALSize>
+bool CH264NALU::ReadNext()
+{
+    assert(NALSize == m_NALSize);
+    if (m_curPos >= m_size)
+        return false;
+
+    if (NALSize && (m_curPos == m_nextRTP))
+    {
+        // RTP Nalu type : (XX XX) XX XX NAL..., with XX XX XX XX or XX XX equal
+        // to NAL size
+        m_startPos = m_curPos;
+        m_dataPos = m_curPos + NALSize;
+        m_nextRTP += readNALSize<NALSize>(m_buffer + m_curPos) + NALSize;
+        m_curPos += NALSize;
+        moveToNextStartcode<NALSize>();
+    }
+    else
+    {
+        // Remove trailing bits
+        while (!m_buffer[m_curPos] &&
+            ((*(reinterpret_cast<const uint32*>(m_buffer + m_curPos)) &
+                0x00FFFFFF) != 0x00010000))
+            m_curPos++;
+
+        // AnnexB Nalu : 00 00 01 NAL...
+        m_startPos = m_curPos;
+        m_curPos += 3;
+        m_dataPos = m_curPos;
+        moveToNextStartcode<NALSize>();
+    }
+
+    forbiddenBit = (m_buffer[m_dataPos]>>7) & 1;
+    referenceIdc = (m_buffer[m_dataPos]>>5) & 3;
+    unitType = static_cast<KNALUType>(m_buffer[m_dataPos] & 0x1f);
+    return true;
+}
+
+template bool CH264NALU::ReadNext<0>();
+template bool CH264NALU::ReadNext<1>();
+template bool CH264NALU::ReadNext<2>();
+template bool CH264NALU::ReadNext<3>();
+template bool CH264NALU::ReadNext<4>();
+
+bool CH264NALU::ReadNext()
+{
+    switch (m_NALSize)
+    {
+        case 0:
+            return ReadNext<0>();
+        case 1:
+            return ReadNext<1>();
+        case 2:
+            return ReadNext<2>();
+        case 3:
+            return ReadNext<3>();
+        case 4:
+            return ReadNext<4>();
+    }
+
+    assert(false);
+    return false;
+}
\ No newline at end of file
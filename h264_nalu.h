@@ -0,0 +1,69 @@
+#ifndef _H264_NALU_H_
+#define _H264_NALU_H_
+
+#include "chromium/base/basictypes.h"
+
+enum KNALUType
+{
+    NALU_TYPE_SLICE = 1,
+    NALU_TYPE_DPA = 2,
+    NALU_TYPE_DPB = 3,
+    NALU_TYPE_DPC = 4,
+    NALU_TYPE_IDR = 5,
+    NALU_TYPE_SEI = 6,
+    NALU_TYPE_SPS = 7,
+    NALU_TYPE_PPS = 8,
+    NALU_TYPE_AUD = 9,
+    NALU_TYPE_EOSEQ = 10,
+    NALU_TYPE_EOSTREAM = 11,
+    NALU_TYPE_FILL = 12
+};
+
+class CH264NALU
+{
+public:
+    KNALUType GetType() const { return unitType; };
+    bool IsRefFrame() const { return (referenceIdc != 0); };
+
+    int GetDataLength() const { return m_curPos - m_dataPos; };
+    const uint8* GetDataBuffer() { return m_buffer + m_dataPos; };
+    int GetRoundedDataLength() const
+    {
+        int size = m_curPos - m_dataPos;
+        return size + 128 - (size % 128);
+    }
+
+    int GetLength() const { return m_curPos - m_startPos; };
+    const uint8* GetNALBuffer() { return m_buffer + m_startPos; };
+    bool IsEOF() const { return m_curPos >= m_size; };
+
+    void SetBuffer (const void* buffer, int size, int NALSize);
+    bool ReadNext();
+
+    // ReadNext() with the NAL size of SetBuffer() fixed at compile time, so
+    // per NAL loops need not branch on it. Instantiated for 0 to 4.
+    template <int NALSize> bool ReadNext();
+
+    int GetRawDataSize() const { return m_size; }
+    const void* GetRawDataBuffer() const { return m_buffer; }
+
+private:
+    template <int NALSize> bool moveToNextStartcode();
+
+    int forbiddenBit;       // should be always FALSE
+    int referenceIdc;       // NALU_PRIORITY_xxxx
+    KNALUType unitType;     // NALU_TYPE_xxxx    
+
+    int m_startPos;         // NALU start (including startcode / size)
+    int m_dataPos;          // Useful part
+    unsigned m_dataLen;     // Length of the NAL unit (Excluding the start
+                            // code, which does not belong to the NALU)
+
+    const uint8* m_buffer;
+    int m_curPos;
+    int m_nextRTP;
+    int m_size;
+    int m_NALSize;
+};
+
+#endif  // _H264_NALU_H_
\ No newline at end of file
@@ -0,0 +1,543 @@
+#include "h264_picture_parser.h"
+
+#include <cassert>
+#include <algorithm>
+#include <vector>
+
+#include "h264_nalu.h"
+
+namespace
+{
+// The padding CH264NALU may read behind the data it is given.
+const int nalPaddingSize = 4;
+
+// Reads the RBSP of a NAL unit, dropping the emulation prevention bytes as it
+// goes. Reading past the end gives zeros and sets IsOverrun().
+class CBitReader
+{
+public:
+    CBitReader(const uint8* data, int size)
+        : m_data(data)
+        , m_size(size)
+        , m_pos(0)
+        , m_zeros(0)
+        , m_byte(0)
+        , m_bitsLeft(0)
+        , m_overrun(false)
+    {
+    }
+
+    bool IsOverrun() const { return m_overrun; }
+
+    // More than the RBSP trailing bits left.
+    bool HasMoreData() const { return !m_bitsLeft && (m_pos + 1 < m_size); }
+
+    int ReadBit()
+    {
+        if (!m_bitsLeft)
+        {
+            if ((m_zeros >= 2) && (m_pos < m_size) && (3 == m_data[m_pos]))
+            {
+                ++m_pos;
+                m_zeros = 0;
+            }
+
+            if (m_pos >= m_size)
+            {
+                m_overrun = true;
+                return 0;
+            }
+
+            m_byte = m_data[m_pos++];
+            m_zeros = m_byte ? 0 : (m_zeros + 1);
+            m_bitsLeft = 8;
+        }
+
+        --m_bitsLeft;
+        return (m_byte >> m_bitsLeft) & 1;
+    }
+
+    int ReadBits(int count)
+    {
+        int value = 0;
+        for (int i = 0; i < count; ++i)
+            value = (value << 1) | ReadBit();
+
+        return value;
+    }
+
+    int ReadUE()
+    {
+        int zeros = 0;
+        while (!ReadBit() && !m_overrun)
+        {
+            if (++zeros > 30)
+            {
+                m_overrun = true;
+                return 0;
+            }
+        }
+
+        return (1 << zeros) - 1 + ReadBits(zeros);
+    }
+
+    int ReadSE()
+    {
+        const int code = ReadUE();
+        return (code & 1) ? ((code + 1) / 2) : -(code / 2);
+    }
+
+private:
+    const uint8* m_data;
+    int m_size;
+    int m_pos;
+    int m_zeros;
+    int m_byte;
+    int m_bitsLeft;
+    bool m_overrun;
+};
+
+bool hasChromaFormat(int profile)
+{
+    switch (profile)
+    {
+        case 44:
+        case 83:
+        case 86:
+        case 100:
+        case 110:
+        case 118:
+        case 122:
+        case 128:
+        case 134:
+        case 135:
+        case 138:
+        case 139:
+        case 244:
+            return true;
+    }
+
+    return false;
+}
+
+void skipScalingList(int size, CBitReader* bits)
+{
+    int last = 8;
+    int next = 8;
+    for (int i = 0; (i < size) && !bits->IsOverrun(); ++i)
+    {
+        if (next)
+            next = (last + bits->ReadSE() + 256) % 256;
+
+        last = next ? next : last;
+    }
+}
+
+// recovery_frame_cnt of the recovery point in an SEI NAL unit, -1 if it has
+// none.
+int parseRecoveryPoint(const uint8* nal, int size)
+{
+    CBitReader bits(nal + 1, size - 1);
+    while (bits.HasMoreData())
+    {
+        int type = 0;
+        int byte;
+        do
+        {
+            byte = bits.ReadBits(8);
+            type += byte;
+        } while ((0xFF == byte) && !bits.IsOverrun());
+
+        int payloadSize = 0;
+        do
+        {
+            byte = bits.ReadBits(8);
+            payloadSize += byte;
+        } while ((0xFF == byte) && !bits.IsOverrun());
+
+        if (bits.IsOverrun())
+            return -1;
+
+        if (6 == type)
+        {
+            const int count = bits.ReadUE();
+            return bits.IsOverrun() ? -1 : count;
+        }
+
+        for (int i = 0; (i < payloadSize) && !bits.IsOverrun(); ++i)
+            bits.ReadBits(8);
+    }
+
+    return -1;
+}
+
+// Adds |picture| to |pictures|, or updates it if it is the last one there.
+void addPicture(const CH264PictureParser::TPicture& picture,
+                CH264PictureParser::TPicture* pictures, int maxPictures,
+                int* count)
+{
+    if (*count && (pictures[*count - 1].Number == picture.Number))
+        pictures[*count - 1] = picture;
+    else if (*count < maxPictures)
+        pictures[(*count)++] = picture;
+}
+}
+
+CH264PictureParser::CH264PictureParser()
+    : m_sps()
+    , m_pps()
+    , m_lastSPS(-1)
+    , m_nalLength(0)
+    , m_picture()
+    , m_started(false)
+    , m_field(false)
+    , m_bottomField(false)
+    , m_paired(false)
+    , m_nextNumber(0)
+    , m_recoveryFrameCount(-1)
+    , m_prevPOCMsb(0)
+    , m_prevPOCLsb(0)
+{
+}
+
+CH264PictureParser::~CH264PictureParser()
+{
+}
+
+void CH264PictureParser::Init(const void* extraData, int extraDataSize,
+                              int nalLength)
+{
+    m_nalLength = nalLength;
+    const uint8* data = reinterpret_cast<const uint8*>(extraData);
+    if ((extraDataSize > 6) && (1 == data[0]))
+    {
+        m_nalLength = (data[4] & 3) + 1;
+        int pos = 5;
+        for (int set = 0; (set < 2) && (pos < extraDataSize); ++set)
+        {
+            // 5 bits of SPS count, a full byte of PPS count.
+            const int count = data[pos++] & (set ? 0xFF : 0x1F);
+            for (int i = 0; (i < count) && (pos + 2 <= extraDataSize); ++i)
+            {
+                const int nalSize = (data[pos] << 8) | data[pos + 1];
+                pos += 2;
+                if (!nalSize || (pos + nalSize > extraDataSize))
+                    break;
+
+                if (set)
+                    parsePPS(data + pos, nalSize);
+                else
+                    parseSPS(data + pos, nalSize);
+
+                pos += nalSize;
+            }
+        }
+
+        return;
+    }
+
+    if (extraDataSize < 3)
+        return;
+
+    // CH264NALU reads a little behind the parameter sets.
+    std::vector<uint8> padded(data, data + extraDataSize);
+    padded.resize(extraDataSize + nalPaddingSize, 0);
+    const bool startCodes = !data[0] && !data[1] &&
+        ((1 == data[2]) || (!data[2] && (extraDataSize > 3) && (1 == data[3])));
+    CH264NALU nalu;
+    nalu.SetBuffer(&padded[0], extraDataSize, startCodes ? 0 : 2);
+    while (nalu.ReadNext())
+    {
+        if (nalu.GetDataLength() <= 0)
+            continue;
+
+        if (NALU_TYPE_SPS == nalu.GetType())
+            parseSPS(nalu.GetDataBuffer(), nalu.GetDataLength());
+        else if (NALU_TYPE_PPS == nalu.GetType())
+            parsePPS(nalu.GetDataBuffer(), nalu.GetDataLength());
+    }
+}
+
+void CH264PictureParser::Reset()
+{
+    m_started = false;
+    m_recoveryFrameCount = -1;
+    m_prevPOCMsb = 0;
+    m_prevPOCLsb = 0;
+}
+
+int CH264PictureParser::Parse(const void* data, int size,
+                              TPicture* pictures, int maxPictures)
+{
+    assert(pictures);
+    int count = 0;
+    CH264NALU nalu;
+    nalu.SetBuffer(data, size, m_nalLength);
+    while (nalu.ReadNext())
+    {
+        const uint8* nal = nalu.GetDataBuffer();
+        const int nalSize = nalu.GetDataLength();
+        if (nalSize <= 1)
+            continue;
+
+        switch (nalu.GetType())
+        {
+            case NALU_TYPE_SLICE:
+            case NALU_TYPE_DPA:
+            case NALU_TYPE_IDR:
+                parseSlice(nal, nalSize, pictures, maxPictures, &count);
+                break;
+            case NALU_TYPE_SEI:
+            {
+                const int recoveryFrameCount = parseRecoveryPoint(nal, nalSize);
+                if (recoveryFrameCount >= 0)
+                    m_recoveryFrameCount = recoveryFrameCount;
+
+                break;
+            }
+            case NALU_TYPE_SPS:
+                parseSPS(nal, nalSize);
+                break;
+            case NALU_TYPE_PPS:
+                parsePPS(nal, nalSize);
+                break;
+            default:
+                break;
+        }
+    }
+
+    return count;
+}
+
+bool CH264PictureParser::GetCodedSize(int* width, int* height) const
+{
+    assert(width);
+    assert(height);
+    if (m_lastSPS < 0)
+        return false;
+
+    *width = m_sps[m_lastSPS].Width;
+    *height = m_sps[m_lastSPS].Height;
+    return true;
+}
+
+bool CH264PictureParser::FindEntryPoint(const void* data, int size,
+                                        int nalLength, bool* isIDR,
+                                        int* recoveryFrameCount)
+{
+    assert(isIDR);
+    assert(recoveryFrameCount);
+    *isIDR = false;
+    *recoveryFrameCount = -1;
+    CH264NALU nalu;
+    nalu.SetBuffer(data, size, nalLength);
+    while (nalu.ReadNext())
+    {
+        if (nalu.GetDataLength() <= 1)
+            continue;
+
+        if (NALU_TYPE_IDR == nalu.GetType())
+        {
+            *isIDR = true;
+        }
+        else if ((NALU_TYPE_SEI == nalu.GetType()) &&
+                 (*recoveryFrameCount < 0))
+        {
+            *recoveryFrameCount = parseRecoveryPoint(nalu.GetDataBuffer(),
+                                                     nalu.GetDataLength());
+        }
+    }
+
+    return *isIDR || (*recoveryFrameCount >= 0);
+}
+
+void CH264PictureParser::parseSPS(const uint8* nal, int size)
+{
+    CBitReader bits(nal + 1, size - 1);
+    const int profile = bits.ReadBits(8);
+    bits.ReadBits(16);          // Constraint flags and level_idc
+    const int id = bits.ReadUE();
+    if (bits.IsOverrun() || (id >= static_cast<int>(arraysize(m_sps))))
+        return;
+
+    TSPS sps = TSPS();
+    if (hasChromaFormat(profile))
+    {
+        const int chromaFormat = bits.ReadUE();
+        if (3 == chromaFormat)
+            sps.SeparateColourPlanes = !!bits.ReadBit();
+
+        bits.ReadUE();          // bit_depth_luma_minus8
+        bits.ReadUE();          // bit_depth_chroma_minus8
+        bits.ReadBit();         // qpprime_y_zero_transform_bypass_flag
+        if (bits.ReadBit())
+        {
+            const int listCount = (3 == chromaFormat) ? 12 : 8;
+            for (int i = 0; i < listCount; ++i)
+                if (bits.ReadBit())
+                    skipScalingList((i < 6) ? 16 : 64, &bits);
+        }
+    }
+
+    sps.Log2MaxFrameNum = bits.ReadUE() + 4;
+    sps.POCType = bits.ReadUE();
+    if (0 == sps.POCType)
+    {
+        sps.Log2MaxPOCLsb = bits.ReadUE() + 4;
+    }
+    else if (1 == sps.POCType)
+    {
+        bits.ReadBit();         // delta_pic_order_always_zero_flag
+        bits.ReadSE();          // offset_for_non_ref_pic
+        bits.ReadSE();          // offset_for_top_to_bottom_field
+        const int cycleLength = bits.ReadUE();
+        for (int i = 0; (i < cycleLength) && !bits.IsOverrun(); ++i)
+            bits.ReadSE();
+    }
+
+    bits.ReadUE();              // max_num_ref_frames
+    bits.ReadBit();             // gaps_in_frame_num_value_allowed_flag
+    const int widthInMBs = bits.ReadUE() + 1;
+    const int heightInMapUnits = bits.ReadUE() + 1;
+    sps.FrameMBsOnly = !!bits.ReadBit();
+    if (bits.IsOverrun() || (sps.Log2MaxFrameNum > 16) ||
+        (sps.POCType > 2) || (sps.Log2MaxPOCLsb > 16))
+        return;
+
+    sps.Width = widthInMBs * 16;
+    sps.Height = heightInMapUnits * 16 * (sps.FrameMBsOnly ? 1 : 2);
+    sps.Valid = true;
+    m_sps[id] = sps;
+    m_lastSPS = id;
+}
+
+void CH264PictureParser::parsePPS(const uint8* nal, int size)
+{
+    CBitReader bits(nal + 1, size - 1);
+    const int id = bits.ReadUE();
+    TPPS pps = TPPS();
+    pps.SPSID = bits.ReadUE();
+    bits.ReadBit();             // entropy_coding_mode_flag
+    pps.BottomFieldPOC = !!bits.ReadBit();
+    if (bits.IsOverrun() || (id >= static_cast<int>(arraysize(m_pps))) ||
+        (pps.SPSID >= static_cast<int>(arraysize(m_sps))))
+        return;
+
+    pps.Valid = true;
+    m_pps[id] = pps;
+}
+
+// A slice with first_mb_in_slice 0 starts a picture, unless it is the second
+// field of the one before. Arbitrary slice order isn't looked after.
+void CH264PictureParser::parseSlice(const uint8* nal, int size,
+                                    TPicture* pictures, int maxPictures,
+                                    int* count)
+{
+    const bool idr = (NALU_TYPE_IDR == (nal[0] & 0x1F));
+    const bool reference = !!(nal[0] & 0x60);
+    CBitReader bits(nal + 1, size - 1);
+    const int firstMB = bits.ReadUE();
+    const int sliceType = bits.ReadUE() % 5;
+    const int ppsID = bits.ReadUE();
+    if (bits.IsOverrun() || (ppsID >= static_cast<int>(arraysize(m_pps))) ||
+        !m_pps[ppsID].Valid || !m_sps[m_pps[ppsID].SPSID].Valid)
+        return;
+
+    const TPPS& pps = m_pps[ppsID];
+    const TSPS& sps = m_sps[pps.SPSID];
+    if (sps.SeparateColourPlanes)
+        bits.ReadBits(2);       // colour_plane_id
+
+    const int frameNum = bits.ReadBits(sps.Log2MaxFrameNum);
+    bool field = false;
+    bool bottomField = false;
+    if (!sps.FrameMBsOnly)
+    {
+        field = !!bits.ReadBit();
+        if (field)
+            bottomField = !!bits.ReadBit();
+    }
+
+    if (idr)
+        bits.ReadUE();          // idr_pic_id
+
+    int pocLsb = 0;
+    int deltaBottom = 0;
+    if (0 == sps.POCType)
+    {
+        pocLsb = bits.ReadBits(sps.Log2MaxPOCLsb);
+        if (pps.BottomFieldPOC && !field)
+            deltaBottom = bits.ReadSE();
+    }
+
+    if (bits.IsOverrun())
+        return;
+
+    m_lastSPS = pps.SPSID;
+    const bool intra = (2 == sliceType) || (4 == sliceType);
+    if (m_started && firstMB)
+    {
+        m_picture.Intra = m_picture.Intra && intra;
+        m_picture.Reference = m_picture.Reference || reference;
+        addPicture(m_picture, pictures, maxPictures, count);
+        return;
+    }
+
+    if (m_started && m_field && !m_paired && field &&
+        (bottomField != m_bottomField) && (frameNum == m_picture.FrameNum))
+    {
+        if (0 == sps.POCType)
+            getPOC(sps, false, reference, pocLsb, 0);
+
+        m_picture.Intra = m_picture.Intra && intra;
+        m_picture.Reference = m_picture.Reference || reference;
+        m_paired = true;
+        addPicture(m_picture, pictures, maxPictures, count);
+        return;
+    }
+
+    TPicture picture;
+    picture.Number = m_nextNumber++;
+    picture.IDR = idr;
+    picture.Intra = intra;
+    picture.Reference = reference;
+    picture.FrameNum = frameNum;
+    picture.HasPOC = (0 == sps.POCType);
+    picture.POC = picture.HasPOC ?
+        getPOC(sps, idr, reference, pocLsb, deltaBottom) : 0;
+    picture.RecoveryFrameCount = m_recoveryFrameCount;
+    m_recoveryFrameCount = -1;
+    m_picture = picture;
+    m_started = true;
+    m_field = field;
+    m_bottomField = bottomField;
+    m_paired = false;
+    addPicture(m_picture, pictures, maxPictures, count);
+}
+
+// POC type 0, 8.2.1.1. Memory management operation 5 isn't looked after,
+// the POCs only need to be in order around the pictures after a flush.
+int CH264PictureParser::getPOC(const TSPS& sps, bool idr, bool reference,
+                               int lsb, int deltaBottom)
+{
+    if (idr)
+    {
+        m_prevPOCMsb = 0;
+        m_prevPOCLsb = 0;
+    }
+
+    const int maxLsb = 1 << sps.Log2MaxPOCLsb;
+    int msb = m_prevPOCMsb;
+    if ((lsb < m_prevPOCLsb) && (m_prevPOCLsb - lsb >= maxLsb / 2))
+        msb += maxLsb;
+    else if ((lsb > m_prevPOCLsb) && (lsb - m_prevPOCLsb > maxLsb / 2))
+        msb -= maxLsb;
+
+    if (reference)
+    {
+        m_prevPOCMsb = msb;
+        m_prevPOCLsb = lsb;
+    }
+
+    return msb + lsb + std::min(0, deltaBottom);
+}
\ No newline at end of file
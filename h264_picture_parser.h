@@ -0,0 +1,99 @@
+#ifndef _H264_PICTURE_PARSER_H_
+#define _H264_PICTURE_PARSER_H_
+
+#include "chromium/base/basictypes.h"
+
+// Follows the pictures of an H.264 stream in decoding order, from the slice
+// headers, parameter sets and SEI of the packets. It needs none of the state
+// of libavcodec, whose frame threads keep it to themselves. The packets are
+// walked once, without allocating.
+class CH264PictureParser
+{
+public:
+    struct TPicture
+    {
+        int Number;             // In decoding order, never reused
+        bool IDR;
+        bool Intra;             // Only I and SI slices so far
+        bool Reference;         // A slice with nal_ref_idc set so far
+        int FrameNum;
+        bool HasPOC;            // Only worked out for POC type 0
+        int POC;                // The lower of its fields
+        int RecoveryFrameCount; // -1 without a recovery point SEI
+    };
+
+    CH264PictureParser();
+    ~CH264PictureParser();
+
+    // |extraData| is an avcC record, or parameter sets behind start codes or
+    // 2 byte lengths. The packets are framed with |nalLength| byte lengths,
+    // or with start codes if it is 0, unless the avcC record says otherwise.
+    void Init(const void* extraData, int extraDataSize, int nalLength);
+
+    // Forgets the picture being parsed after a flush, the parameter sets
+    // stay.
+    void Reset();
+
+    // Writes the pictures |data| holds slices of to |pictures|, at most
+    // |maxPictures| of them, in decoding order. The first may be a picture of
+    // an earlier packet going on, the slices of a picture or the fields of a
+    // pair may come in several packets. |data| is padded as for libavcodec.
+    // Returns their count.
+    int Parse(const void* data, int size, TPicture* pictures,
+              int maxPictures);
+
+    // The macroblock aligned size of the last SPS used or parsed, false
+    // before there is one.
+    bool GetCodedSize(int* width, int* height) const;
+
+    // Whether decoding can start at |data|: it holds an IDR slice or a
+    // recovery point SEI, whose count is -1 otherwise. Needs no parameter
+    // sets.
+    static bool FindEntryPoint(const void* data, int size, int nalLength,
+                               bool* isIDR, int* recoveryFrameCount);
+
+private:
+    struct TSPS
+    {
+        bool Valid;
+        bool SeparateColourPlanes;
+        bool FrameMBsOnly;
+        int Log2MaxFrameNum;
+        int POCType;
+        int Log2MaxPOCLsb;
+        int Width;
+        int Height;
+    };
+
+    struct TPPS
+    {
+        bool Valid;
+        int SPSID;
+        bool BottomFieldPOC;    // bottom_field_pic_order_in_frame_present
+    };
+
+    void parseSPS(const uint8* nal, int size);
+    void parsePPS(const uint8* nal, int size);
+
+    // Adds the picture of the slice to |pictures| as Parse() describes.
+    void parseSlice(const uint8* nal, int size, TPicture* pictures,
+                    int maxPictures, int* count);
+    int getPOC(const TSPS& sps, bool idr, bool reference, int lsb,
+               int deltaBottom);
+
+    TSPS m_sps[32];
+    TPPS m_pps[256];
+    int m_lastSPS;              // -1 before the first
+    int m_nalLength;
+    TPicture m_picture;         // The last one started
+    bool m_started;             // False after a reset
+    bool m_field;               // m_picture is a field
+    bool m_bottomField;
+    bool m_paired;              // Both fields of m_picture seen
+    int m_nextNumber;
+    int m_recoveryFrameCount;   // For the next picture, -1 without
+    int m_prevPOCMsb;           // Of the last reference picture
+    int m_prevPOCLsb;
+};
+
+#endif  // _H264_PICTURE_PARSER_H_
\ No newline at end of file
@@ -0,0 +1,262 @@
+#include "log_sink.h"
+
+#include <cassert>
+#include <algorithm>
+
+#include "chromium/base/string_util.h"
+#include "chromium/base/time.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+using std::vector;
+using base::subtle::Atomic32;
+
+namespace
+{
+const int defaultLevel = 24;    // AV_LOG_WARNING
+const int slotCount = 256;
+
+Atomic32 hashText(const char* text)
+{
+    uint32 hash = 2166136261u;
+    for (; *text; ++text)
+        hash = (hash ^ static_cast<uint8>(*text)) * 16777619u;
+
+    return static_cast<Atomic32>(hash);
+}
+
+class CSequenceLess
+{
+public:
+    explicit CSequenceLess(const vector<int>& sequences)
+        : m_sequences(sequences)
+    {
+    }
+
+    bool operator()(int a, int b) const
+    {
+        return m_sequences[a] < m_sequences[b];
+    }
+
+private:
+    const vector<int>& m_sequences;
+};
+}
+
+CLogSink::CLogSink()
+    : m_level(defaultLevel)
+    , m_slots(slotCount)
+    , m_nextSequence(0)
+    , m_dropped(0)
+    , m_lastHash(0)
+    , m_repeats(0)
+    , m_repeatLevel(defaultLevel)
+    , m_threadBuffer(freeThreadBuffer)
+    , m_outputAccess()
+    , m_file(NULL)
+    , m_callback(NULL)
+    , m_callbackContext(NULL)
+    , m_wake(false, false)
+    , m_stopping(false)
+    , m_thread()
+    , m_threadStarted(false)
+{
+    m_threadStarted = PlatformThread::Create(0, this, &m_thread);
+}
+
+CLogSink::~CLogSink()
+{
+    if (m_threadStarted)
+    {
+        m_stopping = true;
+        m_wake.Signal();
+        PlatformThread::Join(m_thread);
+    }
+
+    if (m_file)
+        fclose(m_file);
+}
+
+void CLogSink::SetLevel(int level)
+{
+    base::subtle::NoBarrier_Store(&m_level, level);
+}
+
+int CLogSink::GetLevel() const
+{
+    return base::subtle::NoBarrier_Load(&m_level);
+}
+
+bool CLogSink::SetFile(const char* fileName)
+{
+    AutoLock lock(m_outputAccess);
+    if (m_file)
+    {
+        fclose(m_file);
+        m_file = NULL;
+    }
+
+    if (!fileName)
+        return true;
+
+    m_file = fopen(fileName, "a");
+    return !!m_file;
+}
+
+void CLogSink::SetCallback(OutputFunc func, void* context)
+{
+    AutoLock lock(m_outputAccess);
+    m_callback = func;
+    m_callbackContext = context;
+}
+
+void CLogSink::Log(int level, const char* format, va_list args)
+{
+    // Most of what a corrupt stream makes ffmpeg say is filtered out here,
+    // before the cost of formatting.
+    if (level > base::subtle::NoBarrier_Load(&m_level))
+        return;
+
+    char* buffer = getThreadBuffer();
+    base::vsnprintf(buffer, messageSize, format, args);
+
+    // Only counted while it repeats, the count is posted ahead of the next
+    // different message. Two threads racing here at worst post a duplicate.
+    const Atomic32 hash = hashText(buffer);
+    if (hash == base::subtle::NoBarrier_Load(&m_lastHash))
+    {
+        base::subtle::NoBarrier_AtomicIncrement(&m_repeats, 1);
+        return;
+    }
+
+    postRepeats();
+    base::subtle::NoBarrier_Store(&m_lastHash, hash);
+    base::subtle::NoBarrier_Store(&m_repeatLevel, level);
+    post(level, buffer);
+}
+
+int CLogSink::GetDroppedCount() const
+{
+    return base::subtle::NoBarrier_Load(&m_dropped);
+}
+
+void CLogSink::ThreadMain()
+{
+    PlatformThread::SetName("Log sink");
+    while (!m_stopping)
+    {
+        // A run of repeats that nothing follows is still reported after a
+        // second.
+        if (!m_wake.TimedWait(base::TimeDelta::FromSeconds(1)))
+            postRepeats();
+
+        writeSlots();
+    }
+
+    postRepeats();
+    writeSlots();
+}
+
+void CLogSink::freeThreadBuffer(void* buffer)
+{
+    delete[] static_cast<char*>(buffer);
+}
+
+// Allocated once for the lifetime of each thread that logs, and freed by the
+// TLS slot when the thread exits.
+char* CLogSink::getThreadBuffer()
+{
+    char* buffer = static_cast<char*>(m_threadBuffer.Get());
+    if (!buffer)
+    {
+        buffer = new char[messageSize];
+        m_threadBuffer.Set(buffer);
+    }
+
+    return buffer;
+}
+
+// Claims the slot at the next sequence number. If the sink thread has not
+// emptied it yet, the ring is full and the message is counted as dropped,
+// never waited for.
+void CLogSink::post(int level, const char* text)
+{
+    const Atomic32 sequence =
+        base::subtle::NoBarrier_AtomicIncrement(&m_nextSequence, 1);
+    TSlot& slot = m_slots[static_cast<uint32>(sequence) % slotCount];
+    if (base::subtle::NoBarrier_CompareAndSwap(&slot.State, SLOT_FREE,
+                                               SLOT_WRITING) != SLOT_FREE)
+    {
+        base::subtle::NoBarrier_AtomicIncrement(&m_dropped, 1);
+        return;
+    }
+
+    slot.Sequence = sequence;
+    slot.Level = level;
+    base::strlcpy(slot.Text, text, messageSize);
+    base::subtle::Release_Store(&slot.State, SLOT_READY);
+    m_wake.Signal();
+}
+
+void CLogSink::postRepeats()
+{
+    const Atomic32 repeats =
+        base::subtle::NoBarrier_AtomicExchange(&m_repeats, 0);
+    if (repeats <= 0)
+        return;
+
+    char text[64];
+    base::snprintf(text, sizeof(text), "Last message repeated %d times\n",
+                   repeats);
+    post(base::subtle::NoBarrier_Load(&m_repeatLevel), text);
+}
+
+// Slots are filled out of order by concurrent threads, so the ready ones are
+// written in sequence order. A slot still being filled is picked up on the
+// next wake.
+void CLogSink::writeSlots()
+{
+    vector<int> ready;
+    vector<int> sequences(slotCount);
+    for (int i = 0; i < slotCount; ++i)
+    {
+        if (base::subtle::Acquire_Load(&m_slots[i].State) == SLOT_READY)
+        {
+            ready.push_back(i);
+            sequences[i] = m_slots[i].Sequence;
+        }
+    }
+
+    std::sort(ready.begin(), ready.end(), CSequenceLess(sequences));
+
+    AutoLock lock(m_outputAccess);
+    for (int i = 0; i < static_cast<int>(ready.size()); ++i)
+    {
+        TSlot& slot = m_slots[ready[i]];
+        write(slot.Level, slot.Text);
+        base::subtle::Release_Store(&slot.State, SLOT_FREE);
+    }
+
+    if (m_file)
+        fflush(m_file);
+}
+
+void CLogSink::write(int level, const char* text)
+{
+    if (m_file)
+        fputs(text, m_file);
+
+    if (m_callback)
+        m_callback(level, text, m_callbackContext);
+
+    if (m_file || m_callback)
+        return;
+
+#if defined(_WIN32)
+    OutputDebugStringA(text);
+#else
+    fputs(text, stderr);
+#endif
+}
\ No newline at end of file
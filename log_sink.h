@@ -0,0 +1,96 @@
+#ifndef _LOG_SINK_H_
+#define _LOG_SINK_H_
+
+#include <cstdarg>
+#include <cstdio>
+#include <vector>
+
+#include "chromium/base/atomicops.h"
+#include "chromium/base/basictypes.h"
+#include "chromium/base/lock.h"
+#include "chromium/base/platform_thread.h"
+#include "chromium/base/singleton.h"
+#include "chromium/base/thread_local_storage.h"
+#include "chromium/base/waitable_event.h"
+
+// Takes log messages off the decoding threads. Messages above the level are
+// dropped before being formatted, the rest are formatted into a buffer owned
+// by the calling thread and copied into a fixed ring of message slots, so
+// logging never allocates. A background thread writes the slots out to a
+// file, a callback, or the debugger. Runs of the same message are folded
+// into a single "repeated" line.
+class CLogSink : public Singleton<CLogSink>, public PlatformThread::Delegate
+{
+public:
+    typedef void (*OutputFunc)(int level, const char* message, void* context);
+
+    CLogSink();
+    ~CLogSink();
+
+    // Levels follow ffmpeg, a lower level is more severe. Defaults to
+    // AV_LOG_WARNING.
+    void SetLevel(int level);
+    int GetLevel() const;
+
+    // Appends to |fileName|, NULL closes the file.
+    bool SetFile(const char* fileName);
+
+    // |func| is called on the sink thread. With neither a file nor a
+    // callback, messages go to the debugger.
+    void SetCallback(OutputFunc func, void* context);
+
+    void Log(int level, const char* format, va_list args);
+
+    // Messages lost because the ring was full.
+    int GetDroppedCount() const;
+
+    // PlatformThread::Delegate
+    virtual void ThreadMain();
+
+private:
+    static const int messageSize = 512;
+
+    enum KSlotState
+    {
+        SLOT_FREE = 0,
+        SLOT_WRITING = 1,
+        SLOT_READY = 2
+    };
+
+    struct TSlot
+    {
+        volatile base::subtle::Atomic32 State;
+        int Sequence;
+        int Level;
+        char Text[messageSize];
+    };
+
+    static void freeThreadBuffer(void* buffer);
+
+    char* getThreadBuffer();
+    void post(int level, const char* text);
+    void postRepeats();
+    void writeSlots();
+    void write(int level, const char* text);
+
+    volatile base::subtle::Atomic32 m_level;
+    std::vector<TSlot> m_slots;
+    volatile base::subtle::Atomic32 m_nextSequence;
+    volatile base::subtle::Atomic32 m_dropped;
+    volatile base::subtle::Atomic32 m_lastHash;
+    volatile base::subtle::Atomic32 m_repeats;
+    volatile base::subtle::Atomic32 m_repeatLevel;
+    ThreadLocalStorage::Slot m_threadBuffer;
+
+    Lock m_outputAccess;        // Never taken by the logging threads
+    FILE* m_file;
+    OutputFunc m_callback;
+    void* m_callbackContext;
+
+    base::WaitableEvent m_wake;
+    volatile bool m_stopping;
+    PlatformThreadHandle m_thread;
+    bool m_threadStarted;
+};
+
+#endif  // _LOG_SINK_H_
\ No newline at end of file
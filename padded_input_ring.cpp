@@ -0,0 +1,67 @@
+#include "padded_input_ring.h"
+
+#include <cassert>
+#include <algorithm>
+
+using std::vector;
+
+CPaddedInputRing::CPaddedInputRing(int slotCount, int paddingSize)
+    : m_slots(std::max(slotCount, 1))
+    , m_nextSlot(0)
+    , m_paddingSize(paddingSize)
+    , m_largestSample(0)
+    , m_copiedBytes(0)
+{
+    assert(paddingSize >= 0);
+}
+
+CPaddedInputRing::~CPaddedInputRing()
+{
+}
+
+const int8* CPaddedInputRing::Stage(uint8* data, int dataLength,
+                                    int bufferSize)
+{
+    assert(data);
+    assert((dataLength >= 0) && (dataLength <= bufferSize));
+
+    m_largestSample = std::max(m_largestSample, dataLength);
+    if (bufferSize - dataLength >= m_paddingSize)
+    {
+        // Still inside the sample's own buffer.
+        memset(data + dataLength, 0, m_paddingSize);
+        return reinterpret_cast<const int8*>(data);
+    }
+
+    vector<int8>& slot = m_slots[m_nextSlot];
+    m_nextSlot = (m_nextSlot + 1) % static_cast<int>(m_slots.size());
+
+    // Size the slot after the largest sample seen so far plus some headroom,
+    // so that a stream stops reallocating once its sample sizes settle.
+    const int slotSize = dataLength + m_paddingSize;
+    if (static_cast<int>(slot.size()) < slotSize)
+        vector<int8>(m_largestSample * 3 / 2 + m_paddingSize).swap(slot);
+
+    if (dataLength > 0)
+        memcpy(&slot[0], data, dataLength);
+
+    memset(&slot[0] + dataLength, 0, m_paddingSize);
+    m_copiedBytes += dataLength;
+    return &slot[0];
+}
+
+void CPaddedInputRing::SetSlotCount(int slotCount)
+{
+    m_slots.resize(std::max(slotCount, 1));
+    m_nextSlot = 0;
+}
+
+void CPaddedInputRing::Clear()
+{
+    for (int i = 0; i < static_cast<int>(m_slots.size()); ++i)
+        vector<int8>().swap(m_slots[i]);
+
+    m_nextSlot = 0;
+    m_largestSample = 0;
+    m_copiedBytes = 0;
+}
\ No newline at end of file
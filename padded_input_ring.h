@@ -0,0 +1,34 @@
+#ifndef _PADDED_INPUT_RING_H_
+#define _PADDED_INPUT_RING_H_
+
+#include <vector>
+
+#include "chromium/base/basictypes.h"
+
+// Hands the decoder input that is followed by the zero padding its bitstream
+// reader may overread. A sample whose buffer already has room for the padding
+// is used in place, any other one is copied into a ring of pre-padded slots,
+// so that an upstream buffer is never written past its end.
+class CPaddedInputRing
+{
+public:
+    CPaddedInputRing(int slotCount, int paddingSize);
+    ~CPaddedInputRing();
+
+    // Returns |data| itself or a padded copy of it. A copy stays valid until
+    // the ring comes round to the same slot again.
+    const int8* Stage(uint8* data, int dataLength, int bufferSize);
+    void SetSlotCount(int slotCount);
+    void Clear();
+
+    int64 GetCopiedBytes() const { return m_copiedBytes; }
+
+private:
+    std::vector<std::vector<int8> > m_slots;
+    int m_nextSlot;
+    int m_paddingSize;
+    int m_largestSample;
+    int64 m_copiedBytes;
+};
+
+#endif  // _PADDED_INPUT_RING_H_
\ No newline at end of file
@@ -0,0 +1,88 @@
+#include "random_access_index.h"
+
+#include <cassert>
+#include <algorithm>
+
+using std::vector;
+
+namespace
+{
+bool earlierThan(const CRandomAccessIndex::TEntryPoint& entryPoint,
+                 int64 time)
+{
+    return entryPoint.Start < time;
+}
+}
+
+CRandomAccessIndex::CRandomAccessIndex()
+    : m_access()
+    , m_entryPoints()
+{
+}
+
+CRandomAccessIndex::~CRandomAccessIndex()
+{
+}
+
+void CRandomAccessIndex::Add(const TEntryPoint& entryPoint)
+{
+    AutoLock lock(m_access);
+    vector<TEntryPoint>::iterator i =
+        std::lower_bound(m_entryPoints.begin(), m_entryPoints.end(),
+                         entryPoint.Start, earlierThan);
+
+    // The same access unit is met again after a seek back, keep the first
+    // record unless it can be upgraded to an IDR.
+    if ((i != m_entryPoints.end()) && (i->Start == entryPoint.Start))
+    {
+        if (entryPoint.IsIDR && !i->IsIDR)
+            *i = entryPoint;
+
+        return;
+    }
+
+    m_entryPoints.insert(i, entryPoint);
+}
+
+bool CRandomAccessIndex::FindEntryPoint(int64 time,
+                                        TEntryPoint* entryPoint) const
+{
+    assert(entryPoint);
+
+    AutoLock lock(m_access);
+    vector<TEntryPoint>::const_iterator i =
+        std::lower_bound(m_entryPoints.begin(), m_entryPoints.end(), time,
+                         earlierThan);
+    if ((i != m_entryPoints.end()) && (i->Start == time))
+    {
+        *entryPoint = *i;
+        return true;
+    }
+
+    // Nothing at or before the requested time.
+    if (i == m_entryPoints.begin())
+        return false;
+
+    *entryPoint = *(i - 1);
+    return true;
+}
+
+void CRandomAccessIndex::GetEntryPoints(vector<TEntryPoint>* entryPoints) const
+{
+    assert(entryPoints);
+
+    AutoLock lock(m_access);
+    *entryPoints = m_entryPoints;
+}
+
+int CRandomAccessIndex::GetSize() const
+{
+    AutoLock lock(m_access);
+    return static_cast<int>(m_entryPoints.size());
+}
+
+void CRandomAccessIndex::Clear()
+{
+    AutoLock lock(m_access);
+    m_entryPoints.clear();
+}
\ No newline at end of file
@@ -0,0 +1,37 @@
+#ifndef _RANDOM_ACCESS_INDEX_H_
+#define _RANDOM_ACCESS_INDEX_H_
+
+#include <vector>
+
+#include "chromium/base/basictypes.h"
+#include "chromium/base/lock.h"
+
+// Keeps the positions of the IDR pictures and recovery points seen while
+// streaming, so that a source can seek straight to the nearest entry point
+// instead of feeding the decoder data it will have to drop.
+class CRandomAccessIndex
+{
+public:
+    struct TEntryPoint
+    {
+        int64 Offset;           // Byte position of the access unit
+        int64 Start;            // Stream time: segment start plus sample time
+        bool IsIDR;             // False for recovery point SEI
+        int RecoveryFrameCount; // Frames to decode before the output is exact
+    };
+
+    CRandomAccessIndex();
+    ~CRandomAccessIndex();
+
+    void Add(const TEntryPoint& entryPoint);
+    bool FindEntryPoint(int64 time, TEntryPoint* entryPoint) const;
+    void GetEntryPoints(std::vector<TEntryPoint>* entryPoints) const;
+    int GetSize() const;
+    void Clear();
+
+private:
+    mutable Lock m_access;
+    std::vector<TEntryPoint> m_entryPoints; // Sorted by start time
+};
+
+#endif  // _RANDOM_ACCESS_INDEX_H_
\ No newline at end of file
@@ -0,0 +1,72 @@
+#ifndef _SPSC_QUEUE_H_
+#define _SPSC_QUEUE_H_
+
+#include <cassert>
+#include <vector>
+
+#include "chromium/base/atomicops.h"
+
+// Bounded queue between exactly one producer thread and one consumer thread.
+// Each side only writes its own index and publishes it with release
+// semantics, so neither side takes a lock. Waiting on a full or empty queue is
+// left to the caller.
+template <typename T>
+class CSPSCQueue
+{
+public:
+    explicit CSPSCQueue(int capacity)
+        : m_items(capacity + 1)
+        , m_head(0)
+        , m_tail(0)
+    {
+        assert(capacity > 0);
+    }
+
+    int GetCapacity() const { return static_cast<int>(m_items.size()) - 1; }
+
+    // Producer side.
+    bool TryPush(const T& item)
+    {
+        const base::subtle::Atomic32 tail = m_tail;
+        const base::subtle::Atomic32 next = advance(tail);
+        if (next == base::subtle::Acquire_Load(&m_head))
+            return false;
+
+        m_items[tail] = item;
+        base::subtle::Release_Store(&m_tail, next);
+        return true;
+    }
+
+    // Consumer side. The slot is reset, so that the queue doesn't keep what
+    // the item refers to alive.
+    bool TryPop(T* item)
+    {
+        assert(item);
+        const base::subtle::Atomic32 head = m_head;
+        if (head == base::subtle::Acquire_Load(&m_tail))
+            return false;
+
+        *item = m_items[head];
+        m_items[head] = T();
+        base::subtle::Release_Store(&m_head, advance(head));
+        return true;
+    }
+
+    bool IsEmpty() const
+    {
+        return base::subtle::Acquire_Load(&m_head) ==
+            base::subtle::Acquire_Load(&m_tail);
+    }
+
+private:
+    base::subtle::Atomic32 advance(base::subtle::Atomic32 i) const
+    {
+        return (i + 1) % static_cast<int>(m_items.size());
+    }
+
+    std::vector<T> m_items;
+    volatile base::subtle::Atomic32 m_head; // Next item to pop
+    volatile base::subtle::Atomic32 m_tail; // Next slot to push
+};
+
+#endif  // _SPSC_QUEUE_H_
\ No newline at end of file
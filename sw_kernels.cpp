@@ -0,0 +1,244 @@
+#include "sw_kernels.h"
+
+#include <emmintrin.h>
+
+namespace
+{
+void reducePlane2C(const uint8* source, int sourceStride, uint8* dest,
+                   int destStride, int destWidth, int destHeight)
+{
+    for (int y = 0; y < destHeight; ++y)
+    {
+        const uint8* row0 = source + sourceStride * y * 2;
+        const uint8* row1 = row0 + sourceStride;
+        uint8* destRow = dest + destStride * y;
+        for (int x = 0; x < destWidth; ++x)
+            destRow[x] = static_cast<uint8>(
+                (row0[x * 2] + row0[x * 2 + 1] + row1[x * 2] +
+                    row1[x * 2 + 1] + 2) >> 2);
+    }
+}
+
+void reducePlane4C(const uint8* source, int sourceStride, uint8* dest,
+                   int destStride, int destWidth, int destHeight)
+{
+    for (int y = 0; y < destHeight; ++y)
+    {
+        const uint8* rows = source + sourceStride * y * 4;
+        uint8* destRow = dest + destStride * y;
+        for (int x = 0; x < destWidth; ++x)
+        {
+            int sum = 0;
+            for (int i = 0; i < 4; ++i)
+                for (int j = 0; j < 4; ++j)
+                    sum += rows[sourceStride * i + x * 4 + j];
+
+            destRow[x] = static_cast<uint8>((sum + 8) >> 4);
+        }
+    }
+}
+
+// Averages the adjacent byte pairs of |v| into 8 words.
+inline __m128i averagePairs(__m128i v, __m128i lowBytes)
+{
+    return _mm_avg_epu16(_mm_and_si128(v, lowBytes), _mm_srli_epi16(v, 8));
+}
+
+// Averages the adjacent word pairs of |v| into 4 dwords.
+inline __m128i averageWordPairs(__m128i v, __m128i lowWords)
+{
+    return _mm_avg_epu16(_mm_and_si128(v, lowWords), _mm_srli_epi32(v, 16));
+}
+
+// The SSE2 versions average with pavg, which rounds up at every step. The
+// result may exceed the exact box filter by one (2:1) or two (4:1) levels,
+// which doesn't matter for previews.
+void reducePlane2SSE2(const uint8* source, int sourceStride, uint8* dest,
+                      int destStride, int destWidth, int destHeight)
+{
+    const int blockWidth = destWidth & ~15;
+    const __m128i lowBytes = _mm_set1_epi16(0x00FF);
+    for (int y = 0; y < destHeight; ++y)
+    {
+        const uint8* row0 = source + sourceStride * y * 2;
+        const uint8* row1 = row0 + sourceStride;
+        uint8* destRow = dest + destStride * y;
+        for (int x = 0; x < blockWidth; x += 16)
+        {
+            const __m128i* a = reinterpret_cast<const __m128i*>(row0 + x * 2);
+            const __m128i* b = reinterpret_cast<const __m128i*>(row1 + x * 2);
+            __m128i v0 = _mm_avg_epu8(_mm_loadu_si128(a),
+                                      _mm_loadu_si128(b));
+            __m128i v1 = _mm_avg_epu8(_mm_loadu_si128(a + 1),
+                                      _mm_loadu_si128(b + 1));
+            __m128i r = _mm_packus_epi16(averagePairs(v0, lowBytes),
+                                         averagePairs(v1, lowBytes));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(destRow + x), r);
+        }
+
+        for (int x = blockWidth; x < destWidth; ++x)
+            destRow[x] = static_cast<uint8>(
+                (row0[x * 2] + row0[x * 2 + 1] + row1[x * 2] +
+                    row1[x * 2 + 1] + 2) >> 2);
+    }
+}
+
+void reducePlane4SSE2(const uint8* source, int sourceStride, uint8* dest,
+                      int destStride, int destWidth, int destHeight)
+{
+    const int blockWidth = destWidth & ~15;
+    const __m128i lowBytes = _mm_set1_epi16(0x00FF);
+    const __m128i lowWords = _mm_set1_epi32(0x0000FFFF);
+    for (int y = 0; y < destHeight; ++y)
+    {
+        const uint8* rows = source + sourceStride * y * 4;
+        uint8* destRow = dest + destStride * y;
+        for (int x = 0; x < blockWidth; x += 16)
+        {
+            __m128i quads[4];
+            for (int i = 0; i < 4; ++i)
+            {
+                const int offset = x * 4 + i * 16;
+                __m128i r0 = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i*>(rows + offset));
+                __m128i r1 = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i*>(
+                        rows + sourceStride + offset));
+                __m128i r2 = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i*>(
+                        rows + sourceStride * 2 + offset));
+                __m128i r3 = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i*>(
+                        rows + sourceStride * 3 + offset));
+                __m128i v = _mm_avg_epu8(_mm_avg_epu8(r0, r1),
+                                         _mm_avg_epu8(r2, r3));
+                quads[i] = averageWordPairs(averagePairs(v, lowBytes),
+                                            lowWords);
+            }
+
+            __m128i r = _mm_packus_epi16(_mm_packs_epi32(quads[0], quads[1]),
+                                         _mm_packs_epi32(quads[2], quads[3]));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(destRow + x), r);
+        }
+
+        if (blockWidth < destWidth)
+            reducePlane4C(rows + blockWidth * 4, sourceStride,
+                          destRow + blockWidth, destStride,
+                          destWidth - blockWidth, 1);
+    }
+}
+
+template <typename T>
+void packP01xC(const uint8* const* planes, const int* strides, uint8* destY,
+               uint8* destUV, int destStride, int width, int height,
+               int shift)
+{
+    for (int y = 0; y < height; ++y)
+    {
+        const T* source =
+            reinterpret_cast<const T*>(planes[0] + strides[0] * y);
+        uint16* destRow = reinterpret_cast<uint16*>(destY + destStride * y);
+        for (int x = 0; x < width; ++x)
+            destRow[x] = static_cast<uint16>(source[x] << shift);
+    }
+
+    for (int y = 0; y < height / 2; ++y)
+    {
+        const T* u = reinterpret_cast<const T*>(planes[1] + strides[1] * y);
+        const T* v = reinterpret_cast<const T*>(planes[2] + strides[2] * y);
+        uint16* destRow = reinterpret_cast<uint16*>(destUV + destStride * y);
+        for (int x = 0; x < width / 2; ++x)
+        {
+            destRow[x * 2] = static_cast<uint16>(u[x] << shift);
+            destRow[x * 2 + 1] = static_cast<uint16>(v[x] << shift);
+        }
+    }
+}
+
+// Loads 8 samples as words.
+inline __m128i loadSamples(const uint8* source, __m128i zero)
+{
+    return _mm_unpacklo_epi8(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i*>(source)), zero);
+}
+
+inline __m128i loadSamples(const uint16* source, __m128i zero)
+{
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(source));
+}
+
+template <typename T>
+void packP01xSSE2(const uint8* const* planes, const int* strides,
+                  uint8* destY, uint8* destUV, int destStride, int width,
+                  int height, int shift)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    const int lumaBlockWidth = width & ~7;
+    for (int y = 0; y < height; ++y)
+    {
+        const T* source =
+            reinterpret_cast<const T*>(planes[0] + strides[0] * y);
+        uint16* destRow = reinterpret_cast<uint16*>(destY + destStride * y);
+        for (int x = 0; x < lumaBlockWidth; x += 8)
+            _mm_storeu_si128(
+                reinterpret_cast<__m128i*>(destRow + x),
+                _mm_sll_epi16(loadSamples(source + x, zero), count));
+
+        for (int x = lumaBlockWidth; x < width; ++x)
+            destRow[x] = static_cast<uint16>(source[x] << shift);
+    }
+
+    const int chromaWidth = width / 2;
+    const int chromaBlockWidth = chromaWidth & ~7;
+    for (int y = 0; y < height / 2; ++y)
+    {
+        const T* u = reinterpret_cast<const T*>(planes[1] + strides[1] * y);
+        const T* v = reinterpret_cast<const T*>(planes[2] + strides[2] * y);
+        uint16* destRow = reinterpret_cast<uint16*>(destUV + destStride * y);
+        for (int x = 0; x < chromaBlockWidth; x += 8)
+        {
+            __m128i u8 = _mm_sll_epi16(loadSamples(u + x, zero), count);
+            __m128i v8 = _mm_sll_epi16(loadSamples(v + x, zero), count);
+            __m128i* d = reinterpret_cast<__m128i*>(destRow + x * 2);
+            _mm_storeu_si128(d, _mm_unpacklo_epi16(u8, v8));
+            _mm_storeu_si128(d + 1, _mm_unpackhi_epi16(u8, v8));
+        }
+
+        for (int x = chromaBlockWidth; x < chromaWidth; ++x)
+        {
+            destRow[x * 2] = static_cast<uint16>(u[x] << shift);
+            destRow[x * 2 + 1] = static_cast<uint16>(v[x] << shift);
+        }
+    }
+}
+}
+
+namespace sw_kernels
+{
+ReducePlaneFunc GetReducePlaneFunc(int shift, bool useSSE2)
+{
+    switch (shift)
+    {
+        case 1:
+            return useSSE2 ? reducePlane2SSE2 : reducePlane2C;
+        case 2:
+            return useSSE2 ? reducePlane4SSE2 : reducePlane4C;
+        default:
+            return NULL;
+    }
+}
+
+PackP01xFunc GetPackP01xFunc(int bytesPerSample, bool useSSE2)
+{
+    switch (bytesPerSample)
+    {
+        case 1:
+            return useSSE2 ? packP01xSSE2<uint8> : packP01xC<uint8>;
+        case 2:
+            return useSSE2 ? packP01xSSE2<uint16> : packP01xC<uint16>;
+        default:
+            return NULL;
+    }
+}
+}
\ No newline at end of file
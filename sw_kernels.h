@@ -0,0 +1,28 @@
+#ifndef _SW_KERNELS_H_
+#define _SW_KERNELS_H_
+
+#include "chromium/base/basictypes.h"
+
+// Pixel kernels of the software output path that libswscale doesn't cover.
+namespace sw_kernels
+{
+// Box filters a plane by 2^shift in both directions.
+typedef void (*ReducePlaneFunc)(const uint8* source, int sourceStride,
+                                uint8* dest, int destStride, int destWidth,
+                                int destHeight);
+
+// Returns NULL if |shift| is not supported. Only 2:1 and 4:1 are.
+ReducePlaneFunc GetReducePlaneFunc(int shift, bool useSSE2);
+
+// Packs 4:2:0 Y, U and V planes into the P010/P016 layout: a plane of 16-bit
+// luma samples at |destY| and a plane of interleaved 16-bit UV pairs at
+// |destUV|, with every sample shifted left by |shift| to be MSB aligned.
+typedef void (*PackP01xFunc)(const uint8* const* planes, const int* strides,
+                             uint8* destY, uint8* destUV, int destStride,
+                             int width, int height, int shift);
+
+// |bytesPerSample| is the size of the decoded samples, 1 or 2.
+PackP01xFunc GetPackP01xFunc(int bytesPerSample, bool useSSE2);
+}
+
+#endif  // _SW_KERNELS_H_
\ No newline at end of file
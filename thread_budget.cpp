@@ -0,0 +1,201 @@
+#include "thread_budget.h"
+
+#include <cassert>
+#include <algorithm>
+
+#include "common/hardware_env.h"
+#include "ffmpeg.h"
+
+using std::map;
+
+namespace
+{
+// What one libavcodec thread keeps up with, about 1080p at 30 fps.
+const int64 macroblocksPerThread = 8160 * 30;
+
+// For streams that don't know their frame rate.
+const double defaultFrameRate = 25.0;
+}
+
+CThreadBudget::CClient::CClient(double frameRate)
+    : m_frameRate((frameRate > 0.0) ? frameRate : defaultFrameRate)
+    , m_id(-1)
+    , m_width(0)
+    , m_height(0)
+    , m_generation(-1)
+    , m_threadCount(0)
+{
+}
+
+CThreadBudget::CClient::~CClient()
+{
+    if (m_id >= 0)
+        CThreadBudget::get()->RemoveStream(m_id);
+}
+
+bool CThreadBudget::CClient::Apply(CCodecContext* codec, int width,
+                                   int height)
+{
+    assert(codec);
+
+    CThreadBudget* budget = CThreadBudget::get();
+    if (m_id < 0)
+    {
+        m_width = width;
+        m_height = height;
+        m_id = budget->AddStream(m_width, m_height, m_frameRate);
+    }
+    else if ((width != m_width) || (height != m_height))
+    {
+        m_width = width;
+        m_height = height;
+        budget->UpdateStream(m_id, m_width, m_height, m_frameRate);
+    }
+
+    const int generation = budget->GetGeneration();
+    if (generation == m_generation)
+        return false;
+
+    m_generation = generation;
+    const int threadCount = budget->GetThreadCount(m_id);
+    if (threadCount == m_threadCount)
+        return false;
+
+    m_threadCount = threadCount;
+    codec->SetThreadNumber(threadCount);
+    return true;
+}
+
+// A new size may end up with the same count, it is left to Apply() to find
+// out.
+bool CThreadBudget::CClient::IsOutdated(int width, int height) const
+{
+    if ((m_id < 0) || (width != m_width) || (height != m_height))
+        return true;
+
+    CThreadBudget* budget = CThreadBudget::get();
+    return (budget->GetGeneration() != m_generation) &&
+        (budget->GetThreadCount(m_id) != m_threadCount);
+}
+
+//------------------------------------------------------------------------------
+CThreadBudget::CThreadBudget()
+    : m_access()
+    , m_streams()
+    , m_nextID(0)
+    , m_processorCount(
+        std::max(1, CHardwareEnv::get()->GetNumOfLogicalProcessors()))
+    , m_generation(0)
+{
+}
+
+CThreadBudget::~CThreadBudget()
+{
+}
+
+int CThreadBudget::AddStream(int width, int height, double frameRate)
+{
+    AutoLock lock(m_access);
+    const int id = m_nextID++;
+    TStream stream = { getLoad(width, height, frameRate), 1 };
+    m_streams[id] = stream;
+    rebalance();
+    return id;
+}
+
+void CThreadBudget::UpdateStream(int id, int width, int height,
+                                 double frameRate)
+{
+    AutoLock lock(m_access);
+    map<int, TStream>::iterator i = m_streams.find(id);
+    assert(i != m_streams.end());
+    if (i == m_streams.end())
+        return;
+
+    i->second.Load = getLoad(width, height, frameRate);
+    rebalance();
+}
+
+void CThreadBudget::RemoveStream(int id)
+{
+    AutoLock lock(m_access);
+    m_streams.erase(id);
+    rebalance();
+}
+
+int CThreadBudget::GetThreadCount(int id) const
+{
+    AutoLock lock(m_access);
+    map<int, TStream>::const_iterator i = m_streams.find(id);
+    return (i == m_streams.end()) ? 1 : i->second.ThreadCount;
+}
+
+int CThreadBudget::GetGeneration() const
+{
+    return base::subtle::Acquire_Load(&m_generation);
+}
+
+void CThreadBudget::SetProcessorCount(int count)
+{
+    AutoLock lock(m_access);
+    m_processorCount = std::max(1, count);
+    rebalance();
+}
+
+int CThreadBudget::GetProcessorCount() const
+{
+    AutoLock lock(m_access);
+    return m_processorCount;
+}
+
+int64 CThreadBudget::getLoad(int width, int height, double frameRate)
+{
+    const int64 macroblocks = static_cast<int64>((width + 15) / 16) *
+        ((height + 15) / 16);
+    return static_cast<int64>(macroblocks *
+        ((frameRate > 0.0) ? frameRate : defaultFrameRate));
+}
+
+// Called with |m_access| held.
+void CThreadBudget::rebalance()
+{
+    int wanted = 0;
+    int64 totalLoad = 0;
+    for (map<int, TStream>::iterator i = m_streams.begin();
+         i != m_streams.end(); ++i)
+    {
+        const int64 threads =
+            (i->second.Load + macroblocksPerThread - 1) / macroblocksPerThread;
+        i->second.ThreadCount = static_cast<int>(
+            std::max<int64>(1, std::min<int64>(threads, m_processorCount)));
+        wanted += i->second.ThreadCount;
+        totalLoad += i->second.Load;
+    }
+
+    if ((wanted > m_processorCount) && (totalLoad > 0))
+    {
+        // Too many threads asked for, split the processors by load.
+        for (map<int, TStream>::iterator i = m_streams.begin();
+             i != m_streams.end(); ++i)
+        {
+            i->second.ThreadCount = static_cast<int>(std::max<int64>(
+                1, m_processorCount * i->second.Load / totalLoad));
+        }
+    }
+    else if (totalLoad > 0)
+    {
+        // Idle processors go to the heavier streams, so pictures that come
+        // early still decode fast. No stream gets more than twice what its
+        // load needs, more threads only add delay and contention.
+        const int64 spare = m_processorCount - wanted;
+        for (map<int, TStream>::iterator i = m_streams.begin();
+             i != m_streams.end(); ++i)
+        {
+            const int64 share = spare * i->second.Load / totalLoad;
+            i->second.ThreadCount += static_cast<int>(
+                std::min<int64>(share, i->second.ThreadCount));
+        }
+    }
+
+    base::subtle::Barrier_AtomicIncrement(&m_generation, 1);
+}
\ No newline at end of file
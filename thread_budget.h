@@ -0,0 +1,85 @@
+#ifndef _THREAD_BUDGET_H_
+#define _THREAD_BUDGET_H_
+
+#include <map>
+
+#include "chromium/base/atomicops.h"
+#include "chromium/base/basictypes.h"
+#include "chromium/base/lock.h"
+#include "chromium/base/singleton.h"
+
+class CCodecContext;
+
+// Shares the processors among the software decoders of the process. A stream
+// asks for threads by its load in macroblocks per second and gets what it
+// needs while there are processors left. Beyond that the processors are
+// split in proportion to the load, with one thread per stream at least.
+// Processors left over go to the streams by load too, up to twice the threads
+// a stream needs. The split is redone whenever a stream starts, stops or
+// changes its format.
+class CThreadBudget : public Singleton<CThreadBudget>
+{
+public:
+    // Keeps one codec's thread count in line with the budget. libavcodec
+    // can't change the count with pictures in flight, so Apply() is called
+    // by the decoding thread only before the first Decode() after the codec
+    // is set up or flushed. A budget that moves in between is picked up at
+    // the next IDR picture, where the decoder drains and flushes the codec
+    // if IsOutdated().
+    class CClient
+    {
+    public:
+        explicit CClient(double frameRate);
+        ~CClient();
+
+        // |width| and |height| are of the coded pictures, 0 before the SPS
+        // is known. Returns true if the thread count of |codec| changed.
+        bool Apply(CCodecContext* codec, int width, int height);
+
+        // Whether Apply() would change the thread count.
+        bool IsOutdated(int width, int height) const;
+        int GetThreadCount() const { return m_threadCount; }
+
+    private:
+        double m_frameRate;
+        int m_id;
+        int m_width;
+        int m_height;
+        int m_generation;
+        int m_threadCount;
+    };
+
+    CThreadBudget();
+    ~CThreadBudget();
+
+    int AddStream(int width, int height, double frameRate);
+    void UpdateStream(int id, int width, int height, double frameRate);
+    void RemoveStream(int id);
+    int GetThreadCount(int id) const;
+
+    // Changes every time the threads are split anew, read without locking.
+    int GetGeneration() const;
+
+    // Defaults to the logical processors of the machine.
+    void SetProcessorCount(int count);
+    int GetProcessorCount() const;
+
+private:
+    struct TStream
+    {
+        int64 Load;             // Macroblocks per second
+        int ThreadCount;
+    };
+
+    static int64 getLoad(int width, int height, double frameRate);
+
+    void rebalance();
+
+    mutable Lock m_access;
+    std::map<int, TStream> m_streams;
+    int m_nextID;
+    int m_processorCount;
+    volatile base::subtle::Atomic32 m_generation;
+};
+
+#endif  // _THREAD_BUDGET_H_
\ No newline at end of file
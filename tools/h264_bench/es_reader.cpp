@@ -0,0 +1,358 @@
+#include "es_reader.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using std::vector;
+
+namespace
+{
+enum KNALType
+{
+    NAL_SLICE = 1,
+    NAL_IDR_SLICE = 5,
+    NAL_SEI = 6,
+    NAL_SPS = 7,
+    NAL_PPS = 8,
+    NAL_AUD = 9,
+    NAL_PREFIX_FIRST = 14,
+    NAL_PREFIX_LAST = 18
+};
+
+bool isValidNALLength(int nalLength)
+{
+    return (nalLength == 0) || (nalLength == 1) || (nalLength == 2) ||
+        (nalLength == 4);
+}
+
+bool isStartCode(const uint8* data)
+{
+    return !data[0] && !data[1] && (1 == data[2]);
+}
+}
+
+CESReader::CESReader()
+    : m_data(NULL)
+    , m_size(0)
+    , m_buffer()
+    , m_mapping(NULL)
+    , m_mappingSize(0)
+    , m_pageSize(0)
+    , m_copiedPages()
+    , m_savedPadding()
+    , m_paddingPos(-1)
+    , m_accessUnits()
+    , m_nalLength(0)
+    , m_current(0)
+    , m_bytesCopied(0)
+{
+}
+
+CESReader::~CESReader()
+{
+    close();
+}
+
+bool CESReader::Open(const char* fileName, int nalLength)
+{
+    assert(fileName);
+    close();
+    if (!isValidNALLength(nalLength))
+        return false;
+
+    FILE* file = fopen(fileName, "rb");
+    if (!file)
+        return false;
+
+    uint8 chunk[65536];
+    size_t read;
+    while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        m_buffer.insert(m_buffer.end(), chunk, chunk + read);
+
+    fclose(file);
+    m_data = m_buffer.empty() ? NULL : &m_buffer[0];
+    m_size = static_cast<int>(m_buffer.size());
+    m_nalLength = nalLength;
+    split();
+    Rewind();
+    return !m_accessUnits.empty();
+}
+
+// The file is mapped private and writable, so padding can be zeroed in place
+// without touching the file, followed by a page of zeros for the padding of
+// the last access unit.
+bool CESReader::Map(const char* fileName, int nalLength)
+{
+    assert(fileName);
+    close();
+    if (!isValidNALLength(nalLength))
+        return false;
+
+#if defined(_WIN32)
+    return false;
+#else
+    const int file = open(fileName, O_RDONLY);
+    if (file < 0)
+        return false;
+
+    // Offsets are ints.
+    const size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    struct stat status;
+    if (fstat(file, &status) || (status.st_size <= 0) ||
+        (status.st_size > 0x7FFFFFFF - static_cast<off_t>(pageSize) * 2))
+    {
+        ::close(file);
+        return false;
+    }
+
+    const size_t size = static_cast<size_t>(status.st_size);
+    const size_t mappedSize = (size + pageSize - 1) / pageSize * pageSize;
+    void* mapping = mmap(NULL, mappedSize + pageSize, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == mapping)
+    {
+        ::close(file);
+        return false;
+    }
+
+    const void* fileMapping = mmap(mapping, size, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_FIXED, file, 0);
+    ::close(file);
+    m_mapping = mapping;
+    m_mappingSize = mappedSize + pageSize;
+    m_pageSize = pageSize;
+    m_copiedPages.assign(m_mappingSize / pageSize, false);
+    if (MAP_FAILED == fileMapping)
+    {
+        close();
+        return false;
+    }
+
+    m_data = reinterpret_cast<const uint8*>(mapping);
+    m_size = static_cast<int>(size);
+    m_nalLength = nalLength;
+    split();
+    Rewind();
+    return !m_accessUnits.empty();
+#endif
+}
+
+void CESReader::Rewind()
+{
+    restorePadding();
+    m_current = 0;
+}
+
+bool CESReader::ReadAccessUnit(vector<uint8>* buffer, int paddingSize,
+                               int* size)
+{
+    assert(buffer);
+    assert(size);
+
+    restorePadding();
+    if (m_current + 1 >= static_cast<int>(m_accessUnits.size()))
+        return false;
+
+    const int begin = m_accessUnits[m_current];
+    *size = m_accessUnits[m_current + 1] - begin;
+    buffer->resize(*size + paddingSize);
+    memcpy(&(*buffer)[0], &m_data[begin], *size);
+    memset(&(*buffer)[*size], 0, paddingSize);
+    m_bytesCopied += *size;
+    ++m_current;
+    return true;
+}
+
+// The head of the next access unit is saved and zeroed, and put back before
+// the reader moves on. The first write to a page of the file makes the kernel
+// copy all of it, which is what gets counted; the page stays private after.
+bool CESReader::MapAccessUnit(int paddingSize, const uint8** data, int* size)
+{
+    assert(m_mapping);
+    assert(data);
+    assert(size);
+
+    restorePadding();
+    if (m_current + 1 >= static_cast<int>(m_accessUnits.size()))
+        return false;
+
+    const int begin = m_accessUnits[m_current];
+    const int end = m_accessUnits[m_current + 1];
+    assert(static_cast<size_t>(m_size + paddingSize) <= m_mappingSize);
+    const int saved = std::max(0, std::min(paddingSize, m_size - end));
+    if (saved)
+    {
+        uint8* padding = const_cast<uint8*>(m_data) + end;
+        m_savedPadding.assign(padding, padding + saved);
+        memset(padding, 0, saved);
+        m_paddingPos = end;
+        const size_t last = (end + saved - 1) / m_pageSize;
+        for (size_t page = end / m_pageSize; page <= last; ++page)
+        {
+            if (!m_copiedPages[page])
+            {
+                m_copiedPages[page] = true;
+                m_bytesCopied += m_pageSize;
+            }
+        }
+    }
+
+    *data = m_data + begin;
+    *size = end - begin;
+    ++m_current;
+    return true;
+}
+
+int CESReader::GetAccessUnitCount() const
+{
+    return m_accessUnits.empty() ?
+        0 : static_cast<int>(m_accessUnits.size()) - 1;
+}
+
+// |nalStart| includes the start code or the length, |next| is where the next
+// NAL unit starts.
+bool CESReader::findNextNAL(int pos, int* nalStart, int* payloadStart,
+                            int* next)
+{
+    assert(nalStart);
+    assert(payloadStart);
+    assert(next);
+
+    const int size = m_size;
+    if (m_nalLength)
+    {
+        if (pos + m_nalLength >= size)
+            return false;
+
+        uint32 length = 0;
+        for (int i = 0; i < m_nalLength; ++i)
+            length = (length << 8) | m_data[pos + i];
+
+        *nalStart = pos;
+        *payloadStart = pos + m_nalLength;
+        // A truncated or corrupt length ends the stream.
+        *next = (length > static_cast<uint32>(size - *payloadStart)) ?
+            size : (*payloadStart + static_cast<int>(length));
+        return true;
+    }
+
+    int i = pos;
+    while ((i + 3 <= size) && !isStartCode(&m_data[i]))
+        ++i;
+
+    if (i + 3 >= size)
+        return false;
+
+    *nalStart = ((i > pos) && !m_data[i - 1]) ? (i - 1) : i;
+    *payloadStart = i + 3;
+
+    // Zero bytes ahead of the next start code are trailing bytes of this NAL
+    // unit or the first byte of a 4-byte start code, either way they go with
+    // the next one.
+    int end = *payloadStart;
+    while ((end + 3 <= size) && !isStartCode(&m_data[end]))
+        ++end;
+
+    if (end + 3 > size)
+        end = size;
+
+    while ((end > *payloadStart) && (end < size) && !m_data[end - 1])
+        --end;
+
+    *next = end;
+    return true;
+}
+
+// An access unit starts with an AUD, SEI or parameter set following a
+// picture, or with the first slice of the next picture. Arbitrary slice
+// order is not taken care of.
+bool CESReader::startsAccessUnit(int payloadStart, int next) const
+{
+    if (payloadStart >= next)
+        return false;
+
+    const int type = m_data[payloadStart] & 0x1F;
+    if ((NAL_SEI == type) || (NAL_SPS == type) || (NAL_PPS == type) ||
+        (NAL_AUD == type) ||
+        ((type >= NAL_PREFIX_FIRST) && (type <= NAL_PREFIX_LAST)))
+        return true;
+
+    // first_mb_in_slice is ue(v) coded, a leading 1 bit is a 0.
+    if ((NAL_SLICE == type) || (NAL_IDR_SLICE == type))
+        return (payloadStart + 1 < next) && (m_data[payloadStart + 1] & 0x80);
+
+    return false;
+}
+
+void CESReader::split()
+{
+    m_accessUnits.clear();
+
+    bool hasSlice = false;
+    int pos = 0;
+    int nalStart;
+    int payloadStart;
+    int next;
+    while (findNextNAL(pos, &nalStart, &payloadStart, &next))
+    {
+        if (m_accessUnits.empty())
+        {
+            m_accessUnits.push_back(nalStart);
+        }
+        else if (hasSlice && startsAccessUnit(payloadStart, next))
+        {
+            m_accessUnits.push_back(nalStart);
+            hasSlice = false;
+        }
+
+        if (payloadStart < next)
+        {
+            const int type = m_data[payloadStart] & 0x1F;
+            if ((NAL_SLICE == type) || (NAL_IDR_SLICE == type))
+                hasSlice = true;
+        }
+
+        pos = next;
+    }
+
+    if (!m_accessUnits.empty())
+        m_accessUnits.push_back(m_size);
+}
+
+void CESReader::close()
+{
+    restorePadding();
+#if !defined(_WIN32)
+    if (m_mapping)
+        munmap(m_mapping, m_mappingSize);
+#endif
+
+    m_mapping = NULL;
+    m_mappingSize = 0;
+    m_pageSize = 0;
+    m_copiedPages.clear();
+    m_buffer.clear();
+    m_data = NULL;
+    m_size = 0;
+    m_accessUnits.clear();
+    m_bytesCopied = 0;
+}
+
+void CESReader::restorePadding()
+{
+    if (m_paddingPos < 0)
+        return;
+
+    memcpy(const_cast<uint8*>(m_data) + m_paddingPos, &m_savedPadding[0],
+           m_savedPadding.size());
+    m_paddingPos = -1;
+}
\ No newline at end of file
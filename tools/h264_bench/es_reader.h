@@ -0,0 +1,66 @@
+#ifndef _ES_READER_H_
+#define _ES_READER_H_
+
+#include <vector>
+
+#include "chromium/base/basictypes.h"
+
+// Splits an H.264 elementary stream file into access units. Annex-B streams
+// are cut at start codes, AVCC streams at their big-endian NAL lengths. The
+// access units keep the framing of the file, so they can be handed straight
+// to a decoder configured with the same NAL length.
+class CESReader
+{
+public:
+    CESReader();
+    ~CESReader();
+
+    // |nalLength| is 0 for Annex-B, else 1, 2 or 4. Open() reads the file
+    // into memory, Map() maps it, which is only supported on POSIX systems.
+    bool Open(const char* fileName, int nalLength);
+    bool Map(const char* fileName, int nalLength);
+    bool IsMapped() const { return !!m_mapping; }
+    void Rewind();
+
+    // Copies the next access unit into |buffer|, followed by |paddingSize|
+    // zero bytes. Returns false at the end of the stream.
+    bool ReadAccessUnit(std::vector<uint8>* buffer, int paddingSize,
+                        int* size);
+
+    // Points |data| at the next access unit of a mapped file, without a copy.
+    // The |paddingSize| bytes behind it read as zeros until the next call or
+    // Rewind(). Returns false at the end of the stream.
+    bool MapAccessUnit(int paddingSize, const uint8** data, int* size);
+
+    int GetAccessUnitCount() const;
+
+    // What the reader copied to hand out the access units so far. For a
+    // mapped file that is the pages the kernel copied on write, in full.
+    int64 GetBytesCopied() const { return m_bytesCopied; }
+
+private:
+    CESReader(const CESReader&);
+    void operator=(const CESReader&);
+
+    void close();
+    void restorePadding();
+    bool findNextNAL(int pos, int* nalStart, int* payloadStart, int* next);
+    bool startsAccessUnit(int payloadStart, int next) const;
+    void split();
+
+    const uint8* m_data;
+    int m_size;
+    std::vector<uint8> m_buffer;        // Data of a file that is read
+    void* m_mapping;
+    size_t m_mappingSize;
+    size_t m_pageSize;
+    std::vector<bool> m_copiedPages;    // Of the mapping, written to once
+    std::vector<uint8> m_savedPadding;  // What the zeros replaced
+    int m_paddingPos;
+    std::vector<int> m_accessUnits;     // Offsets, plus the file size
+    int m_nalLength;
+    int m_current;
+    int64 m_bytesCopied;
+};
+
+#endif  // _ES_READER_H_
\ No newline at end of file
@@ -0,0 +1,816 @@
+// Decodes an H.264 elementary stream outside of any filter graph and reports
+// throughput, per access unit latency, peak memory and the MD5 of the output.
+//
+//   h264_bench [options] <stream>
+//     --avcc <1|2|4>       AVCC stream with NAL lengths of that size, the
+//                          default is Annex-B
+//     --extradata <file>   avcC record or parameter sets to open the codec with
+//     --output <format>    yv12, yuy2, p010, p016 or none (default yv12)
+//     --threads <n>        Decoding threads per stream, default 1
+//     --thread-budget      Let the process-wide thread budget pick the
+//                          threads of each stream instead of --threads
+//     --fps <rate>         Frame rate the thread budget assumes, default 30
+//     --streams <n>        Decode the stream n times concurrently and report
+//                          the aggregate fps, default 1
+//     --runs <n>           Number of runs, default 3
+//     --mmap               Decode the access units in place from a mapping
+//                          of the stream rather than from copies (POSIX only)
+//     --pic-params         Drive the DXVA pic-param builders through a
+//                          stand-in accelerator instead of the SW path
+//     --frame-md5 <file>   Write the MD5 of every output picture of the first
+//                          run, one per line
+//     --json <file>        Write the results of all runs as JSON
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <boost/scoped_ptr.hpp>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "chromium/base/at_exit.h"
+#include "chromium/base/md5.h"
+#include "chromium/base/platform_thread.h"
+#include "chromium/base/string_util.h"
+#include "chromium/base/time.h"
+#include "es_reader.h"
+#include "ffmpeg.h"
+#include "h264_picture_parser.h"
+#include "stand_in_accelerator.h"
+#include "thread_budget.h"
+
+using std::vector;
+using std::string;
+using boost::shared_ptr;
+using boost::scoped_ptr;
+
+namespace
+{
+int makeFourCC(const char* code)
+{
+    return static_cast<uint8>(code[0]) | (static_cast<uint8>(code[1]) << 8) |
+        (static_cast<uint8>(code[2]) << 16) |
+        (static_cast<uint8>(code[3]) << 24);
+}
+
+struct TOptions
+{
+    const char* FileName;
+    int NALLength;
+    const char* ExtraDataFile;
+    const char* OutputFormat;
+    int Threads;
+    bool ThreadBudget;
+    double FrameRate;
+    int Streams;
+    int Runs;
+    bool Mapped;
+    bool PicParams;
+    const char* FrameDigestFile;
+    const char* JSONFile;
+};
+
+struct TRunResult
+{
+    int Frames;
+    int64 TotalTime;            // In microseconds, hashing left out
+    int64 SetupTime;            // Codec creation, in microseconds
+    int64 FirstFrameTime;       // From the first access unit, -1 if none
+    vector<int64> Latencies;    // Per access unit, hashing left out
+    string Digest;
+    vector<string> FrameDigests;
+    int Width;
+    int Height;
+    int64 BytesCopied;          // By the reader, to hand out access units
+    int AccessUnits;
+
+    // Over all the streams of the run, the rest is for the first stream.
+    int AggregateFrames;
+    int64 WallTime;             // In microseconds
+};
+
+void printUsage()
+{
+    fprintf(stderr,
+            "usage: h264_bench [--avcc <1|2|4>] [--extradata <file>]\n"
+            "                  [--output <yv12|yuy2|p010|p016|none>]\n"
+            "                  [--threads <n>] [--thread-budget]\n"
+            "                  [--fps <rate>] [--streams <n>] [--runs <n>]\n"
+            "                  [--mmap] [--pic-params]\n"
+            "                  [--frame-md5 <file>] [--json <file>]\n"
+            "                  <stream>\n");
+}
+
+bool parseOptions(int argc, char** argv, TOptions* options)
+{
+    options->FileName = NULL;
+    options->NALLength = 0;
+    options->ExtraDataFile = NULL;
+    options->OutputFormat = "yv12";
+    options->Threads = 1;
+    options->ThreadBudget = false;
+    options->FrameRate = 30.0;
+    options->Streams = 1;
+    options->Runs = 3;
+    options->Mapped = false;
+    options->PicParams = false;
+    options->FrameDigestFile = NULL;
+    options->JSONFile = NULL;
+    for (int i = 1; i < argc; ++i)
+    {
+        const bool hasValue = (i + 1 < argc);
+        if (!strcmp(argv[i], "--avcc") && hasValue)
+            options->NALLength = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--extradata") && hasValue)
+            options->ExtraDataFile = argv[++i];
+        else if (!strcmp(argv[i], "--output") && hasValue)
+            options->OutputFormat = argv[++i];
+        else if (!strcmp(argv[i], "--threads") && hasValue)
+            options->Threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--thread-budget"))
+            options->ThreadBudget = true;
+        else if (!strcmp(argv[i], "--fps") && hasValue)
+            options->FrameRate = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--streams") && hasValue)
+            options->Streams = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--runs") && hasValue)
+            options->Runs = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--mmap"))
+            options->Mapped = true;
+        else if (!strcmp(argv[i], "--pic-params"))
+            options->PicParams = true;
+        else if (!strcmp(argv[i], "--frame-md5") && hasValue)
+            options->FrameDigestFile = argv[++i];
+        else if (!strcmp(argv[i], "--json") && hasValue)
+            options->JSONFile = argv[++i];
+        else if ((argv[i][0] != '-') && !options->FileName)
+            options->FileName = argv[i];
+        else
+            return false;
+    }
+
+    return options->FileName && (options->Threads > 0) &&
+        (options->FrameRate > 0.0) && (options->Streams > 0) &&
+        (options->Runs > 0);
+}
+
+bool readFile(const char* fileName, vector<uint8>* data)
+{
+    FILE* file = fopen(fileName, "rb");
+    if (!file)
+        return false;
+
+    uint8 chunk[4096];
+    size_t read;
+    while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        data->insert(data->end(), chunk, chunk + read);
+
+    fclose(file);
+    return true;
+}
+
+// Size of a |width| x |height| picture in the output format, 0 if the format
+// is unknown.
+int getOutputSize(const char* format, int width, int height)
+{
+    if (!strcmp(format, "yv12"))
+        return width * height * 3 / 2;
+
+    if (!strcmp(format, "yuy2"))
+        return width * height * 2;
+
+    if (!strcmp(format, "p010") || !strcmp(format, "p016"))
+        return width * height * 3;
+
+    return 0;
+}
+
+int getPeakRSS()
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters,
+                              sizeof(counters)))
+        return 0;
+
+    return static_cast<int>(counters.PeakWorkingSetSize / 1024);
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage))
+        return 0;
+
+    return static_cast<int>(usage.ru_maxrss);
+#endif
+}
+
+// Hands out the access units of a mapped file in place, the others through
+// |buffer|.
+bool readAccessUnit(CESReader* reader, vector<uint8>* buffer,
+                    const uint8** data, int* size)
+{
+    const int paddingSize = CFFMPEG::GetInputBufferPaddingSize();
+    if (reader->IsMapped())
+        return reader->MapAccessUnit(paddingSize, data, size);
+
+    if (!reader->ReadAccessUnit(buffer, paddingSize, size))
+        return false;
+
+    *data = &(*buffer)[0];
+    return true;
+}
+
+shared_ptr<CCodecContext> createCodec(const TOptions& options,
+                                      const vector<uint8>& extraData)
+{
+    const int fourCC = makeFourCC(options.NALLength ? "avc1" : "H264");
+    return CFFMPEG::CreateCodec(
+        fourCC, 0, 0, options.NALLength,
+        extraData.empty() ? NULL : &extraData[0],
+        static_cast<int>(extraData.size()));
+}
+
+// Leaves |picture| empty if the output format is none.
+bool outputFrame(const TOptions& options, const CCodecContext& codec,
+                 const CVideoFrame& frame, CSWScale* scale,
+                 vector<uint8>* picture)
+{
+    if (!strcmp(options.OutputFormat, "none"))
+        return true;
+
+    int left;
+    int top;
+    int width;
+    int height;
+    codec.GetVisibleRect(&left, &top, &width, &height);
+    const string format(options.OutputFormat);
+    char code[5] = {0};
+    for (int i = 0; i < 4; ++i)
+        code[i] = static_cast<char>(toupper(format[i]));
+
+    if (!scale->Init(codec, width, height, makeFourCC(code)))
+        return false;
+
+    picture->resize(getOutputSize(options.OutputFormat, width, height));
+    return scale->Convert(frame, &(*picture)[0]);
+}
+
+// |frameDigests| may be NULL if the per picture hashes aren't wanted. Returns
+// the time it took, which the runs don't count.
+int64 hashPicture(const vector<uint8>& picture, MD5Context* digest,
+                  vector<string>* frameDigests)
+{
+    if (picture.empty())
+        return 0;
+
+    const base::TimeTicks begin = base::TimeTicks::HighResNow();
+    MD5Update(digest, &picture[0], picture.size());
+    if (frameDigests)
+    {
+        MD5Digest md5;
+        MD5Sum(&picture[0], picture.size(), &md5);
+        frameDigests->push_back(MD5DigestToBase16(md5));
+    }
+
+    return (base::TimeTicks::HighResNow() - begin).InMicroseconds();
+}
+
+void markFirstFrame(const base::TimeTicks& start, TRunResult* result)
+{
+    result->FirstFrameTime =
+        (base::TimeTicks::HighResNow() - start).InMicroseconds();
+}
+
+// Empty packets push out the pictures still waiting to be reordered.
+// |hashTime| adds up the time hashPicture() took.
+bool drainCodec(const TOptions& options, CCodecContext* codec,
+                CVideoFrame* frame, CSWScale* scale, vector<uint8>* picture,
+                MD5Context* digest, vector<string>* frameDigests,
+                const base::TimeTicks& start, TRunResult* result,
+                int64* hashTime)
+{
+    for (;;)
+    {
+        codec->Decode(frame, NULL, 0);
+        if (!frame->IsComplete())
+            return true;
+
+        if (!outputFrame(options, *codec, *frame, scale, picture))
+            return false;
+
+        if (!result->Frames++)
+            markFirstFrame(start, result);
+
+        *hashTime += hashPicture(*picture, digest, frameDigests);
+    }
+}
+
+// Of the SPS |parser| knows, 0 before there is one.
+void getCodedSize(const CH264PictureParser& parser, int* width, int* height)
+{
+    if (!parser.GetCodedSize(width, height))
+    {
+        *width = 0;
+        *height = 0;
+    }
+}
+
+bool runSoftware(const TOptions& options, const vector<uint8>& extraData,
+                 CESReader* reader, bool hashFrames, TRunResult* result)
+{
+    // Set up the way CH264SWDecoder::Init() does it.
+    const base::TimeTicks setup = base::TimeTicks::HighResNow();
+    shared_ptr<CCodecContext> codec = createCodec(options, extraData);
+    if (!codec)
+        return false;
+
+    CH264PictureParser parser;
+    parser.Init(extraData.empty() ? NULL : &extraData[0],
+                static_cast<int>(extraData.size()), options.NALLength);
+    int width;
+    int height;
+    getCodedSize(parser, &width, &height);
+    scoped_ptr<CThreadBudget::CClient> budget;
+    if (options.ThreadBudget)
+    {
+        budget.reset(new CThreadBudget::CClient(options.FrameRate));
+        budget->Apply(codec.get(), width, height);
+    }
+    else
+    {
+        codec->SetThreadNumber(options.Threads);
+    }
+
+    result->SetupTime =
+        (base::TimeTicks::HighResNow() - setup).InMicroseconds();
+
+    CVideoFrame frame;
+    CSWScale scale;
+    scale.SetThreadCount(budget ? budget->GetThreadCount() : options.Threads);
+    vector<uint8> accessUnit;
+    vector<uint8> picture;
+    MD5Context digest;
+    MD5Init(&digest);
+    vector<string>* frameDigests = hashFrames ? &result->FrameDigests : NULL;
+
+    const int64 bytesCopied = reader->GetBytesCopied();
+    int64 hashTime = 0;
+    const base::TimeTicks start = base::TimeTicks::HighResNow();
+    bool decoding = false;
+    const uint8* data;
+    int size;
+    while (readAccessUnit(reader, &accessUnit, &data, &size))
+    {
+        const base::TimeTicks begin = base::TimeTicks::HighResNow();
+        CH264PictureParser::TPicture pictures[4];
+        const int count = parser.Parse(data, size, pictures,
+                                       arraysize(pictures));
+        bool startsIDR = false;
+        for (int i = 0; i < count; ++i)
+            startsIDR = startsIDR || pictures[i].IDR;
+
+        // As CH264SWDecoder::Decode() does it: before the first access unit,
+        // whose SPS an Annex-B stream may only carry in band, and at the IDR
+        // pictures after the budget has moved.
+        getCodedSize(parser, &width, &height);
+        if (budget && decoding && startsIDR &&
+            budget->IsOutdated(width, height))
+        {
+            if (!drainCodec(options, codec.get(), &frame, &scale, &picture,
+                            &digest, frameDigests, start, result,
+                            &hashTime))
+                return false;
+
+            codec->FlushBuffers();
+            decoding = false;
+        }
+
+        if (budget && !decoding &&
+            budget->Apply(codec.get(), width, height))
+            scale.SetThreadCount(budget->GetThreadCount());
+
+        decoding = true;
+        codec->Decode(&frame, data, size);
+        const bool complete = frame.IsComplete();
+        if (complete)
+        {
+            if (!outputFrame(options, *codec, frame, &scale, &picture))
+                return false;
+
+            if (!result->Frames++)
+                markFirstFrame(start, result);
+        }
+
+        result->Latencies.push_back(
+            (base::TimeTicks::HighResNow() - begin).InMicroseconds());
+        if (complete)
+            hashTime += hashPicture(picture, &digest, frameDigests);
+    }
+
+    if (!drainCodec(options, codec.get(), &frame, &scale, &picture, &digest,
+                    frameDigests, start, result, &hashTime))
+        return false;
+
+    result->TotalTime =
+        (base::TimeTicks::HighResNow() - start).InMicroseconds() - hashTime;
+    result->BytesCopied = reader->GetBytesCopied() - bytesCopied;
+    result->AccessUnits = reader->GetAccessUnitCount();
+
+    int left;
+    int top;
+    codec->GetVisibleRect(&left, &top, &result->Width, &result->Height);
+    MD5Digest md5;
+    MD5Final(&md5, &digest);
+    result->Digest = MD5DigestToBase16(md5);
+    return true;
+}
+
+bool runPicParams(const TOptions& options, const vector<uint8>& extraData,
+                  CESReader* reader, bool hashFrames, TRunResult* result)
+{
+    const base::TimeTicks setup = base::TimeTicks::HighResNow();
+    shared_ptr<CCodecContext> preDecode = createCodec(options, extraData);
+    if (!preDecode)
+        return false;
+
+    CStandInAccelerator accelerator;
+    accelerator.Init(preDecode);
+    result->SetupTime =
+        (base::TimeTicks::HighResNow() - setup).InMicroseconds();
+
+    vector<uint8> accessUnit;
+    const int64 bytesCopied = reader->GetBytesCopied();
+    const base::TimeTicks start = base::TimeTicks::HighResNow();
+    const uint8* data;
+    int size;
+    while (readAccessUnit(reader, &accessUnit, &data, &size))
+    {
+        const base::TimeTicks begin = base::TimeTicks::HighResNow();
+        if (accelerator.DecodeAccessUnit(data, size))
+        {
+            if (!result->Frames++)
+                markFirstFrame(start, result);
+
+            if (hashFrames)
+            {
+                result->FrameDigests.push_back(
+                    MD5DigestToBase16(accelerator.GetPictureDigest()));
+            }
+        }
+
+        result->Latencies.push_back(
+            (base::TimeTicks::HighResNow() - begin).InMicroseconds());
+    }
+
+    result->TotalTime =
+        (base::TimeTicks::HighResNow() - start).InMicroseconds();
+    result->BytesCopied = reader->GetBytesCopied() - bytesCopied;
+    result->AccessUnits = reader->GetAccessUnitCount();
+
+    int left;
+    int top;
+    preDecode->GetVisibleRect(&left, &top, &result->Width, &result->Height);
+    MD5Digest md5;
+    accelerator.GetDigest(&md5);
+    result->Digest = MD5DigestToBase16(md5);
+    return true;
+}
+
+// Decodes one of the streams of a run.
+class CStreamThread : public PlatformThread::Delegate
+{
+public:
+    CStreamThread(const TOptions& options, const vector<uint8>& extraData,
+                  CESReader* reader, bool hashFrames, TRunResult* result)
+        : m_options(options)
+        , m_extraData(extraData)
+        , m_reader(reader)
+        , m_hashFrames(hashFrames)
+        , m_result(result)
+        , m_succeeded(false)
+        , m_thread()
+    {
+    }
+
+    bool Start() { return PlatformThread::Create(0, this, &m_thread); }
+    bool Join()
+    {
+        PlatformThread::Join(m_thread);
+        return m_succeeded;
+    }
+
+    virtual void ThreadMain()
+    {
+        m_reader->Rewind();
+        m_succeeded = m_options.PicParams ?
+            runPicParams(m_options, m_extraData, m_reader, m_hashFrames,
+                         m_result) :
+            runSoftware(m_options, m_extraData, m_reader, m_hashFrames,
+                        m_result);
+    }
+
+private:
+    const TOptions& m_options;
+    const vector<uint8>& m_extraData;
+    CESReader* m_reader;
+    bool m_hashFrames;
+    TRunResult* m_result;
+    bool m_succeeded;
+    PlatformThreadHandle m_thread;
+};
+
+// Runs a copy of the stream per reader at the same time. |result| receives
+// the first stream's figures and the aggregate ones.
+bool runStreams(const TOptions& options, const vector<uint8>& extraData,
+                const vector<shared_ptr<CESReader> >& readers,
+                bool hashFrames, TRunResult* result)
+{
+    vector<TRunResult> streamResults(readers.size(), *result);
+    vector<shared_ptr<CStreamThread> > threads;
+    const base::TimeTicks start = base::TimeTicks::HighResNow();
+    bool succeeded = true;
+    for (int i = 0; i < static_cast<int>(readers.size()); ++i)
+    {
+        shared_ptr<CStreamThread> thread(
+            new CStreamThread(options, extraData, readers[i].get(),
+                              hashFrames && !i, &streamResults[i]));
+        if (!thread->Start())
+        {
+            succeeded = false;
+            break;
+        }
+
+        threads.push_back(thread);
+    }
+
+    for (int i = 0; i < static_cast<int>(threads.size()); ++i)
+        succeeded = threads[i]->Join() && succeeded;
+
+    const int64 wallTime =
+        (base::TimeTicks::HighResNow() - start).InMicroseconds();
+    if (!succeeded)
+        return false;
+
+    *result = streamResults[0];
+    result->AggregateFrames = 0;
+    for (int i = 0; i < static_cast<int>(streamResults.size()); ++i)
+        result->AggregateFrames += streamResults[i].Frames;
+
+    result->WallTime = wallTime;
+    return true;
+}
+
+double getPercentile(const vector<int64>& sorted, int percentile)
+{
+    if (sorted.empty())
+        return 0.0;
+
+    const int index = std::min(
+        static_cast<int>(sorted.size()) - 1,
+        static_cast<int>(sorted.size()) * percentile / 100);
+    return sorted[index] / 1000.0;
+}
+
+double getFps(const TRunResult& result)
+{
+    return result.TotalTime ?
+        result.Frames * 1000000.0 / result.TotalTime : 0.0;
+}
+
+double getBytesCopiedPerAccessUnit(const TRunResult& result)
+{
+    return result.AccessUnits ?
+        static_cast<double>(result.BytesCopied) / result.AccessUnits : 0.0;
+}
+
+double getAggregateFps(const TRunResult& result)
+{
+    return result.WallTime ?
+        result.AggregateFrames * 1000000.0 / result.WallTime : 0.0;
+}
+
+// Sorts the latencies, which the JSON output relies on.
+void printResult(int run, int streams, TRunResult* result)
+{
+    std::sort(result->Latencies.begin(), result->Latencies.end());
+    const double fps = getFps(*result);
+    printf("run %d: %d frames in %.1f ms, %.1f fps, latency p50 %.3f ms "
+           "p90 %.3f ms p99 %.3f ms max %.3f ms, setup %.3f ms, "
+           "first frame %.3f ms, peak RSS %d KB, "
+           "%.0f bytes copied per access unit, md5 %s\n",
+           run, result->Frames, result->TotalTime / 1000.0, fps,
+           getPercentile(result->Latencies, 50),
+           getPercentile(result->Latencies, 90),
+           getPercentile(result->Latencies, 99),
+           getPercentile(result->Latencies, 100),
+           result->SetupTime / 1000.0, result->FirstFrameTime / 1000.0,
+           getPeakRSS(),
+           getBytesCopiedPerAccessUnit(*result), result->Digest.c_str());
+    if (streams > 1)
+    {
+        printf("  %d streams: %d frames in %.1f ms, aggregate %.1f fps\n",
+               streams, result->AggregateFrames, result->WallTime / 1000.0,
+               getAggregateFps(*result));
+    }
+}
+
+void appendJSONString(const char* text, string* json)
+{
+    json->push_back('"');
+    for (const char* c = text; *c; ++c)
+    {
+        if ((*c == '"') || (*c == '\\'))
+            json->push_back('\\');
+
+        json->push_back(*c);
+    }
+
+    json->push_back('"');
+}
+
+// Latencies of |results| must have been sorted by printResult().
+void appendJSON(const TOptions& options, int accessUnits, int peakRSS,
+                const vector<TRunResult>& results, string* json)
+{
+    json->append("{\n  \"stream\": ");
+    appendJSONString(options.FileName, json);
+    StringAppendF(json,
+                  ",\n  \"mode\": \"%s\", \"threads\": %d, "
+                  "\"thread_budget\": %s, \"streams\": %d, \"mmap\": %s, "
+                  "\"access_units\": %d,\n  \"width\": %d, \"height\": %d, "
+                  "\"peak_rss_kb\": %d,\n  \"runs\": [\n",
+                  options.PicParams ? "pic_params" : options.OutputFormat,
+                  options.Threads, options.ThreadBudget ? "true" : "false",
+                  options.Streams, options.Mapped ? "true" : "false",
+                  accessUnits,
+                  results.empty() ? 0 : results[0].Width,
+                  results.empty() ? 0 : results[0].Height, peakRSS);
+    for (int i = 0; i < static_cast<int>(results.size()); ++i)
+    {
+        const TRunResult& r = results[i];
+        StringAppendF(json,
+                      "    {\"frames\": %d, \"time_ms\": %.3f, "
+                      "\"fps\": %.2f, \"latency_p50_ms\": %.3f, "
+                      "\"latency_p90_ms\": %.3f, \"latency_p99_ms\": %.3f, "
+                      "\"latency_max_ms\": %.3f, \"aggregate_fps\": %.2f, "
+                      "\"setup_ms\": %.3f, \"first_frame_ms\": %.3f, "
+                      "\"bytes_copied_per_au\": %.1f, \"md5\": \"%s\"}%s\n",
+                      r.Frames, r.TotalTime / 1000.0, getFps(r),
+                      getPercentile(r.Latencies, 50),
+                      getPercentile(r.Latencies, 90),
+                      getPercentile(r.Latencies, 99),
+                      getPercentile(r.Latencies, 100), getAggregateFps(r),
+                      r.SetupTime / 1000.0, r.FirstFrameTime / 1000.0,
+                      getBytesCopiedPerAccessUnit(r), r.Digest.c_str(),
+                      (i + 1 < static_cast<int>(results.size())) ? "," : "");
+    }
+
+    json->append("  ]\n}\n");
+}
+
+bool writeFile(const char* fileName, const string& data)
+{
+    FILE* file = fopen(fileName, "wb");
+    if (!file)
+        return false;
+
+    const bool succeeded =
+        (fwrite(data.data(), 1, data.size(), file) == data.size());
+    fclose(file);
+    return succeeded;
+}
+}
+
+int main(int argc, char** argv)
+{
+    base::AtExitManager exitManager;
+
+    TOptions options;
+    if (!parseOptions(argc, argv, &options))
+    {
+        printUsage();
+        return 1;
+    }
+
+    if (strcmp(options.OutputFormat, "none") &&
+        !getOutputSize(options.OutputFormat, 2, 2))
+    {
+        fprintf(stderr, "unknown output format %s\n", options.OutputFormat);
+        return 1;
+    }
+
+    if (options.FrameDigestFile && !options.PicParams &&
+        !strcmp(options.OutputFormat, "none"))
+    {
+        fprintf(stderr, "--frame-md5 needs an output format\n");
+        return 1;
+    }
+
+    vector<uint8> extraData;
+    if (options.ExtraDataFile && !readFile(options.ExtraDataFile, &extraData))
+    {
+        fprintf(stderr, "cannot read %s\n", options.ExtraDataFile);
+        return 1;
+    }
+
+    // Every stream gets a reader of its own, a mapped one zeroes padding in
+    // place.
+    vector<shared_ptr<CESReader> > readers;
+    for (int i = 0; i < options.Streams; ++i)
+    {
+        shared_ptr<CESReader> reader(new CESReader);
+        const bool opened = options.Mapped ?
+            reader->Map(options.FileName, options.NALLength) :
+            reader->Open(options.FileName, options.NALLength);
+        if (!opened)
+        {
+            fprintf(stderr, "cannot read access units from %s\n",
+                    options.FileName);
+            return 1;
+        }
+
+        readers.push_back(reader);
+    }
+
+    const int accessUnits = readers[0]->GetAccessUnitCount();
+
+    // Registers the codecs.
+    CFFMPEG::get();
+
+    if (options.ThreadBudget)
+    {
+        printf("%s: %d access units, %s, thread budget over %d processors, "
+               "%d stream(s)\n", options.FileName, accessUnits,
+               options.PicParams ? "pic params" : options.OutputFormat,
+               CThreadBudget::get()->GetProcessorCount(), options.Streams);
+    }
+    else
+    {
+        printf("%s: %d access units, %s, %d thread(s), %d stream(s)\n",
+               options.FileName, accessUnits,
+               options.PicParams ? "pic params" : options.OutputFormat,
+               options.Threads, options.Streams);
+    }
+
+    vector<TRunResult> results(options.Runs);
+    for (int i = 0; i < options.Runs; ++i)
+    {
+        TRunResult& result = results[i];
+        result.Frames = 0;
+        result.TotalTime = 0;
+        result.SetupTime = 0;
+        result.FirstFrameTime = -1;
+        result.Width = 0;
+        result.Height = 0;
+        result.BytesCopied = 0;
+        result.AccessUnits = 0;
+        result.AggregateFrames = 0;
+        result.WallTime = 0;
+
+        // Later runs only add timings, the pictures are the same.
+        const bool hashFrames = options.FrameDigestFile && !i;
+        if (!runStreams(options, extraData, readers, hashFrames, &result))
+        {
+            fprintf(stderr, "run %d failed\n", i + 1);
+            return 1;
+        }
+
+        printResult(i + 1, options.Streams, &result);
+    }
+
+    if (options.FrameDigestFile)
+    {
+        const vector<string>& frameDigests = results[0].FrameDigests;
+        string digests;
+        for (int i = 0; i < static_cast<int>(frameDigests.size()); ++i)
+            digests.append(frameDigests[i] + "\n");
+
+        if (!writeFile(options.FrameDigestFile, digests))
+        {
+            fprintf(stderr, "cannot write %s\n", options.FrameDigestFile);
+            return 1;
+        }
+    }
+
+    if (options.JSONFile)
+    {
+        string json;
+        appendJSON(options, accessUnits, getPeakRSS(), results, &json);
+        if (!writeFile(options.JSONFile, json))
+        {
+            fprintf(stderr, "cannot write %s\n", options.JSONFile);
+            return 1;
+        }
+    }
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,145 @@
+#include "stand_in_accelerator.h"
+
+#include <cassert>
+#include <cstring>
+
+#include "ffmpeg.h"
+
+namespace
+{
+// As many slices as the DXVA1 decoder keeps room for.
+const int maxSlices = 16;
+
+// All 16 reference frames and the picture being decoded.
+const int surfaceCount = 17;
+
+// The builder adds a start code per slice and pads to 128 bytes.
+const int bitStreamMargin = maxSlices * 3 + 128;
+}
+
+CStandInAccelerator::CStandInAccelerator()
+    : m_preDecode()
+    , m_buildBitStream(NULL)
+    , m_picParams()
+    , m_sliceLong()
+    , m_bitStream()
+    , m_digest()
+    , m_pictureDigest()
+    , m_nextSurface(0)
+{
+}
+
+CStandInAccelerator::~CStandInAccelerator()
+{
+}
+
+void CStandInAccelerator::Init(
+    const boost::shared_ptr<CCodecContext>& preDecode)
+{
+    assert(preDecode);
+    m_preDecode = preDecode;
+
+    DXVA_Slice_H264_Long emptySliceLong = {0};
+    m_sliceLong.assign(maxSlices, emptySliceLong);
+    m_preDecode->SetSliceLong(&m_sliceLong[0]);
+    m_buildBitStream =
+        h264_detail::GetBitStreamBuilder(true, m_preDecode->GetNALLength());
+
+    // Same starting state as CH264DXVA1Decoder, without vendor tweaks.
+    memset(&m_picParams, 0, sizeof(m_picParams));
+    m_picParams.MbsConsecutiveFlag = 1;
+    m_picParams.ContinuationFlag = 1;
+    m_picParams.MinLumaBipredSize8x8Flag = 1;
+    for (int i = 0; i < arraysize(m_picParams.RefFrameList); ++i)
+    {
+        m_picParams.RefFrameList[i].AssociatedFlag = 1;
+        m_picParams.RefFrameList[i].bPicEntry = 255;
+        m_picParams.RefFrameList[i].Index7Bits = 127;
+    }
+
+    MD5Init(&m_digest);
+    m_nextSurface = 0;
+}
+
+bool CStandInAccelerator::DecodeAccessUnit(const void* data, int size)
+{
+    assert(m_preDecode);
+    if (!m_buildBitStream)
+        return false;
+
+    int framePOC;
+    int outPOC;
+    int64 startTime;
+    m_preDecode->PreDecodeBuffer(data, size, &framePOC, &outPOC, &startTime);
+
+    int fieldType;
+    int sliceType;
+    DXVA_Qmatrix_H264 scalingMatrix;
+    if (FAILED(h264_detail::BuildPicParams(m_preDecode.get(), &m_picParams,
+                                           &fieldType, &sliceType)))
+        return false;
+
+    if (FAILED(h264_detail::BuildScalingMatrix(m_preDecode.get(),
+                                               &scalingMatrix)))
+        return false;
+
+    h264_detail::SetCurrentPicIndex(getFreeSurfaceIndex(), &m_picParams,
+                                    m_preDecode.get());
+    m_picParams.StatusReportFeedbackNumber++;
+
+    // The slice control entries are filled in along with the bitstream.
+    if (static_cast<int>(m_bitStream.size()) < size + bitStreamMargin)
+        m_bitStream.resize(size + bitStreamMargin);
+
+    int bitStreamSize;
+    const int slices = m_buildBitStream(data, size, m_preDecode.get(),
+                                        &m_picParams, &m_sliceLong[0], NULL,
+                                        maxSlices, &m_bitStream[0],
+                                        &bitStreamSize);
+    if (slices <= 0)
+        return false;
+
+    // In the order CH264DXVA1Decoder executes the buffers.
+    MD5Context picture;
+    MD5Init(&picture);
+    const void* buffers[] = {
+        &m_picParams, &m_bitStream[0], &m_sliceLong[0], &scalingMatrix
+    };
+    const int sizes[] = {
+        sizeof(m_picParams), bitStreamSize,
+        static_cast<int>(sizeof(m_sliceLong[0])) * slices,
+        sizeof(scalingMatrix)
+    };
+    for (int i = 0; i < arraysize(buffers); ++i)
+    {
+        MD5Update(&m_digest, buffers[i], sizes[i]);
+        MD5Update(&picture, buffers[i], sizes[i]);
+    }
+
+    MD5Final(&m_pictureDigest, &picture);
+
+    h264_detail::UpdateRefFramesList(&m_picParams, m_preDecode.get());
+    return true;
+}
+
+void CStandInAccelerator::GetDigest(MD5Digest* digest)
+{
+    assert(digest);
+    MD5Final(digest, &m_digest);
+}
+
+// Surfaces are handed out in turn, skipping the ones still referenced.
+int CStandInAccelerator::getFreeSurfaceIndex()
+{
+    for (int i = 0; i < surfaceCount; ++i)
+    {
+        const int index = (m_nextSurface + i) % surfaceCount;
+        if (!m_preDecode->IsRefFrameInUse(index))
+        {
+            m_nextSurface = (index + 1) % surfaceCount;
+            return index;
+        }
+    }
+
+    return m_nextSurface;
+}
\ No newline at end of file
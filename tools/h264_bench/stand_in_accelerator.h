@@ -0,0 +1,50 @@
+#ifndef _STAND_IN_ACCELERATOR_H_
+#define _STAND_IN_ACCELERATOR_H_
+
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+#include "chromium/base/md5.h"
+#include "dxva_h264.h"
+#include "h264_detail.h"
+
+class CCodecContext;
+
+// Does the per picture work of the DXVA1 decoder up to the point where the
+// buffers would be handed to the accelerator: the pre-decode parse, the
+// pic-param, bitstream, slice control and scaling matrix builders and the
+// reference list updates. What would have been sent to the driver is hashed
+// instead, so runs can be compared for bit-exactness.
+class CStandInAccelerator
+{
+public:
+    CStandInAccelerator();
+    ~CStandInAccelerator();
+
+    void Init(const boost::shared_ptr<CCodecContext>& preDecode);
+
+    // Returns false if the access unit didn't carry a picture that could be
+    // parsed, e.g. before the first SPS/PPS.
+    bool DecodeAccessUnit(const void* data, int size);
+    void GetDigest(MD5Digest* digest);
+
+    // Hash of what the last successful DecodeAccessUnit() would have sent.
+    const MD5Digest& GetPictureDigest() const { return m_pictureDigest; }
+
+    const DXVA_PicParams_H264& GetPicParams() const { return m_picParams; }
+
+private:
+    int getFreeSurfaceIndex();
+
+    boost::shared_ptr<CCodecContext> m_preDecode;
+    h264_detail::BuildBitStreamFunc m_buildBitStream;
+    DXVA_PicParams_H264 m_picParams;
+    std::vector<DXVA_Slice_H264_Long> m_sliceLong;
+    std::vector<int8> m_bitStream;  // Stands in for the bitstream buffer
+    MD5Context m_digest;
+    MD5Digest m_pictureDigest;
+    int m_nextSurface;
+};
+
+#endif  // _STAND_IN_ACCELERATOR_H_
\ No newline at end of file
@@ -0,0 +1,319 @@
+#!/usr/bin/env python
+"""Runs reference bitstreams through h264_bench and checks them for
+bit-exactness and speed.
+
+    run_conformance.py --bench <h264_bench> --streams <dir> [options]
+      --manifest <file>    Stream list, may be repeated. The default is
+                           streams.json next to this script
+      --goldens <dir>      Per frame MD5 lists, default goldens/ next to this
+                           script
+      --results <dir>      Where the results of every run are kept, default
+                           conformance_results
+      --modes <list>       Comma separated subset of sw,pic_params
+      --runs <n>           Timed runs per stream and mode, default 3
+      --threads <n>        Decoding threads for the SW path, default 1
+      --filter <text>      Only streams whose name contains the text
+      --update-goldens     Write the goldens instead of checking them
+
+Every stream of the manifests is decoded through the SW path (YV12 output)
+and through the pic-param builders of the stand-in accelerator. The MD5 of
+every output picture is compared against goldens/<name>.<mode>.md5 and the
+best fps of the runs is recorded. A pic_params digest covers the pic params,
+the bitstream, every slice control entry and the scaling matrix. Goldens
+written before the digest last changed are reported as STALE. Each invocation leaves <timestamp>.json in
+the results directory and appends a line per stream and mode to history.csv,
+which is what trend plots are made from. The exit code is 1 if any stream
+mismatched, had no current golden or failed to decode.
+
+A manifest entry is {"name", "file"} with the optional keys "avcc" (NAL length
+of AVCC streams), "extradata" (file passed with --extradata), "modes" and
+"reference". "reference" names the 8-bit 4:2:0 I420 output of the reference
+decoder; --update-goldens then derives the SW goldens from it rather than
+from our own output. Paths are relative to the --streams directory. Captured
+streams that can't live in the repository go into a manifest of their own.
+"""
+
+import csv
+import datetime
+import hashlib
+import json
+import os
+import subprocess
+import sys
+import tempfile
+
+SCRIPT_DIR = os.path.dirname(os.path.abspath(__file__))
+MODES = ('sw', 'pic_params')
+
+# First line of the golden files, bumped whenever h264_bench changes what a
+# digest of the mode covers.
+DIGEST_VERSIONS = {
+    'sw': '# sw digest 1: YV12 picture',
+    'pic_params': '# pic_params digest 2: pic params, bitstream, all slice '
+                  'control entries, scaling matrix',
+}
+
+
+def parse_args(argv):
+    options = {
+        'bench': None,
+        'streams': None,
+        'manifests': [],
+        'goldens': os.path.join(SCRIPT_DIR, 'goldens'),
+        'results': 'conformance_results',
+        'modes': list(MODES),
+        'runs': 3,
+        'threads': 1,
+        'filter': '',
+        'update_goldens': False,
+    }
+    args = list(argv[1:])
+    while args:
+        arg = args.pop(0)
+        if arg == '--update-goldens':
+            options['update_goldens'] = True
+            continue
+
+        if not args or not arg.startswith('--'):
+            return None
+
+        value = args.pop(0)
+        if arg == '--bench':
+            options['bench'] = value
+        elif arg == '--streams':
+            options['streams'] = value
+        elif arg == '--manifest':
+            options['manifests'].append(value)
+        elif arg == '--goldens':
+            options['goldens'] = value
+        elif arg == '--results':
+            options['results'] = value
+        elif arg == '--modes':
+            options['modes'] = value.split(',')
+        elif arg == '--runs':
+            options['runs'] = int(value)
+        elif arg == '--threads':
+            options['threads'] = int(value)
+        elif arg == '--filter':
+            options['filter'] = value
+        else:
+            return None
+
+    if not options['bench'] or not options['streams']:
+        return None
+
+    if [m for m in options['modes'] if m not in MODES]:
+        return None
+
+    if not options['manifests']:
+        options['manifests'].append(os.path.join(SCRIPT_DIR, 'streams.json'))
+
+    return options
+
+
+def load_streams(options):
+    streams = []
+    for manifest in options['manifests']:
+        with open(manifest) as f:
+            streams.extend(json.load(f)['streams'])
+
+    return [s for s in streams if options['filter'] in s['name']]
+
+
+def get_revision():
+    try:
+        return subprocess.check_output(
+            ['git', 'rev-parse', '--short', 'HEAD'],
+            cwd=SCRIPT_DIR).decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        return 'unknown'
+
+
+def read_digests(file_name):
+    with open(file_name) as f:
+        return [line.strip() for line in f if line.strip()]
+
+
+# Returns the digests of a golden file, or None if it was written for another
+# digest version.
+def read_golden(file_name, mode):
+    lines = read_digests(file_name)
+    if not lines or lines[0] != DIGEST_VERSIONS[mode]:
+        return None
+
+    return lines[1:]
+
+
+def write_golden(file_name, mode, digests):
+    with open(file_name, 'w') as f:
+        f.write(''.join(line + '\n' for line in
+                        [DIGEST_VERSIONS[mode]] + digests))
+
+
+# YV12 keeps V before U, so the reference planes are swapped before hashing.
+def reference_digests(file_name, width, height):
+    luma = width * height
+    chroma = (width // 2) * (height // 2)
+    digests = []
+    with open(file_name, 'rb') as f:
+        while True:
+            frame = f.read(luma + chroma * 2)
+            if len(frame) < luma + chroma * 2:
+                break
+
+            y = frame[:luma]
+            u = frame[luma:luma + chroma]
+            v = frame[luma + chroma:]
+            digests.append(hashlib.md5(y + v + u).hexdigest())
+
+    return digests
+
+
+def run_bench(options, stream, mode, work_dir):
+    frame_md5 = os.path.join(work_dir, 'frames.md5')
+    result_json = os.path.join(work_dir, 'result.json')
+    command = [options['bench'], '--runs', str(options['runs']),
+               '--threads', str(options['threads']),
+               '--frame-md5', frame_md5, '--json', result_json]
+    if stream.get('avcc'):
+        command += ['--avcc', str(stream['avcc'])]
+
+    if stream.get('extradata'):
+        command += ['--extradata',
+                    os.path.join(options['streams'], stream['extradata'])]
+
+    command += ['--pic-params'] if mode == 'pic_params' else \
+        ['--output', 'yv12']
+    command.append(os.path.join(options['streams'], stream['file']))
+    with open(os.devnull, 'w') as null:
+        if subprocess.call(command, stdout=null):
+            return None, None
+
+    with open(result_json) as f:
+        return json.load(f), read_digests(frame_md5)
+
+
+def check_stream(options, stream, mode, work_dir):
+    entry = {'stream': stream['name'], 'mode': mode, 'status': 'ERROR',
+             'frames': 0, 'first_mismatch': None, 'fps': 0.0,
+             'deterministic': True, 'md5': ''}
+    result, digests = run_bench(options, stream, mode, work_dir)
+    if result is None:
+        return entry
+
+    runs = result['runs']
+    entry['frames'] = len(digests)
+    entry['fps'] = max(r['fps'] for r in runs)
+    entry['md5'] = runs[0]['md5']
+    entry['deterministic'] = len(set(r['md5'] for r in runs)) == 1
+    golden = os.path.join(options['goldens'],
+                          '%s.%s.md5' % (stream['name'], mode))
+    if options['update_goldens']:
+        if mode == 'sw' and stream.get('reference'):
+            digests = reference_digests(
+                os.path.join(options['streams'], stream['reference']),
+                result['width'], result['height'])
+
+        write_golden(golden, mode, digests)
+        entry['status'] = 'UPDATED'
+        return entry
+
+    if not os.path.exists(golden):
+        entry['status'] = 'MISSING'
+        return entry
+
+    expected = read_golden(golden, mode)
+    if expected is None:
+        entry['status'] = 'STALE'
+        return entry
+    mismatch = [i for i, (a, b) in enumerate(zip(expected, digests)) if a != b]
+    if mismatch:
+        entry['first_mismatch'] = mismatch[0]
+    elif len(expected) != len(digests):
+        entry['first_mismatch'] = min(len(expected), len(digests))
+
+    entry['status'] = 'PASS'
+    if entry['first_mismatch'] is not None or not entry['deterministic']:
+        entry['status'] = 'FAIL'
+
+    return entry
+
+
+def store_results(options, timestamp, revision, entries):
+    if not os.path.isdir(options['results']):
+        os.makedirs(options['results'])
+
+    # Runs started within the same second get a suffix.
+    file_name = os.path.join(options['results'], timestamp + '.json')
+    suffix = 1
+    while os.path.exists(file_name):
+        file_name = os.path.join(options['results'],
+                                 '%s-%d.json' % (timestamp, suffix))
+        suffix += 1
+
+    with open(file_name, 'w') as f:
+        json.dump({'timestamp': timestamp, 'revision': revision,
+                   'runs': options['runs'], 'threads': options['threads'],
+                   'results': entries}, f, indent=2)
+
+    history = os.path.join(options['results'], 'history.csv')
+    is_new = not os.path.exists(history)
+    with open(history, 'a') as f:
+        writer = csv.writer(f, lineterminator='\n')
+        if is_new:
+            writer.writerow(['timestamp', 'revision', 'stream', 'mode',
+                             'status', 'frames', 'fps'])
+
+        for e in entries:
+            writer.writerow([timestamp, revision, e['stream'], e['mode'],
+                             e['status'], e['frames'], '%.2f' % e['fps']])
+
+
+def main(argv):
+    options = parse_args(argv)
+    if not options:
+        sys.stderr.write(__doc__)
+        return 2
+
+    if options['update_goldens'] and not os.path.isdir(options['goldens']):
+        os.makedirs(options['goldens'])
+
+    timestamp = datetime.datetime.utcnow().strftime('%Y%m%dT%H%M%SZ')
+    revision = get_revision()
+    work_dir = tempfile.mkdtemp()
+    entries = []
+    try:
+        for stream in load_streams(options):
+            for mode in options['modes']:
+                if mode not in stream.get('modes', MODES):
+                    continue
+
+                entry = check_stream(options, stream, mode, work_dir)
+                entries.append(entry)
+                detail = ''
+                if entry['first_mismatch'] is not None:
+                    detail = '  first mismatch at frame %d' % \
+                        entry['first_mismatch']
+                elif not entry['deterministic']:
+                    detail = '  runs differ'
+
+                print('%-28s %-10s %-8s %6d frames %9.1f fps%s' % (
+                    entry['stream'], mode, entry['status'], entry['frames'],
+                    entry['fps'], detail))
+    finally:
+        for name in os.listdir(work_dir):
+            os.remove(os.path.join(work_dir, name))
+
+        os.rmdir(work_dir)
+
+    store_results(options, timestamp, revision, entries)
+    failed = [e for e in entries if e['status'] not in ('PASS', 'UPDATED')]
+    if failed:
+        print('%d of %d check(s) failed' % (len(failed), len(entries)))
+        return 1
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
\ No newline at end of file
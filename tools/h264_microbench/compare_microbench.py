@@ -0,0 +1,64 @@
+#!/usr/bin/env python
+"""Compares two h264_microbench JSON results.
+
+    compare_microbench.py <baseline.json> <candidate.json> [--threshold <pct>]
+
+Prints the change of the median time of every benchmark found in both files
+and exits with 1 if any got slower by more than the threshold (5% by
+default).
+"""
+
+import json
+import sys
+
+
+def load(file_name):
+    with open(file_name) as f:
+        return dict((b['name'], b) for b in json.load(f)['benchmarks'])
+
+
+def main(argv):
+    args = list(argv[1:])
+    threshold = 5.0
+    if '--threshold' in args:
+        i = args.index('--threshold')
+        threshold = float(args[i + 1])
+        del args[i:i + 2]
+
+    if len(args) != 2:
+        sys.stderr.write(__doc__)
+        return 2
+
+    baseline = load(args[0])
+    candidate = load(args[1])
+    regressions = 0
+    print('%-40s %12s %12s %8s' % ('benchmark', 'baseline ns', 'candidate ns',
+                                    'change'))
+    for name in sorted(set(baseline) | set(candidate)):
+        if name not in baseline or name not in candidate:
+            print('%-40s %s' % (name, 'only in ' +
+                                ('candidate' if name in candidate
+                                 else 'baseline')))
+            continue
+
+        before = baseline[name]['ns_per_run']
+        after = candidate[name]['ns_per_run']
+        change = (after - before) * 100.0 / before if before else 0.0
+        flag = ''
+        if change > threshold:
+            flag = '  REGRESSION'
+            regressions += 1
+
+        print('%-40s %12.1f %12.1f %+7.1f%%%s' % (name, before, after, change,
+                                                  flag))
+
+    if regressions:
+        print('%d benchmark(s) slower by more than %.1f%%' % (regressions,
+                                                              threshold))
+        return 1
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
\ No newline at end of file
@@ -0,0 +1,784 @@
+// Times the hot helpers of the decoder in isolation and writes the results
+// as JSON, for compare_microbench.py to diff against a baseline.
+//
+//   h264_microbench [options]
+//     --stream <file>      Recorded stream, Annex-B unless --avcc is given
+//     --avcc <1|2|4>       NAL length size of an AVCC stream
+//     --extradata <file>   avcC record or parameter sets of the stream
+//     --min-time <ms>      Time spent on each benchmark, default 500
+//     --output <file>      Where the JSON goes, default stdout
+//
+// The NAL parser and the bitstream builder always run on synthetic access
+// units, the P010 packing and preview reduction kernels on synthetic 1080p
+// and 4K pictures. A recorded stream adds the helpers that need parsed
+// parameter sets and a decoded picture. They run on the decoder state left
+// by the last access unit of the stream, and on its first decoded picture.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+#include "chromium/base/at_exit.h"
+#include "chromium/base/string_util.h"
+#include "chromium/base/time.h"
+#include "common/hardware_env.h"
+#include "es_reader.h"
+#include "ffmpeg.h"
+#include "h264_detail.h"
+#include "h264_nalu.h"
+#include "stand_in_accelerator.h"
+#include "sw_kernels.h"
+
+using std::vector;
+using std::string;
+using boost::shared_ptr;
+
+namespace
+{
+// Matches the slice control room of the DXVA1 decoder.
+const int maxSlices = 16;
+const int sampleCount = 7;
+
+// Keeps the results of the benchmarked calls alive.
+volatile int resultSink;
+
+int makeFourCC(const char* code)
+{
+    return static_cast<uint8>(code[0]) | (static_cast<uint8>(code[1]) << 8) |
+        (static_cast<uint8>(code[2]) << 16) |
+        (static_cast<uint8>(code[3]) << 24);
+}
+
+// Deterministic, so that runs on different commits see the same data.
+class CRandom
+{
+public:
+    explicit CRandom(uint32 seed) : m_state(seed) {}
+
+    int Next(int low, int high)
+    {
+        m_state = m_state * 1103515245 + 12345;
+        return low + static_cast<int>((m_state >> 8) % (high - low + 1));
+    }
+
+private:
+    uint32 m_state;
+};
+
+// |nalCount| slice NAL units of random sizes between |minSize| and |maxSize|,
+// with Annex-B start codes or |nalLength| byte lengths. Payloads hold no zero
+// byte, so no start code is emulated.
+void buildSyntheticAccessUnit(int nalCount, int minSize, int maxSize,
+                              int nalLength, vector<uint8>* accessUnit)
+{
+    CRandom random(nalLength + 1);
+    accessUnit->clear();
+    for (int i = 0; i < nalCount; ++i)
+    {
+        const int size = random.Next(minSize, maxSize);
+        if (nalLength)
+        {
+            for (int j = nalLength - 1; j >= 0; --j)
+                accessUnit->push_back(static_cast<uint8>(size >> (j * 8)));
+        }
+        else
+        {
+            const uint8 startCode[] = { 0, 0, 0, 1 };
+            accessUnit->insert(accessUnit->end(), startCode, startCode + 4);
+        }
+
+        accessUnit->push_back(0x41);   // Non-IDR slice, nal_ref_idc 2
+        for (int j = 1; j < size; ++j)
+            accessUnit->push_back(static_cast<uint8>(random.Next(1, 255)));
+    }
+}
+
+// A |width| x |height| plane of random samples of |bitDepth| bits, 16-bit
+// little endian above 8 bits.
+void buildSyntheticPlane(int width, int height, int bitDepth,
+                         vector<uint8>* plane)
+{
+    CRandom random(width * height + bitDepth);
+    const int maxSample = (1 << bitDepth) - 1;
+    plane->clear();
+    plane->reserve(width * height * ((bitDepth > 8) ? 2 : 1));
+    for (int i = 0; i < width * height; ++i)
+    {
+        const int sample = random.Next(0, maxSample);
+        plane->push_back(static_cast<uint8>(sample));
+        if (bitDepth > 8)
+            plane->push_back(static_cast<uint8>(sample >> 8));
+    }
+}
+
+bool hasSSE2()
+{
+    return !!(CHardwareEnv::get()->GetProcessorFeatures() &
+        CHardwareEnv::PROCESSOR_FEATURE_SSE2);
+}
+
+//------------------------------------------------------------------------------
+class CBenchmark
+{
+public:
+    explicit CBenchmark(const string& name) : m_name(name) {}
+    virtual ~CBenchmark() {}
+
+    const string& GetName() const { return m_name; }
+
+    // Input bytes a run goes through, 0 if throughput is meaningless.
+    virtual int GetBytesPerRun() const { return 0; }
+    virtual void Run() = 0;
+
+private:
+    string m_name;
+};
+
+class CNALUReadBenchmark : public CBenchmark
+{
+public:
+    CNALUReadBenchmark(const string& name, const vector<uint8>& accessUnit,
+                       int size, int nalLength)
+        : CBenchmark(name)
+        , m_accessUnit(accessUnit)
+        , m_size(size)
+        , m_nalLength(nalLength)
+    {
+    }
+
+    virtual int GetBytesPerRun() const { return m_size; }
+    virtual void Run()
+    {
+        CH264NALU nalu;
+        nalu.SetBuffer(&m_accessUnit[0], m_size, m_nalLength);
+        int total = 0;
+        while (nalu.ReadNext())
+            total += nalu.GetDataLength();
+
+        resultSink = total;
+    }
+
+private:
+    vector<uint8> m_accessUnit;
+    int m_size;
+    int m_nalLength;
+};
+
+class CBitStreamBenchmark : public CBenchmark
+{
+public:
+    CBitStreamBenchmark(const string& name, const vector<uint8>& accessUnit,
+                        int size, int nalLength, const CCodecContext* cont,
+                        const DXVA_PicParams_H264* picParams, bool longSlice)
+        : CBenchmark(name)
+        , m_accessUnit(accessUnit)
+        , m_size(size)
+        , m_nalLength(nalLength)
+        , m_cont(cont)
+        , m_picParams(picParams)
+        , m_sliceLong(maxSlices)
+        , m_sliceShort(maxSlices)
+        , m_longSlice(longSlice)
+        , m_dest(size + maxSlices * 4 + 128)
+        , m_build(h264_detail::GetBitStreamBuilder(longSlice, nalLength))
+    {
+    }
+
+    virtual int GetBytesPerRun() const { return m_size; }
+    virtual void Run()
+    {
+        int destSize;
+        resultSink = m_build(
+            &m_accessUnit[0], m_size, m_cont, m_picParams,
+            m_longSlice ? &m_sliceLong[0] : NULL,
+            m_longSlice ? NULL : &m_sliceShort[0], maxSlices, &m_dest[0],
+            &destSize);
+    }
+
+private:
+    vector<uint8> m_accessUnit;
+    int m_size;
+    int m_nalLength;
+    const CCodecContext* m_cont;
+    const DXVA_PicParams_H264* m_picParams;
+    vector<DXVA_Slice_H264_Long> m_sliceLong;
+    vector<DXVA_Slice_H264_Short> m_sliceShort;
+    bool m_longSlice;
+    vector<uint8> m_dest;
+    h264_detail::BuildBitStreamFunc m_build;   // Picked once, as in decoders
+};
+
+// Decoder state and pictures taken from a recorded stream.
+struct TRecording
+{
+    shared_ptr<CCodecContext> PreDecode;
+    CStandInAccelerator Accelerator;
+    vector<uint8> LastAccessUnit;
+    int LastAccessUnitSize;
+    int NALLength;
+    shared_ptr<CCodecContext> Codec;
+    CVideoFrame Frame;
+};
+
+class CPicParamsBenchmark : public CBenchmark
+{
+public:
+    explicit CPicParamsBenchmark(const TRecording* recording)
+        : CBenchmark("build_pic_params/recorded")
+        , m_recording(recording)
+        , m_picParams(recording->Accelerator.GetPicParams())
+    {
+    }
+
+    virtual void Run()
+    {
+        int fieldType;
+        int sliceType;
+        resultSink = h264_detail::BuildPicParams(
+            m_recording->PreDecode.get(), &m_picParams, &fieldType,
+            &sliceType);
+    }
+
+private:
+    const TRecording* m_recording;
+    DXVA_PicParams_H264 m_picParams;
+};
+
+class CScalingMatrixBenchmark : public CBenchmark
+{
+public:
+    explicit CScalingMatrixBenchmark(const TRecording* recording)
+        : CBenchmark("build_scaling_matrix/recorded")
+        , m_recording(recording)
+    {
+    }
+
+    virtual void Run()
+    {
+        DXVA_Qmatrix_H264 scalingMatrix;
+        resultSink = h264_detail::BuildScalingMatrix(
+            m_recording->PreDecode.get(), &scalingMatrix);
+        resultSink = scalingMatrix.bScalingLists4x4[0][0];
+    }
+
+private:
+    const TRecording* m_recording;
+};
+
+class CRefFrameSliceBenchmark : public CBenchmark
+{
+public:
+    explicit CRefFrameSliceBenchmark(const TRecording* recording)
+        : CBenchmark("update_ref_frame_slice_long/recorded")
+        , m_recording(recording)
+        , m_slice()
+    {
+    }
+
+    virtual void Run()
+    {
+        h264_detail::UpdateRefFrameSliceLong(
+            &m_recording->Accelerator.GetPicParams(),
+            m_recording->PreDecode.get(), &m_slice);
+        resultSink = m_slice.RefPicList[0][0].bPicEntry;
+    }
+
+private:
+    const TRecording* m_recording;
+    DXVA_Slice_H264_Long m_slice;
+};
+
+class CRefFramesListBenchmark : public CBenchmark
+{
+public:
+    explicit CRefFramesListBenchmark(const TRecording* recording)
+        : CBenchmark("update_ref_frames_list/recorded")
+        , m_recording(recording)
+        , m_picParams(recording->Accelerator.GetPicParams())
+    {
+    }
+
+    virtual void Run()
+    {
+        h264_detail::UpdateRefFramesList(&m_picParams,
+                                         m_recording->PreDecode.get());
+        resultSink = m_picParams.UsedForReferenceFlags;
+    }
+
+private:
+    const TRecording* m_recording;
+    DXVA_PicParams_H264 m_picParams;
+};
+
+class CConvertBenchmark : public CBenchmark
+{
+public:
+    CConvertBenchmark(const string& name, const TRecording* recording,
+                      int width, int height, int outSize)
+        : CBenchmark(name)
+        , m_recording(recording)
+        , m_scale()
+        , m_picture(outSize)
+        , m_width(width)
+        , m_height(height)
+    {
+    }
+
+    bool Init(int outFourCC)
+    {
+        // Every core, as in a single stream decoding with the whole budget.
+        m_scale.SetThreadCount(
+            CHardwareEnv::get()->GetNumOfLogicalProcessors());
+        return m_scale.Init(*m_recording->Codec, m_width, m_height, outFourCC);
+    }
+
+    virtual int GetBytesPerRun() const
+    {
+        return static_cast<int>(m_picture.size());
+    }
+
+    virtual void Run()
+    {
+        resultSink = m_scale.Convert(m_recording->Frame, &m_picture[0]);
+    }
+
+private:
+    const TRecording* m_recording;
+    CSWScale m_scale;
+    vector<uint8> m_picture;
+    int m_width;
+    int m_height;
+};
+
+// The kernels CSWScale runs per band, on one thread over a whole synthetic
+// 4:2:0 picture, so that the numbers don't depend on a recorded stream.
+class CPackP01xBenchmark : public CBenchmark
+{
+public:
+    CPackP01xBenchmark(const string& name, int width, int height,
+                       int bitDepth)
+        : CBenchmark(name)
+        , m_width(width)
+        , m_height(height)
+        , m_shift(16 - bitDepth)
+        , m_dest(width * height * 3)
+        , m_pack(sw_kernels::GetPackP01xFunc((bitDepth > 8) ? 2 : 1,
+                                             hasSSE2()))
+    {
+        const int bytesPerSample = (bitDepth > 8) ? 2 : 1;
+        for (int i = 0; i < arraysize(m_planes); ++i)
+        {
+            const int planeWidth = i ? (width / 2) : width;
+            const int planeHeight = i ? (height / 2) : height;
+            buildSyntheticPlane(planeWidth, planeHeight, bitDepth,
+                                &m_planes[i]);
+            m_planePointers[i] = &m_planes[i][0];
+            m_strides[i] = planeWidth * bytesPerSample;
+        }
+    }
+
+    virtual int GetBytesPerRun() const
+    {
+        return static_cast<int>(m_dest.size());
+    }
+
+    virtual void Run()
+    {
+        uint8* destY = &m_dest[0];
+        m_pack(m_planePointers, m_strides, destY,
+               destY + m_width * 2 * m_height, m_width * 2, m_width,
+               m_height, m_shift);
+        resultSink = m_dest[0];
+    }
+
+private:
+    int m_width;
+    int m_height;
+    int m_shift;
+    vector<uint8> m_planes[3];
+    const uint8* m_planePointers[3];
+    int m_strides[3];
+    vector<uint8> m_dest;
+    sw_kernels::PackP01xFunc m_pack;
+};
+
+class CReducePlanesBenchmark : public CBenchmark
+{
+public:
+    CReducePlanesBenchmark(const string& name, int width, int height,
+                           int shift)
+        : CBenchmark(name)
+        , m_width(width)
+        , m_height(height)
+        , m_shift(shift)
+        , m_dest((width >> shift) * (height >> shift) * 3 / 2)
+        , m_reduce(sw_kernels::GetReducePlaneFunc(shift, hasSSE2()))
+    {
+        for (int i = 0; i < arraysize(m_planes); ++i)
+            buildSyntheticPlane(i ? (width / 2) : width,
+                                i ? (height / 2) : height, 8, &m_planes[i]);
+    }
+
+    virtual int GetBytesPerRun() const
+    {
+        return static_cast<int>(m_dest.size());
+    }
+
+    virtual void Run()
+    {
+        uint8* dest = &m_dest[0];
+        for (int i = 0; i < arraysize(m_planes); ++i)
+        {
+            const int planeWidth = i ? (m_width / 2) : m_width;
+            const int planeHeight = i ? (m_height / 2) : m_height;
+            const int destWidth = planeWidth >> m_shift;
+            const int destHeight = planeHeight >> m_shift;
+            m_reduce(&m_planes[i][0], planeWidth, dest, destWidth, destWidth,
+                     destHeight);
+            dest += destWidth * destHeight;
+        }
+
+        resultSink = m_dest[0];
+    }
+
+private:
+    int m_width;
+    int m_height;
+    int m_shift;
+    vector<uint8> m_planes[3];
+    vector<uint8> m_dest;
+    sw_kernels::ReducePlaneFunc m_reduce;
+};
+
+//------------------------------------------------------------------------------
+struct TResult
+{
+    string Name;
+    int Iterations;
+    double NanosecondsPerRun;   // Median of the samples
+    double MinNanosecondsPerRun;
+    int BytesPerRun;
+};
+
+int64 timeRuns(CBenchmark* benchmark, int iterations)
+{
+    const base::TimeTicks start = base::TimeTicks::HighResNow();
+    for (int i = 0; i < iterations; ++i)
+        benchmark->Run();
+
+    return (base::TimeTicks::HighResNow() - start).InMicroseconds();
+}
+
+// Doubles the iterations until a sample takes its share of |minTime|, which
+// also warms up the caches, then keeps the median of the samples.
+void measure(CBenchmark* benchmark, int64 minTime, TResult* result)
+{
+    const int64 sampleTime = std::max<int64>(minTime / sampleCount, 1);
+    int iterations = 1;
+    while ((timeRuns(benchmark, iterations) < sampleTime) &&
+           (iterations < (1 << 30)))
+        iterations *= 2;
+
+    vector<double> samples;
+    for (int i = 0; i < sampleCount; ++i)
+        samples.push_back(
+            timeRuns(benchmark, iterations) * 1000.0 / iterations);
+
+    std::sort(samples.begin(), samples.end());
+    result->Name = benchmark->GetName();
+    result->Iterations = iterations;
+    result->NanosecondsPerRun = samples[sampleCount / 2];
+    result->MinNanosecondsPerRun = samples[0];
+    result->BytesPerRun = benchmark->GetBytesPerRun();
+}
+
+bool readFile(const char* fileName, vector<uint8>* data)
+{
+    FILE* file = fopen(fileName, "rb");
+    if (!file)
+        return false;
+
+    uint8 chunk[4096];
+    size_t read;
+    while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        data->insert(data->end(), chunk, chunk + read);
+
+    fclose(file);
+    return true;
+}
+
+bool loadRecording(const char* fileName, int nalLength,
+                   const vector<uint8>& extraData, TRecording* recording)
+{
+    CESReader reader;
+    if (!reader.Open(fileName, nalLength))
+        return false;
+
+    const int fourCC = makeFourCC(nalLength ? "avc1" : "H264");
+    const void* extra = extraData.empty() ? NULL : &extraData[0];
+    const int extraSize = static_cast<int>(extraData.size());
+    recording->PreDecode = CFFMPEG::CreateCodec(fourCC, 0, 0, nalLength, extra,
+                                                extraSize);
+    recording->Codec = CFFMPEG::CreateCodec(fourCC, 0, 0, nalLength, extra,
+                                            extraSize);
+    if (!recording->PreDecode || !recording->Codec)
+        return false;
+
+    recording->Accelerator.Init(recording->PreDecode);
+    recording->NALLength = nalLength;
+
+    // Decoding stops at the first picture so its buffers stay valid.
+    bool hasPicture = false;
+    bool parsed = false;
+    vector<uint8> accessUnit;
+    int size;
+    while (reader.ReadAccessUnit(&accessUnit,
+                                 CFFMPEG::GetInputBufferPaddingSize(), &size))
+    {
+        if (recording->Accelerator.DecodeAccessUnit(&accessUnit[0], size))
+        {
+            parsed = true;
+            recording->LastAccessUnit = accessUnit;
+            recording->LastAccessUnitSize = size;
+        }
+
+        if (!hasPicture)
+        {
+            recording->Codec->Decode(&recording->Frame, &accessUnit[0], size);
+            hasPicture = recording->Frame.IsComplete();
+        }
+    }
+
+    return parsed && hasPicture;
+}
+
+void addConvertBenchmarks(const TRecording* recording,
+                          vector<CBenchmark*>* benchmarks)
+{
+    struct TFormat
+    {
+        const char* Name;
+        const char* FourCC;
+        int Shift;              // Output size reduction
+        int BytesPerPixelX2;
+    };
+    const TFormat formats[] = {
+        { "convert/yv12/recorded", "YV12", 0, 3 },
+        { "convert/yv12_half/recorded", "YV12", 1, 3 },
+        { "convert/yv12_quarter/recorded", "YV12", 2, 3 },
+        { "convert/yuy2/recorded", "YUY2", 0, 4 },
+        { "convert/p010/recorded", "P010", 0, 6 },
+        { "convert/p016/recorded", "P016", 0, 6 }
+    };
+
+    int left;
+    int top;
+    int width;
+    int height;
+    recording->Codec->GetVisibleRect(&left, &top, &width, &height);
+    for (int i = 0; i < arraysize(formats); ++i)
+    {
+        const int outWidth = width >> formats[i].Shift;
+        const int outHeight = height >> formats[i].Shift;
+        CConvertBenchmark* benchmark = new CConvertBenchmark(
+            formats[i].Name, recording, outWidth, outHeight,
+            outWidth * outHeight * formats[i].BytesPerPixelX2 / 2);
+        if (!benchmark->Init(makeFourCC(formats[i].FourCC)))
+        {
+            fprintf(stderr, "%s: not supported for this stream\n",
+                    formats[i].Name);
+            delete benchmark;
+            continue;
+        }
+
+        benchmarks->push_back(benchmark);
+    }
+}
+
+void addSyntheticConvertBenchmarks(vector<CBenchmark*>* benchmarks)
+{
+    struct TSize
+    {
+        const char* Name;
+        int Width;
+        int Height;
+    };
+    const TSize sizes[] = {
+        { "1080p", 1920, 1080 },
+        { "4k", 3840, 2160 }
+    };
+
+    for (int i = 0; i < arraysize(sizes); ++i)
+    {
+        const string suffix = string("/") + sizes[i].Name + "/synthetic";
+        benchmarks->push_back(new CPackP01xBenchmark(
+            "convert/p010_from_10bit" + suffix, sizes[i].Width,
+            sizes[i].Height, 10));
+        benchmarks->push_back(new CPackP01xBenchmark(
+            "convert/p010_from_8bit" + suffix, sizes[i].Width,
+            sizes[i].Height, 8));
+        benchmarks->push_back(new CReducePlanesBenchmark(
+            "convert/yv12_half" + suffix, sizes[i].Width, sizes[i].Height,
+            1));
+        benchmarks->push_back(new CReducePlanesBenchmark(
+            "convert/yv12_quarter" + suffix, sizes[i].Width,
+            sizes[i].Height, 2));
+    }
+}
+
+void appendJSON(const vector<TResult>& results, string* json)
+{
+    json->append("{\n  \"benchmarks\": [\n");
+    for (int i = 0; i < static_cast<int>(results.size()); ++i)
+    {
+        const TResult& r = results[i];
+        const double bytesPerSecond = (r.BytesPerRun && r.NanosecondsPerRun) ?
+            r.BytesPerRun * 1000000000.0 / r.NanosecondsPerRun : 0.0;
+        StringAppendF(json,
+                      "    {\"name\": \"%s\", \"iterations\": %d, "
+                      "\"ns_per_run\": %.1f, \"min_ns_per_run\": %.1f, "
+                      "\"bytes_per_run\": %d, \"bytes_per_second\": %.0f}%s\n",
+                      r.Name.c_str(), r.Iterations, r.NanosecondsPerRun,
+                      r.MinNanosecondsPerRun, r.BytesPerRun, bytesPerSecond,
+                      (i + 1 < static_cast<int>(results.size())) ? "," : "");
+    }
+
+    json->append("  ]\n}\n");
+}
+}
+
+int main(int argc, char** argv)
+{
+    base::AtExitManager exitManager;
+
+    const char* streamFile = NULL;
+    const char* extraDataFile = NULL;
+    const char* outputFile = NULL;
+    int nalLength = 0;
+    int64 minTime = 500 * 1000;
+    for (int i = 1; i < argc; ++i)
+    {
+        const bool hasValue = (i + 1 < argc);
+        if (!strcmp(argv[i], "--stream") && hasValue)
+            streamFile = argv[++i];
+        else if (!strcmp(argv[i], "--avcc") && hasValue)
+            nalLength = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--extradata") && hasValue)
+            extraDataFile = argv[++i];
+        else if (!strcmp(argv[i], "--min-time") && hasValue)
+            minTime = atoi(argv[++i]) * 1000;
+        else if (!strcmp(argv[i], "--output") && hasValue)
+            outputFile = argv[++i];
+        else
+        {
+            fprintf(stderr,
+                    "usage: h264_microbench [--stream <file>] "
+                    "[--avcc <1|2|4>] [--extradata <file>]\n"
+                    "                       [--min-time <ms>] "
+                    "[--output <file>]\n");
+            return 1;
+        }
+    }
+
+    // Registers the codecs.
+    CFFMPEG::get();
+
+    vector<CBenchmark*> benchmarks;
+    const int paddingSize = CFFMPEG::GetInputBufferPaddingSize();
+    const int syntheticNALLengths[] = { 0, 2, 4 };
+    const char* syntheticNames[] = { "annexb", "avcc2", "avcc4" };
+    for (int i = 0; i < arraysize(syntheticNALLengths); ++i)
+    {
+        vector<uint8> accessUnit;
+        buildSyntheticAccessUnit(maxSlices, 200, 4000, syntheticNALLengths[i],
+                                 &accessUnit);
+        int size = static_cast<int>(accessUnit.size());
+        accessUnit.resize(size + paddingSize, 0);
+        benchmarks.push_back(new CNALUReadBenchmark(
+            string("nalu_read_next/") + syntheticNames[i] + "/synthetic",
+            accessUnit, size, syntheticNALLengths[i]));
+        benchmarks.push_back(new CBitStreamBenchmark(
+            string("build_bitstream/short/") + syntheticNames[i] +
+                "/synthetic",
+            accessUnit, size, syntheticNALLengths[i], NULL, NULL, false));
+
+        // Small slices, as low-latency encoders emit them, where the per NAL
+        // cost outweighs the copy.
+        buildSyntheticAccessUnit(maxSlices, 20, 120, syntheticNALLengths[i],
+                                 &accessUnit);
+        size = static_cast<int>(accessUnit.size());
+        accessUnit.resize(size + paddingSize, 0);
+        benchmarks.push_back(new CNALUReadBenchmark(
+            string("nalu_read_next/") + syntheticNames[i] + "/small_slices",
+            accessUnit, size, syntheticNALLengths[i]));
+        benchmarks.push_back(new CBitStreamBenchmark(
+            string("build_bitstream/short/") + syntheticNames[i] +
+                "/small_slices",
+            accessUnit, size, syntheticNALLengths[i], NULL, NULL, false));
+    }
+
+    addSyntheticConvertBenchmarks(&benchmarks);
+
+    TRecording recording;
+    if (streamFile)
+    {
+        vector<uint8> extraData;
+        if (extraDataFile && !readFile(extraDataFile, &extraData))
+        {
+            fprintf(stderr, "cannot read %s\n", extraDataFile);
+            return 1;
+        }
+
+        if (!loadRecording(streamFile, nalLength, extraData, &recording))
+        {
+            fprintf(stderr, "cannot decode %s\n", streamFile);
+            return 1;
+        }
+
+        benchmarks.push_back(new CNALUReadBenchmark(
+            "nalu_read_next/recorded", recording.LastAccessUnit,
+            recording.LastAccessUnitSize, nalLength));
+        benchmarks.push_back(new CBitStreamBenchmark(
+            "build_bitstream/short/recorded", recording.LastAccessUnit,
+            recording.LastAccessUnitSize, nalLength, NULL, NULL, false));
+        benchmarks.push_back(new CBitStreamBenchmark(
+            "build_bitstream/long/recorded", recording.LastAccessUnit,
+            recording.LastAccessUnitSize, nalLength,
+            recording.PreDecode.get(), &recording.Accelerator.GetPicParams(),
+            true));
+        benchmarks.push_back(new CPicParamsBenchmark(&recording));
+        benchmarks.push_back(new CScalingMatrixBenchmark(&recording));
+        benchmarks.push_back(new CRefFrameSliceBenchmark(&recording));
+        benchmarks.push_back(new CRefFramesListBenchmark(&recording));
+        addConvertBenchmarks(&recording, &benchmarks);
+    }
+
+    vector<TResult> results(benchmarks.size());
+    for (int i = 0; i < static_cast<int>(benchmarks.size()); ++i)
+    {
+        measure(benchmarks[i], minTime, &results[i]);
+        fprintf(stderr, "%-40s %12.1f ns\n", results[i].Name.c_str(),
+                results[i].NanosecondsPerRun);
+        delete benchmarks[i];
+    }
+
+    string json;
+    appendJSON(results, &json);
+    FILE* output = outputFile ? fopen(outputFile, "wb") : stdout;
+    if (!output)
+    {
+        fprintf(stderr, "cannot write %s\n", outputFile);
+        return 1;
+    }
+
+    fwrite(json.data(), 1, json.size(), output);
+    if (outputFile)
+        fclose(output);
+
+    return 0;
+}
\ No newline at end of file